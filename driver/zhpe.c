@@ -34,45 +34,91 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <linux/eventfd.h>
 #include <linux/fs.h>
+#include <linux/interval_tree.h>
 #include <linux/kernel.h>
 #include <linux/kmod.h>
 #include <linux/list.h>
+#include <linux/log2.h>
 #include <linux/miscdevice.h>
 #include <linux/mm.h>
+#include <linux/mmu_notifier.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
 #include <linux/poll.h>
+#include <linux/rbtree.h>
 #include <linux/sched.h>
 #include <linux/slab.h>
 #include <linux/version.h>
 #include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+
+#include <asm/tsc.h>
 
 #if LINUX_VERSION_CODE >=  KERNEL_VERSION(4, 11, 0)
+#include <linux/sched/mm.h>
 #include <linux/sched/signal.h>
 #include <linux/sched/task.h>
 #endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 17, 0)
+typedef int vm_fault_t;
+#endif
+
+/* The registration cache needs pin_user_pages() and range notifiers. */
+#define MR_CACHE        (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0))
 #include <zhpe.h>
 
 static const char driver_name[] = DRIVER_NAME;
 
+#if !defined(NDEBUG)
+/* kmalloc() and page accounting; the slabs keep their own statistics. */
 static atomic64_t       mem_total = ATOMIC64_INIT(0);
+#endif
+static atomic64_t       owner_seq = ATOMIC64_INIT(0);
+
+/* Slabs for the objects allocated on every request and queue. */
+static struct kmem_cache *io_cache;
+static struct kmem_cache *zmap_cache;
 
-#define DEBUG_TRACKER_SANE (0)
 
 static struct zmap *shared_zmap;
 static struct zhpe_shared_data *shared_data;
 
+/*
+ * zmaps are indexed by offset for mmap() and linked on their owner's list
+ * for release; both are protected by zmap_lock. Offsets are handed out
+ * in increasing order and never reused, leaving an unmapped page between
+ * entries; 63 bits of offset will not run out in real life.
+ */
 static DEFINE_SPINLOCK(zmap_lock);
-/* XXX: potentially 3000 entries, rbtree? */
-static LIST_HEAD(zmap_list);
+static struct rb_root   zmap_tree = RB_ROOT;
+static ulong            zmap_next_off;
+#define ZMAP_OFF_MAX    ((ulong)LONG_MAX & PAGE_MASK)
 #define ZMAP_BAD_OWNER  (ERR_PTR(-EACCES))
 
+/* Where the response of an io_entry goes; rd_list unless ioctl. */
+enum {
+    IO_RSP_READ         = 0,
+    IO_RSP_IOCTL_WAIT,
+    IO_RSP_IOCTL_DONE,
+    IO_RSP_IOCTL_GONE,
+    IO_RSP_RING,
+};
+
+struct zmr;
+
 struct io_entry {
     void                (*free)(const char *callf, uint line, void *ptr);
     atomic_t            count;
     bool                nonblock;
+    bool                cached;
+    uint8_t             rsp_state;
     struct zhpe_common_hdr hdr;
     struct file_data    *fdata;
+    struct zmr          *zmr;
     struct list_head    list;
     size_t              data_len;
     union {
@@ -86,36 +132,105 @@ enum {
     STATE_READY         = 2,
 };
 
+/*
+ * count is held by the zmap and by every vma that maps the pages. pgoff
+ * is the zmap's offset in pages: a vma split by mprotect() or munmap()
+ * has a larger vm_pgoff, so faults index from pgoff, not vm_pgoff.
+ */
 struct zpages {
+    struct list_head    list;
+    atomic_t            count;
+    ulong               pgoff;
     size_t              size;
+    bool                pool;
+    bool                contig;
     void                *pages[0];
 };
 
+/*
+ * Free queue page sets, kept per size so QALLOC can skip allocating and
+ * zeroing. Returned sets go on zpool_dirty and are zeroed by zpool_work
+ * before they move to their pool's clean list; count includes both.
+ */
+#define ZPOOL_SIZES     (16)
+
+struct zpool {
+    size_t              size;
+    bool                contig;
+    uint                count;
+    struct list_head    clean;
+};
+
+static DEFINE_SPINLOCK(zpool_lock);
+static LIST_HEAD(zpool_dirty);
+static struct zpool     zpools[ZPOOL_SIZES];
+
 struct zmap {
+    struct rb_node      node;
     struct list_head    list;
     struct file_data    *owner;
     ulong               offset;
     struct zpages       *zpages;
 };
 
+/*
+ * Control ring shared with user space; the kernel copies of the indices
+ * are authoritative and the ones in hdr are only published. The helper's
+ * ring runs the other way and uses sq_lock/sq_tail and cq_mutex/cq_head.
+ */
+struct cmd_ring {
+    struct zmap         *zmap;
+    struct zhpe_ring_hdr *hdr;
+    union zhpe_op       *sq;
+    union zhpe_op       *cq;
+    struct eventfd_ctx  *evfd;
+    struct mutex        sq_mutex;
+    spinlock_t          cq_lock;
+    spinlock_t          sq_lock;
+    struct mutex        cq_mutex;
+    uint32_t            entries;
+    uint32_t            sq_head;
+    uint32_t            cq_tail;
+    uint32_t            sq_tail;
+    uint32_t            cq_head;
+    uint32_t            inflight;
+};
+
 struct file_data {
     void                (*free)(const char *callf, uint line, void *ptr);
     atomic_t            count;
     uint8_t             state;
     spinlock_t          io_lock;
     wait_queue_head_t   io_wqh;
+    wait_queue_head_t   poll_wqh;
     struct list_head    rd_list;
+    struct list_head    zmap_list;
+    struct list_head    mr_list;
+    struct mr_cache     *mr_cache;
+    struct cmd_ring     *ring;
+    uint64_t            owner;
 };
 
-#define TRACKER_MAX     (256)
+#define TRACKER_MAX     (4096)
+
+/*
+ * Outstanding helper requests are indexed by a lock-free stack of free
+ * indices: tracker_free holds a generation tag in the upper 32 bits, to
+ * defeat ABA, and the top index in the lower; tracker_next[] links the
+ * rest. Index 0 is reserved.
+ */
+#define TRACKER_TAG_SHIFT (32)
+#define TRACKER_IDX_MASK ((1ULL << TRACKER_TAG_SHIFT) - 1)
 
 struct helper_data {
     struct file_data    fdata;
     struct task_struct  *task;
     wait_queue_head_t   tracker_wqh;
+    wait_queue_head_t   tracker_poll_wqh;
     uint                tracker_max;
-    uint                tracker_freecnt;
-    void                *tracker_free;
+    atomic_t            tracker_freecnt;
+    atomic64_t          tracker_free;
+    uint32_t            *tracker_next;
     struct io_entry     *tracker[0];
 };
 
@@ -131,8 +246,6 @@ static pid_t            helper_pid;
 static struct helper_data *helper_data;
 static DECLARE_WAIT_QUEUE_HEAD(helper_wqh);
 
-static DECLARE_WAIT_QUEUE_HEAD(poll_wqh);
-
 #define HELPER_EXIT_TIMEOUT (5 * HZ)
 
 static char *helper_path = "/sbin/zhpe_helper";
@@ -144,6 +257,19 @@ static char *backend = "libfabric";
 module_param(backend, charp, 0444);
 MODULE_PARM_DESC(backend, "backend transport: zhpe, libfabric (default)");
 
+/* Back each WQ and CQ ring with one physically contiguous block. */
+static bool queue_contig;
+module_param(queue_contig, bool, 0444);
+MODULE_PARM_DESC(queue_contig, "Allocate contiguous queue rings");
+
+static uint queue_pool = 8;
+module_param(queue_pool, uint, 0444);
+MODULE_PARM_DESC(queue_pool, "Free queue page sets kept per size");
+
+static uint mr_cache_max = 256;
+module_param(mr_cache_max, uint, 0444);
+MODULE_PARM_DESC(mr_cache_max, "Unused registrations cached per process");
+
 static uint tracker_max = TRACKER_MAX;
 module_param(tracker_max, uint, 0444);
 MODULE_PARM_DESC(tracker_max, "Maximum outstanding requests to helper");
@@ -159,6 +285,9 @@ static uint debug_flags;
 module_param_named(debug, debug_flags, uint, 0644);
 MODULE_PARM_DESC(debug, "debug output bitmask");
 
+#define debug_mem_add(_size) atomic64_add((_size), &mem_total)
+#define debug_mem_sub(_size) atomic64_sub((_size), &mem_total)
+
 #define  debug_cond(_mask,_cond,  _fmt, ...)            \
 do {                                                    \
     if ((debug_flags & (_mask)) && (_cond))             \
@@ -192,7 +321,7 @@ static void _do_kfree(const char *callf, uint line, void *ptr)
 
     ptr -= sizeof(void *);
     size = *(uintptr_t *)ptr;
-    atomic64_sub(size, &mem_total);
+    debug_mem_sub(size);
     debug(DEBUG_MEM, "%s:%s,%u:%s:ptr 0x%p size %lu\n",
           driver_name, callf, line, __FUNCTION__, ptr, size);
     kfree(ptr);
@@ -218,7 +347,7 @@ static void *_do_kmalloc(const char *callf, uint line,
         memset(ret, 0, size);
     debug(DEBUG_MEM, "%s:%s,%u:%s:ret 0x%p size %lu\n",
           driver_name, callf, line, __FUNCTION__, ret, size);
-    atomic64_add(size, &mem_total);
+    debug_mem_add(size);
     *(uintptr_t *)ret = size;
     ret += sizeof(void *);
 
@@ -237,7 +366,7 @@ static void _do_free_pages(const char *callf, uint line, void *ptr, int order)
         return;
 
     size = 1UL << (order + PAGE_SHIFT);
-    atomic64_sub(size, &mem_total);
+    debug_mem_sub(size);
     page = virt_to_page(ptr);
     (void)page;
     debug(DEBUG_MEM, "%s:%s,%u:%s:ptr/page/pfn 0x%p/0x%p/0x%lx size %lu\n",
@@ -258,14 +387,14 @@ static void *_do__get_free_pages(const char *callf, uint line,
 
     ret = (void *)__get_free_pages(flags, order);
     if (!ret) {
-        if (flags != GFP_ATOMIC)
+        if (flags != GFP_ATOMIC && !(flags & __GFP_NOWARN))
             printk(KERN_ERR "%s:%s,%u:%s:failed to allocate %lu bytes\n",
                    driver_name, callf, line, __FUNCTION__, size);
         return NULL;
     }
     if (zero)
         memset(ret, 0, size);
-    atomic64_add(size, &mem_total);
+    debug_mem_add(size);
     page = virt_to_page(ret);
     (void)page;
     debug(DEBUG_MEM, "%s:%s,%u:%s:ret/page/pfn 0x%p/0x%p/0x%lx size %lu\n",
@@ -338,8 +467,14 @@ static void _free_io_lists(const char *callf, uint line,
 #define free_io_lists(...) \
     _free_io_lists(__FUNCTION__, __LINE__, __VA_ARGS__)
 
+static void ring_free(struct cmd_ring *ring);
+static bool zpool_put(struct zpages *zpages);
+
 static void file_data_free(const char *callf, uint line, void *ptr)
 {
+    struct file_data    *fdata = ptr;
+
+    ring_free(fdata->ring);
     _do_kfree(callf, line, ptr);
 }
 
@@ -386,7 +521,9 @@ static void _zpages_free(const char *callf, uint line, struct zpages *zpages)
     size_t              i;
     struct page         *page;
 
-    if (!zpages)
+    if (!zpages || !atomic_dec_and_test(&zpages->count))
+        return;
+    if (zpages->pool && zpool_put(zpages))
         return;
 
     debug(DEBUG_MEM, "%s:%s,%u:%s:zpages 0x%p\n",
@@ -409,54 +546,70 @@ static void _zpages_free(const char *callf, uint line, struct zpages *zpages)
 #define zpages_free(...) \
     _zpages_free(__FUNCTION__, __LINE__, __VA_ARGS__)
 
+static inline struct zpages *zpages_get(struct zpages *zpages)
+{
+    atomic_inc(&zpages->count);
+
+    return zpages;
+}
+
+/*
+ * A contig allocation is one naturally aligned block with the pages past
+ * size given back; if the block isn't available, it quietly falls back
+ * to single pages.
+ */
 static struct zpages *_zpages_alloc(const char *callf, uint line,
                                     size_t size, bool contig)
 {
     struct zpages       *ret = NULL;
     int                 order = 0;
     size_t              npages;
-    size_t              i;
+    size_t              i = 0;
+    void                *ptr;
 
     debug(DEBUG_MEM, "%s:%s,%u:%s:size %lu contig %d\n",
           driver_name, callf, line, __FUNCTION__, size, contig);
 
-    if  (contig) {
-        order = get_order(size);
-        npages = 1UL << order;
-        size = npages << PAGE_SHIFT;
-    } else {
-        size = PAGE_ALIGN(size);
-        npages = size >> PAGE_SHIFT;
-    }
+    size = PAGE_ALIGN(size);
+    npages = size >> PAGE_SHIFT;
 
     ret = do_kmalloc(sizeof(*ret) + npages * sizeof(ret->pages[0]),
                      GFP_KERNEL, true);
     if (!ret || !npages)
         goto done;
 
+    INIT_LIST_HEAD(&ret->list);
+    atomic_set(&ret->count, 1);
     ret->size = size;
+    ret->pool = false;
+    ret->contig = contig;
     if (contig) {
-        ret->pages[0] = _do__get_free_pages(callf, line,
-                                            order, GFP_KERNEL | __GFP_ZERO,
+        order = get_order(size);
+        ptr = _do__get_free_pages(callf, line, order,
+                                  GFP_KERNEL | __GFP_ZERO | __GFP_NOWARN,
+                                  true);
+        if (ptr) {
+            split_page(virt_to_page(ptr), order);
+            for (; i < (1UL << order); i++, ptr += PAGE_SIZE) {
+                if (i < npages)
+                    ret->pages[i] = ptr;
+                else
+                    do_free_pages(ptr, 0);
+            }
+        } else
+            debug(DEBUG_MEM, "%s:%s,%u:%s:order %d failed, using pages\n",
+                  driver_name, callf, line, __FUNCTION__, order);
+    }
+    for (; i < npages; i++) {
+        ret->pages[i] = _do__get_free_pages(callf, line,
+                                            0, GFP_KERNEL | __GFP_ZERO,
                                             true);
-        i = 1;
-        if (ret->pages[0]) {
-            split_page(virt_to_page(ret->pages[0]), order);
-            for (; i < npages; i++)
-                ret->pages[i] = ret->pages[i - 1] + PAGE_SIZE;
-        }
-    } else {
-        for (i = 0; i < npages; i++) {
-            ret->pages[i] = _do__get_free_pages(callf, line,
-                                                0, GFP_KERNEL | __GFP_ZERO,
-                                                true);
-            if (!ret->pages[i])
-                break;
-        }
+        if (!ret->pages[i])
+            break;
     }
-    if (!ret->pages[i-1]) {
-        for (i = 0; i < npages; i++)
-            do_free_pages(ret->pages[i], 0);
+    if (i < npages) {
+        while (i > 0)
+            do_free_pages(ret->pages[--i], 0);
         do_kfree(ret);
         ret = NULL;
     }
@@ -471,6 +624,137 @@ static struct zpages *_zpages_alloc(const char *callf, uint line,
 #define zpages_alloc(...) \
     _zpages_alloc(__FUNCTION__, __LINE__, __VA_ARGS__)
 
+/* Must hold zpool_lock; if add, claim a free slot for a new size. */
+static struct zpool *zpool_find(size_t size, bool contig, bool add)
+{
+    struct zpool        *ret;
+    size_t              i;
+
+    for (i = 0; i < ARRAY_SIZE(zpools); i++) {
+        ret = &zpools[i];
+        if (ret->size == size && ret->contig == contig)
+            return ret;
+        if (!ret->size) {
+            if (!add)
+                break;
+            ret->size = size;
+            ret->contig = contig;
+            INIT_LIST_HEAD(&ret->clean);
+            return ret;
+        }
+    }
+
+    return NULL;
+}
+
+static void zpool_zero(struct work_struct *work)
+{
+    struct zpages       *zpages;
+    struct zpool        *pool;
+    size_t              npages;
+    size_t              i;
+    LIST_HEAD(dirty);
+
+    spin_lock(&zpool_lock);
+    list_splice_init(&zpool_dirty, &dirty);
+    spin_unlock(&zpool_lock);
+
+    while (!list_empty(&dirty)) {
+        zpages = list_first_entry(&dirty, struct zpages, list);
+        list_del(&zpages->list);
+        npages = zpages->size >> PAGE_SHIFT;
+        for (i = 0; i < npages; i++)
+            clear_page(zpages->pages[i]);
+        spin_lock(&zpool_lock);
+        pool = zpool_find(zpages->size, zpages->contig, false);
+        list_add(&zpages->list, &pool->clean);
+        spin_unlock(&zpool_lock);
+        cond_resched();
+    }
+}
+
+static DECLARE_WORK(zpool_work, zpool_zero);
+
+/* Take a zeroed page set from the pool or allocate one. */
+static struct zpages *zpool_get(size_t size, bool contig)
+{
+    struct zpages       *ret = NULL;
+    struct zpool        *pool;
+
+    size = PAGE_ALIGN(size);
+    spin_lock(&zpool_lock);
+    pool = zpool_find(size, contig, false);
+    if (pool && !list_empty(&pool->clean)) {
+        ret = list_first_entry(&pool->clean, struct zpages, list);
+        list_del_init(&ret->list);
+        pool->count--;
+    }
+    spin_unlock(&zpool_lock);
+    if (!ret)
+        ret = zpages_alloc(size, contig);
+    if (ret)
+        ret->pool = true;
+
+    return ret;
+}
+
+/*
+ * Queue a page set to be zeroed and pooled; false if it must be freed,
+ * because the pool is full or a page is still in use.
+ */
+static bool zpool_put(struct zpages *zpages)
+{
+    struct zpool        *pool;
+    struct page         *page;
+    size_t              npages;
+    size_t              i;
+
+    if (!queue_pool)
+        return false;
+    npages = zpages->size >> PAGE_SHIFT;
+    for (i = 0; i < npages; i++) {
+        page = virt_to_page(zpages->pages[i]);
+        if (page_count(page) != 1 || page_mapcount(page) != 0)
+            return false;
+    }
+
+    spin_lock(&zpool_lock);
+    pool = zpool_find(zpages->size, zpages->contig, true);
+    if (!pool || pool->count >= queue_pool) {
+        spin_unlock(&zpool_lock);
+        return false;
+    }
+    pool->count++;
+    atomic_set(&zpages->count, 1);
+    list_add_tail(&zpages->list, &zpool_dirty);
+    spin_unlock(&zpool_lock);
+    schedule_work(&zpool_work);
+
+    return true;
+}
+
+/* Free every pooled page set; only at exit. */
+static void zpool_drain(void)
+{
+    struct zpages       *zpages;
+    struct zpool        *pool;
+    size_t              i;
+
+    flush_work(&zpool_work);
+    for (i = 0; i < ARRAY_SIZE(zpools); i++) {
+        pool = &zpools[i];
+        if (!pool->size)
+            break;
+        while (!list_empty(&pool->clean)) {
+            zpages = list_first_entry(&pool->clean, struct zpages, list);
+            list_del(&zpages->list);
+            zpages->pool = false;
+            zpages_free(zpages);
+        }
+        pool->count = 0;
+    }
+}
+
 static void _zmap_free(const char *callf, uint line, struct zmap *zmap)
 {
     if (!zmap)
@@ -482,59 +766,97 @@ static void _zmap_free(const char *callf, uint line, struct zmap *zmap)
 
     if (zmap->zpages)
         zpages_free(zmap->zpages);
-    do_kfree(zmap);
+    kmem_cache_free(zmap_cache, zmap);
 }
 
 #define zmap_free(...) \
     _zmap_free(__FUNCTION__, __LINE__, __VA_ARGS__)
 
+static void zmap_insert(struct zmap *zmap)
+{
+    struct rb_node      **link = &zmap_tree.rb_node;
+    struct rb_node      *parent = NULL;
+    struct zmap         *cur;
+
+    while (*link) {
+        parent = *link;
+        cur = rb_entry(parent, struct zmap, node);
+        if (zmap->offset < cur->offset)
+            link = &parent->rb_left;
+        else
+            link = &parent->rb_right;
+    }
+    rb_link_node(&zmap->node, parent, link);
+    rb_insert_color(&zmap->node, &zmap_tree);
+}
+
+/* Must hold zmap_lock. */
+static struct zmap *zmap_find(ulong offset)
+{
+    struct rb_node      *node = zmap_tree.rb_node;
+    struct zmap         *cur;
+
+    while (node) {
+        cur = rb_entry(node, struct zmap, node);
+        if (offset < cur->offset)
+            node = node->rb_left;
+        else if (offset > cur->offset)
+            node = node->rb_right;
+        else
+            return cur;
+    }
+
+    return NULL;
+}
+
+/* Must hold zmap_lock. */
+static void zmap_remove(struct zmap *zmap)
+{
+    rb_erase(&zmap->node, &zmap_tree);
+    RB_CLEAR_NODE(&zmap->node);
+    list_del_init(&zmap->list);
+}
+
+static void zmap_set_owner(struct zmap *zmap, struct file_data *fdata)
+{
+    spin_lock(&zmap_lock);
+    zmap->owner = fdata;
+    if (fdata)
+        list_add_tail(&zmap->list, &fdata->zmap_list);
+    spin_unlock(&zmap_lock);
+}
+
 static struct zmap *_zmap_alloc(const char *callf, uint line,
                                struct zpages *zpages)
 {
     struct zmap         *ret;
-    struct zmap         *cur;
-    ulong               coff;
     size_t              size;
 
     debug(DEBUG_MEM, "%s:%s,%u:%s:zpages 0x%p\n",
           driver_name, callf, line, __FUNCTION__, zpages);
 
-    ret = _do_kmalloc(callf, line, sizeof(*ret), GFP_KERNEL, true);
+    ret = kmem_cache_zalloc(zmap_cache, GFP_KERNEL);
     if (!ret) {
-        ret = ERR_PTR(-EINVAL);
+        ret = ERR_PTR(-ENOMEM);
         goto done;
     }
 
+    RB_CLEAR_NODE(&ret->node);
     INIT_LIST_HEAD(&ret->list);
     ret->zpages = zpages;
     /* Set bad owner to keep entry from being used until ready. */
     ret->owner = ZMAP_BAD_OWNER;
-    /*
-     * Look for a hole in betwen entries; allow space for unmapped pages
-     * between entries.
-     */
-    size = zpages->size + PAGE_SIZE * 2;
-    coff = 0;
+    /* Allow space for an unmapped page after every entry. */
+    size = zpages->size + PAGE_SIZE;
     spin_lock(&zmap_lock);
-    list_for_each_entry(cur, &zmap_list, list) {
-        if (cur->offset - coff >= size)
-            break;
-        coff = cur->offset + cur->zpages->size;
-    }
-    /*
-     * cur will either point to a real entry before which we want to insert
-     * ret or &cur->list == head and we want to add ourselves at the tail.
-     *
-     * Can we wrap around in real life? Probably not.
-     */
-    if (coff < coff + size) {
-        ret->offset = coff;
-        if (coff)
-            ret->offset += PAGE_SIZE;
-        list_add_tail(&ret->list, &cur->list);
+    if (zmap_next_off <= ZMAP_OFF_MAX - size) {
+        ret->offset = zmap_next_off;
+        zpages->pgoff = ret->offset >> PAGE_SHIFT;
+        zmap_next_off += size;
+        zmap_insert(ret);
     }
     spin_unlock(&zmap_lock);
-    if (list_empty(&ret->list)) {
+    if (RB_EMPTY_NODE(&ret->node)) {
         _zmap_free(callf, line, ret);
         printk(KERN_ERR "%s:%s,%u:Out of file space.\n",
                driver_name, __FUNCTION__, __LINE__);
@@ -549,24 +871,44 @@ static struct zmap *_zmap_alloc(const char *callf, uint line,
 #define zmap_alloc(...) \
     _zmap_alloc(__FUNCTION__, __LINE__, __VA_ARGS__)
 
+/* Unlink and free a zmap that was never advertised. */
+static void zmap_release(struct zmap *zmap)
+{
+    spin_lock(&zmap_lock);
+    zmap_remove(zmap);
+    spin_unlock(&zmap_lock);
+    zmap_free(zmap);
+}
+
+/* Free the zmaps owned by fdata or, if fdata is NULL, all of them. */
 static bool _free_zmap_list(const char *callf, uint line,
                             struct file_data *fdata)
 {
     bool                ret = true;
     struct zmap         *zmap;
     struct zmap         *next;
+    struct rb_node      *node;
+    LIST_HEAD(free_list);
 
     debug(DEBUG_RELEASE, "%s:%s,%u:%s:fdata 0x%p\n",
           driver_name, callf, line, __FUNCTION__, fdata);
 
     spin_lock(&zmap_lock);
-    list_for_each_entry_safe(zmap, next, &zmap_list, list) {
-        if (!fdata || zmap->owner == fdata) {
-            list_del_init(&zmap->list);
-            zmap_free(zmap);
+    if (fdata) {
+        list_for_each_entry_safe(zmap, next, &fdata->zmap_list, list) {
+            zmap_remove(zmap);
+            list_add_tail(&zmap->list, &free_list);
+        }
+    } else {
+        while ((node = rb_first(&zmap_tree))) {
+            zmap = rb_entry(node, struct zmap, node);
+            zmap_remove(zmap);
+            list_add_tail(&zmap->list, &free_list);
         }
     }
     spin_unlock(&zmap_lock);
+    list_for_each_entry_safe(zmap, next, &free_list, list)
+        zmap_free(zmap);
 
     return ret;
 }
@@ -574,6 +916,156 @@ static bool _free_zmap_list(const char *callf, uint line,
 #define free_zmap_list(...) \
     _free_zmap_list(__FUNCTION__, __LINE__, __VA_ARGS__)
 
+static void ring_free(struct cmd_ring *ring)
+{
+    if (!ring)
+        return;
+
+    if (ring->hdr)
+        vunmap(ring->hdr);
+    if (ring->zmap)
+        zmap_release(ring->zmap);
+    if (ring->evfd)
+        eventfd_ctx_put(ring->evfd);
+    do_kfree(ring);
+}
+
+static int ring_alloc(struct file_data *fdata, uint32_t entries, int evfd)
+{
+    int                 ret = -EINVAL;
+    struct cmd_ring     *ring = NULL;
+    struct zpages       *zpages = NULL;
+    struct page         **pages = NULL;
+    struct zmap         *zmap;
+    size_t              sq_off;
+    size_t              cq_off;
+    size_t              size;
+    size_t              npages;
+    size_t              i;
+
+    if (!entries)
+        goto done;
+    entries = roundup_pow_of_two(entries);
+
+    ret = -ENOMEM;
+    ring = do_kmalloc(sizeof(*ring), GFP_KERNEL, true);
+    if (!ring)
+        goto done;
+    ring->zmap = NULL;
+    ring->hdr = NULL;
+    ring->evfd = NULL;
+    mutex_init(&ring->sq_mutex);
+    spin_lock_init(&ring->cq_lock);
+    spin_lock_init(&ring->sq_lock);
+    mutex_init(&ring->cq_mutex);
+    ring->entries = entries;
+    ring->sq_head = 0;
+    ring->cq_tail = 0;
+    ring->sq_tail = 0;
+    ring->cq_head = 0;
+    ring->inflight = 0;
+    if (evfd >= 0) {
+        ring->evfd = eventfd_ctx_fdget(evfd);
+        if (IS_ERR(ring->evfd)) {
+            ret = PTR_ERR(ring->evfd);
+            ring->evfd = NULL;
+            goto done;
+        }
+    }
+
+    sq_off = sizeof(struct zhpe_ring_hdr);
+    cq_off = sq_off + entries * sizeof(union zhpe_op);
+    size = PAGE_ALIGN(cq_off + entries * sizeof(union zhpe_op));
+    npages = size >> PAGE_SHIFT;
+    zpages = zpages_alloc(size, false);
+    if (!zpages)
+        goto done;
+    /* The driver needs a contiguous view of the ring, too. */
+    pages = do_kmalloc(npages * sizeof(*pages), GFP_KERNEL, false);
+    if (!pages)
+        goto done;
+    for (i = 0; i < npages; i++)
+        pages[i] = virt_to_page(zpages->pages[i]);
+    ring->hdr = vmap(pages, npages, VM_MAP, PAGE_KERNEL);
+    do_kfree(pages);
+    if (!ring->hdr)
+        goto done;
+    zmap = zmap_alloc(zpages);
+    if (IS_ERR(zmap)) {
+        ret = PTR_ERR(zmap);
+        goto done;
+    }
+    ring->zmap = zmap;
+    zpages = NULL;
+
+    /* The pages are zeroed, so all the indices start at 0. */
+    ring->hdr->entries = entries;
+    ring->hdr->sq_off = sq_off;
+    ring->hdr->cq_off = cq_off;
+    ring->sq = (void *)ring->hdr + sq_off;
+    ring->cq = (void *)ring->hdr + cq_off;
+
+    /* Owned by fdata, but freed with it rather than on release. */
+    spin_lock(&zmap_lock);
+    zmap->owner = fdata;
+    spin_unlock(&zmap_lock);
+
+    ret = -EEXIST;
+    spin_lock(&fdata->io_lock);
+    if (!fdata->ring) {
+        fdata->ring = ring;
+        ring = NULL;
+        ret = 0;
+    }
+    spin_unlock(&fdata->io_lock);
+
+ done:
+    if (ring && ring->hdr && zpages) {
+        vunmap(ring->hdr);
+        ring->hdr = NULL;
+    }
+    zpages_free(zpages);
+    ring_free(ring);
+
+    return ret;
+}
+
+/* Completions in the CQ user space hasn't consumed. */
+static inline uint32_t ring_cq_count(struct cmd_ring *ring)
+{
+    uint32_t            ret;
+
+    ret = ring->cq_tail - READ_ONCE(ring->hdr->cq_head);
+
+    return (ret > ring->entries ? ring->entries : ret);
+}
+
+static void ring_post(struct file_data *fdata, struct io_entry *entry)
+{
+    struct cmd_ring     *ring = fdata->ring;
+    union zhpe_op       *slot;
+
+    spin_lock(&ring->cq_lock);
+    slot = &ring->cq[ring->cq_tail & (ring->entries - 1)];
+    memcpy(slot, entry->data, entry->data_len);
+    memset((void *)slot + entry->data_len, 0,
+           sizeof(*slot) - entry->data_len);
+    smp_wmb();
+    ring->cq_tail++;
+    WRITE_ONCE(ring->hdr->cq_tail, ring->cq_tail);
+    ring->inflight--;
+    spin_unlock(&ring->cq_lock);
+    if (ring->evfd)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+        eventfd_signal(ring->evfd);
+#else
+        eventfd_signal(ring->evfd, 1);
+#endif
+    wake_up_all(&fdata->io_wqh);
+    wake_up_all(&fdata->poll_wqh);
+    put_io_entry(entry);
+}
+
 static inline void queue_io_entry_locked(struct file_data *fdata,
                                          struct list_head *head,
                                          struct io_entry *entry)
@@ -584,7 +1076,7 @@ static inline void queue_io_entry_locked(struct file_data *fdata,
     spin_unlock(&fdata->io_lock);
     wake_up(&fdata->io_wqh);
     if (wake)
-        wake_up_all(&poll_wqh);
+        wake_up_all(&fdata->poll_wqh);
 }
 
 static inline int queue_io_entry(struct file_data *fdata,
@@ -608,7 +1100,10 @@ static void io_free(const char *callf, uint line, void *ptr)
     struct io_entry     *entry = ptr;
 
     _put_file_data(callf, line, entry->fdata);
-    _do_kfree(callf, line, entry);
+    if (entry->cached)
+        kmem_cache_free(io_cache, entry);
+    else
+        _do_kfree(callf, line, entry);
 }
 
 static inline struct io_entry *_io_alloc(
@@ -617,17 +1112,23 @@ static inline struct io_entry *_io_alloc(
     void (*free)(const char *callf, uint line, void *ptr))
 {
     struct io_entry     *ret = NULL;
+    gfp_t               gfp = (nonblock ? GFP_ATOMIC : GFP_KERNEL);
+    bool                cached = (size <= sizeof(ret->op));
 
-    if (size < sizeof(ret->op))
-        size = sizeof(ret->op);
-    size += sizeof(*ret);
-    ret = do_kmalloc(size, (nonblock ? GFP_ATOMIC : GFP_KERNEL), false);
+    /* Anything that fits in the op comes from the slab. */
+    if (cached)
+        ret = kmem_cache_alloc(io_cache, gfp);
+    else
+        ret = _do_kmalloc(callf, line, size + sizeof(*ret), gfp, false);
     if (!ret)
         goto done;
 
     ret->free = free;
+    ret->cached = cached;
     atomic_set(&ret->count, 1);
     ret->nonblock = nonblock;
+    ret->rsp_state = IO_RSP_READ;
+    ret->zmr = NULL;
     ret->fdata = get_file_data(fdata);
     INIT_LIST_HEAD(&ret->list);
 
@@ -639,107 +1140,65 @@ static inline struct io_entry *_io_alloc(
 #define io_alloc(...) \
     _io_alloc(__FUNCTION__, __LINE__, __VA_ARGS__)
 
-#if DEBUG_TRACKER_SANE
-
-static bool tracker_sane_locked(const char *callf, uint line,
-                                struct helper_data *hdata)
+static uint tracker_alloc(struct helper_data *hdata)
 {
-    bool                ret = true;
-    uintptr_t           cur;
-    uint64_t            check[TRACKER_MAX / 64];
-    uint                i;
+    uint64_t            old;
+    uint64_t            new;
+    uint64_t            cur;
+    uint                ret;
 
-    memset(check, 0, sizeof(check));
-    for (i = 0, cur = (uintptr_t)hdata->tracker_free;
-         i < hdata->tracker_freecnt;
-         i++, cur = (uintptr_t)hdata->tracker[cur]) {
-        if (!cur)
-            break;
-        if (cur >= hdata->tracker_max)
+    old = atomic64_read(&hdata->tracker_free);
+    for (;;) {
+        ret = old & TRACKER_IDX_MASK;
+        if (!ret)
             break;
-        check[cur >> 6] |= (((uint64_t)1) << (cur & 63));
-    }
-    if (i != hdata->tracker_freecnt || (i && cur)) {
-        spin_unlock(&hdata->fdata.io_lock);
-        printk(KERN_ERR "%s:%s,%u:i %u free %u  cur %lu\n",
-               driver_name, callf, line, i, hdata->tracker_freecnt, cur);
-        spin_lock(&hdata->fdata.io_lock);
-        ret = false;
-        goto done;
-    }
-    for (i = 1; i < TRACKER_MAX; i++) {
-        if (!(check[i >> 6] & (((uint64_t)1) << (i & 63))) &&
-            (uintptr_t)hdata->tracker[i] < hdata->tracker_max)
+        new = (((old >> TRACKER_TAG_SHIFT) + 1) << TRACKER_TAG_SHIFT) |
+            READ_ONCE(hdata->tracker_next[ret]);
+        cur = atomic64_cmpxchg(&hdata->tracker_free, old, new);
+        if (cur == old) {
+            atomic_dec(&hdata->tracker_freecnt);
             break;
+        }
+        old = cur;
     }
-    if (i != TRACKER_MAX) {
-        spin_unlock(&hdata->fdata.io_lock);
-        printk(KERN_ERR "%s:%s,%u:i %u ptr 0x%lx\n",
-               driver_name, callf, line, i, (uintptr_t)hdata->tracker[i]);
-        spin_lock(&hdata->fdata.io_lock);
-        ret = false;
-        goto done;
-    }
- done:
-
-    return ret;
-}
-
-static bool tracker_sane(const char *callf, uint line,
-                         struct helper_data *hdata)
-{
-    bool                ret;
-
-    spin_lock(&hdata->fdata.io_lock);
-    ret = tracker_sane_locked(callf, line, hdata);
-    spin_unlock(&hdata->fdata.io_lock);
 
     return ret;
 }
 
-#else
-
-static inline bool tracker_sane_locked(const char *callf, uint line,
-                                  struct helper_data *hdata)
+static void tracker_put(struct helper_data *hdata, uint index)
 {
-    return true;
-}
+    uint64_t            old;
+    uint64_t            new;
+    uint64_t            cur;
 
-static inline bool tracker_sane(const char *callf, uint line,
-                                struct helper_data *hdata)
-{
-    return true;
+    old = atomic64_read(&hdata->tracker_free);
+    for (;;) {
+        WRITE_ONCE(hdata->tracker_next[index], old & TRACKER_IDX_MASK);
+        new = (((old >> TRACKER_TAG_SHIFT) + 1) << TRACKER_TAG_SHIFT) | index;
+        cur = atomic64_cmpxchg(&hdata->tracker_free, old, new);
+        if (cur == old)
+            break;
+        old = cur;
+    }
+    /* Only pollers that found no free index are waiting for one. */
+    if (atomic_inc_return(&hdata->tracker_freecnt) == 1)
+        wake_up_all(&hdata->tracker_poll_wqh);
+    /* atomic_inc_return() is a full barrier. */
+    if (waitqueue_active(&hdata->tracker_wqh))
+        wake_up(&hdata->tracker_wqh);
 }
 
-#endif
-
 static struct io_entry *_tracker_fetch(const char *callf, uint line,
                                        struct helper_data *hdata, uint index)
 {
     struct io_entry     *ret = NULL;
-    bool                wake = false;
 
     if (index < 1 || index >= hdata->tracker_max)
         goto done;
 
-    spin_lock(&hdata->fdata.io_lock);
-    if (!tracker_sane_locked(__FUNCTION__, __LINE__, hdata))
-        goto unlock;
-    ret = hdata->tracker[index];
-    /* Kernel addresses >> hdata->tracker_max */
-    if ((uintptr_t)ret >= hdata->tracker_max && list_empty(&ret->list)) {
-        wake = !(uintptr_t)hdata->tracker_free;
-        hdata->tracker[index] = hdata->tracker_free;
-        hdata->tracker_free = (void *)(uintptr_t)index;
-        hdata->tracker_freecnt++;
-        if (!tracker_sane_locked(__FUNCTION__, __LINE__, hdata))
-            goto unlock;
-    }
- unlock:
-    spin_unlock(&hdata->fdata.io_lock);
-    wake_up(&hdata->tracker_wqh);
-    if (wake)
-        wake_up_all(&poll_wqh);
+    ret = xchg(&hdata->tracker[index], NULL);
+    if (ret)
+        tracker_put(hdata, index);
 
  done:
     if (!ret)
@@ -752,32 +1211,69 @@ static struct io_entry *_tracker_fetch(const char *callf, uint line,
 #define tracker_fetch(...) \
     _tracker_fetch(__FUNCTION__, __LINE__, __VA_ARGS__)
 
+/* Copy a request into the helper's SQ and wake the helper if it sleeps. */
+static void helper_ring_post(struct helper_data *hdata,
+                             struct io_entry *entry)
+{
+    struct cmd_ring     *ring = hdata->fdata.ring;
+    union zhpe_op       *slot;
+
+    /* No overflow: the SQ has a slot for every tracker index. */
+    spin_lock(&ring->sq_lock);
+    slot = &ring->sq[ring->sq_tail & (ring->entries - 1)];
+    memcpy(slot, entry->data, entry->data_len);
+    memset((void *)slot + entry->data_len, 0,
+           sizeof(*slot) - entry->data_len);
+    smp_wmb();
+    ring->sq_tail++;
+    WRITE_ONCE(ring->hdr->sq_tail, ring->sq_tail);
+    spin_unlock(&ring->sq_lock);
+    /* Pairs with the barrier after the helper sets wakeup. */
+    smp_mb();
+    if (READ_ONCE(ring->hdr->wakeup))
+        wake_up_all(&hdata->fdata.poll_wqh);
+}
+
+/*
+ * Returns the index on success, 0 if the caller must wait for one, or
+ * an error. Until the helper is ready, requests are queued for read();
+ * after that, they go through the ring. The tracker holds the caller's
+ * reference.
+ */
 static int try_tracker_save(struct helper_data *hdata, struct io_entry *entry)
 {
-    int                 ret = 0;
+    int                 ret = -EIO;
+    struct file_data    *fdata = &hdata->fdata;
+    uint                index;
 
-    spin_lock(&hdata->fdata.io_lock);
-    if (!tracker_sane_locked(__FUNCTION__, __LINE__, hdata))
-        ret = -EIO;
-    else if (hdata->fdata.state & STATE_CLOSED)
-        ret = -EIO;
-    else if ((ret = (uintptr_t)hdata->tracker_free)) {
-        hdata->tracker_free = hdata->tracker[ret];
-        hdata->tracker[ret] = entry;
-        hdata->tracker_freecnt--;
-        entry->op.hdr.index = ret;
-        if (tracker_sane_locked(__FUNCTION__, __LINE__, hdata)) {
-            get_io_entry(entry);
-            queue_io_entry_locked(&hdata->fdata, &hdata->fdata.rd_list, entry);
-            goto done;
-        } else
+    if (READ_ONCE(fdata->state) & STATE_CLOSED)
+        goto done;
+    index = tracker_alloc(hdata);
+    if (!index) {
+        ret = (entry->nonblock ? -EAGAIN : 0);
+        goto done;
+    }
+    entry->op.hdr.index = index;
+    /* xchg() is a full barrier: orders the store before the state check. */
+    (void)xchg(&hdata->tracker[index], entry);
+    ret = index;
+    if (READ_ONCE(fdata->state) & STATE_CLOSED) {
+        /* Raced with release; back out unless it already responded. */
+        if (cmpxchg(&hdata->tracker[index], entry, NULL) == entry) {
+            tracker_put(hdata, index);
             ret = -EIO;
-    } else if (entry->nonblock)
-        ret = -EAGAIN;
-    spin_unlock(&hdata->fdata.io_lock);
+        }
+        goto done;
+    }
+    if (READ_ONCE(fdata->state) & STATE_READY)
+        helper_ring_post(hdata, entry);
+    else {
+        get_io_entry(entry);
+        if (queue_io_entry(fdata, &fdata->rd_list, entry) < 0)
+            put_io_entry(entry);
+    }
 
  done:
-
     return ret;
 }
 
@@ -813,9 +1309,30 @@ static int queue_io_rsp(struct io_entry *entry, size_t data_len, int status)
         data_len = sizeof(*op_hdr);
     entry->data_len = data_len;
 
-    if (fdata)
+    /* No one to tell: the caller frees the entry. */
+    if (!fdata) {
+        ret = -ENOENT;
+        goto done;
+    }
+    if (entry->rsp_state == IO_RSP_READ) {
         ret = queue_io_entry(fdata, &fdata->rd_list, entry);
+        goto done;
+    }
+    if (entry->rsp_state == IO_RSP_RING) {
+        ring_post(fdata, entry);
+        goto done;
+    }
+    /* Hand the response to the waiting ioctl; if it's gone, caller frees. */
+    spin_lock(&fdata->io_lock);
+    if (entry->rsp_state == IO_RSP_IOCTL_WAIT)
+        entry->rsp_state = IO_RSP_IOCTL_DONE;
+    else
+        ret = -EIO;
+    spin_unlock(&fdata->io_lock);
+    if (ret >= 0)
+        wake_up_all(&fdata->io_wqh);
 
+ done:
     return ret;
 }
 
@@ -830,6 +1347,49 @@ static int queue_io_helper(struct io_entry *entry, size_t data_len)
     return tracker_save(hdata, entry);
 }
 
+static inline bool backend_zhpe(void)
+{
+    return (shared_data->default_attr.backend == ZHPEQ_BACKEND_ZHPE);
+}
+
+/*
+ * Check that fdata owns the three zmaps of a queue and, if free is set,
+ * free them.
+ */
+static int zmap_info(struct file_data *fdata, struct zhpe_info *info,
+                     bool free)
+{
+    int                 ret = 0;
+    ulong               offs[3] = { info->reg_off, info->wq_off,
+                                    info->cq_off };
+    struct zmap         *zmaps[3];
+    size_t              i;
+
+    if (offs[0] == offs[1] || offs[0] == offs[2] || offs[1] == offs[2])
+        return -EINVAL;
+
+    spin_lock(&zmap_lock);
+    for (i = 0; i < ARRAY_SIZE(offs); i++) {
+        zmaps[i] = zmap_find(offs[i]);
+        if (!zmaps[i]) {
+            if (ret >= 0)
+                ret = -ENOENT;
+        } else if (zmaps[i]->owner != fdata && ret >= 0)
+            ret = -EACCES;
+    }
+    if (ret >= 0 && free) {
+        for (i = 0; i < ARRAY_SIZE(zmaps); i++)
+            zmap_remove(zmaps[i]);
+    }
+    spin_unlock(&zmap_lock);
+    if (ret >= 0 && free) {
+        for (i = 0; i < ARRAY_SIZE(zmaps); i++)
+            zmap_free(zmaps[i]);
+    }
+
+    return ret;
+}
+
 static int zhpe_user_req_INIT(struct io_entry *entry)
 {
     union zhpe_rsp      *rsp = &entry->op.rsp;
@@ -839,16 +1399,561 @@ static int zhpe_user_req_INIT(struct io_entry *entry)
     return queue_io_rsp(entry, sizeof(rsp->init), 0);
 }
 
+#if MR_CACHE
+
+/*
+ * Registration cache: registrations are pinned by the driver, registered
+ * with the helper under an owner private to the cache, and kept, per mm,
+ * in an interval tree by address. Files of the same process share them
+ * and a repeated registration is a lookup. Unused ones stay on an LRU,
+ * up to mr_cache_max; an mmu_notifier invalidation drops every entry
+ * that overlaps the range from the tree. Dead registrations are unpinned
+ * and deregistered by zmr_work, since invalidation can't block.
+ *
+ * users counts the files of the cache and registrations in flight, under
+ * mr_cache_mutex; the rest of the cache is protected by lock.
+ */
+struct mr_cache {
+    struct mmu_notifier mn;
+    struct list_head    list;
+    struct mm_struct    *mm;
+    spinlock_t          lock;
+    struct rb_root_cached tree;
+    struct list_head    lru;
+    uint                n_lru;
+    uint                users;
+    uint64_t            inval_seq;
+    uint64_t            owner;
+};
+
+struct zmr {
+    struct interval_tree_node it;
+    struct list_head    lru;
+    struct mr_cache     *cache;
+    struct mm_struct    *mm;
+    struct page         **pages;
+    ulong               npages;
+    uint64_t            seq;
+    uint64_t            owner;
+    uint                refs;
+    uint8_t             access;
+    bool                cached;
+    union zhpe_mr_desc  desc;
+};
+
+/* A file's reference to a registration. */
+struct zmr_ref {
+    struct list_head    list;
+    struct zmr          *zmr;
+};
+
+static DEFINE_MUTEX(mr_cache_mutex);
+static LIST_HEAD(mr_caches);
+static DEFINE_SPINLOCK(zmr_dead_lock);
+static LIST_HEAD(zmr_dead);
+
+static void zmr_free(struct zmr *zmr)
+{
+    struct io_entry     *entry;
+    union zhpe_req      *req;
+
+    /* Only if the helper registered it. */
+    if (zmr->desc.hdr.magic == ZHPE_MAGIC) {
+        entry = io_alloc(0, false, NULL, io_free);
+        if (entry) {
+            req = &entry->op.req;
+            req->hdr.opcode = ZHPE_OP_HELPER_MR_DEREG;
+            req->helper_mr_dereg.desc = zmr->desc;
+            req->helper_mr_dereg.owner = zmr->owner;
+            if (queue_io_helper(entry, sizeof(req->helper_mr_dereg)) < 0)
+                put_io_entry(entry);
+        }
+    }
+    unpin_user_pages(zmr->pages, zmr->npages);
+    atomic64_sub(zmr->npages, &zmr->mm->pinned_vm);
+    mmdrop(zmr->mm);
+    kvfree(zmr->pages);
+    do_kfree(zmr);
+}
+
+static void zmr_reap(struct work_struct *work)
+{
+    struct zmr          *zmr;
+    LIST_HEAD(dead);
+
+    spin_lock(&zmr_dead_lock);
+    list_splice_init(&zmr_dead, &dead);
+    spin_unlock(&zmr_dead_lock);
+
+    while (!list_empty(&dead)) {
+        zmr = list_first_entry(&dead, struct zmr, lru);
+        list_del(&zmr->lru);
+        zmr_free(zmr);
+    }
+}
+
+static DECLARE_WORK(zmr_work, zmr_reap);
+
+static void zmr_dead_add(struct zmr *zmr)
+{
+    spin_lock(&zmr_dead_lock);
+    list_add_tail(&zmr->lru, &zmr_dead);
+    spin_unlock(&zmr_dead_lock);
+}
+
+/* Must hold cache->lock; returns true if zmr is now dead. */
+static bool zmr_uncache_locked(struct mr_cache *cache, struct zmr *zmr)
+{
+    interval_tree_remove(&zmr->it, &cache->tree);
+    zmr->cached = false;
+    if (zmr->refs)
+        return false;
+    list_del_init(&zmr->lru);
+    cache->n_lru--;
+    zmr_dead_add(zmr);
+
+    return true;
+}
+
+static void mr_cache_invalidate(struct mr_cache *cache,
+                                ulong start, ulong end)
+{
+    struct interval_tree_node *it;
+    bool                reap = false;
+
+    if (start >= end)
+        return;
+
+    spin_lock(&cache->lock);
+    cache->inval_seq++;
+    while ((it = interval_tree_iter_first(&cache->tree, start, end - 1)))
+        reap |= zmr_uncache_locked(cache, container_of(it, struct zmr, it));
+    spin_unlock(&cache->lock);
+    if (reap)
+        schedule_work(&zmr_work);
+}
+
+static int mr_cache_invalidate_range_start(
+    struct mmu_notifier *mn, const struct mmu_notifier_range *range)
+{
+    mr_cache_invalidate(container_of(mn, struct mr_cache, mn),
+                        range->start, range->end);
+
+    return 0;
+}
+
+static void mr_cache_mm_release(struct mmu_notifier *mn,
+                                struct mm_struct *mm)
+{
+    mr_cache_invalidate(container_of(mn, struct mr_cache, mn), 0, ULONG_MAX);
+}
+
+static const struct mmu_notifier_ops mr_cache_mn_ops = {
+    .invalidate_range_start =   mr_cache_invalidate_range_start,
+    .release                =   mr_cache_mm_release,
+};
+
+/* Find or create the cache of the current mm and attach it to fdata. */
+static struct mr_cache *mr_cache_get(struct file_data *fdata)
+{
+    struct mr_cache     *ret;
+    int                 rc;
+
+    mutex_lock(&mr_cache_mutex);
+    ret = fdata->mr_cache;
+    if (ret) {
+        if (ret->mm != current->mm)
+            ret = ERR_PTR(-EXDEV);
+        goto unlock;
+    }
+    list_for_each_entry(ret, &mr_caches, list) {
+        if (ret->mm == current->mm) {
+            ret->users++;
+            fdata->mr_cache = ret;
+            goto unlock;
+        }
+    }
+    ret = do_kmalloc(sizeof(*ret), GFP_KERNEL, true);
+    if (!ret) {
+        ret = ERR_PTR(-ENOMEM);
+        goto unlock;
+    }
+    ret->mn.ops = &mr_cache_mn_ops;
+    ret->mm = current->mm;
+    spin_lock_init(&ret->lock);
+    ret->tree = RB_ROOT_CACHED;
+    INIT_LIST_HEAD(&ret->lru);
+    ret->n_lru = 0;
+    ret->users = 1;
+    ret->inval_seq = 0;
+    ret->owner = atomic64_inc_return(&owner_seq);
+    rc = mmu_notifier_register(&ret->mn, ret->mm);
+    if (rc < 0) {
+        do_kfree(ret);
+        ret = ERR_PTR(rc);
+        goto unlock;
+    }
+    mmgrab(ret->mm);
+    list_add_tail(&ret->list, &mr_caches);
+    fdata->mr_cache = ret;
+
+ unlock:
+    mutex_unlock(&mr_cache_mutex);
+
+    return ret;
+}
+
+/* Last user: every registration left is unused; kill them all. */
+static void mr_cache_put(struct mr_cache *cache)
+{
+    struct interval_tree_node *it;
+
+    if (!cache)
+        return;
+
+    mutex_lock(&mr_cache_mutex);
+    if (--cache->users) {
+        mutex_unlock(&mr_cache_mutex);
+        return;
+    }
+    list_del(&cache->list);
+    mutex_unlock(&mr_cache_mutex);
+
+    mmu_notifier_unregister(&cache->mn, cache->mm);
+    spin_lock(&cache->lock);
+    while ((it = interval_tree_iter_first(&cache->tree, 0, ULONG_MAX)))
+        (void)zmr_uncache_locked(cache, container_of(it, struct zmr, it));
+    spin_unlock(&cache->lock);
+    schedule_work(&zmr_work);
+    mmdrop(cache->mm);
+    do_kfree(cache);
+}
+
+static void mr_cache_hold(struct mr_cache *cache)
+{
+    mutex_lock(&mr_cache_mutex);
+    cache->users++;
+    mutex_unlock(&mr_cache_mutex);
+}
+
+/* Exact match of address and length, with at least the access asked. */
+static struct zmr *mr_cache_lookup(struct mr_cache *cache,
+                                   const struct zhpeq_key_data *kdata)
+{
+    struct zmr          *ret = NULL;
+    ulong               last = kdata->vaddr + kdata->len - 1;
+    struct interval_tree_node *it;
+    struct zmr          *zmr;
+
+    spin_lock(&cache->lock);
+    for (it = interval_tree_iter_first(&cache->tree, kdata->vaddr,
+                                       kdata->vaddr);
+         it; it = interval_tree_iter_next(it, kdata->vaddr, kdata->vaddr)) {
+        zmr = container_of(it, struct zmr, it);
+        if (it->start != kdata->vaddr || it->last != last ||
+            (zmr->access & kdata->access) != kdata->access)
+            continue;
+        if (!zmr->refs++) {
+            list_del_init(&zmr->lru);
+            cache->n_lru--;
+        }
+        ret = zmr;
+        break;
+    }
+    spin_unlock(&cache->lock);
+
+    return ret;
+}
+
+/* Cache a registration the helper has accepted, unless it is stale. */
+static void mr_cache_insert(struct zmr *zmr)
+{
+    struct mr_cache     *cache = zmr->cache;
+
+    spin_lock(&cache->lock);
+    if (mr_cache_max && zmr->seq == cache->inval_seq) {
+        interval_tree_insert(&zmr->it, &cache->tree);
+        zmr->cached = true;
+    }
+    spin_unlock(&cache->lock);
+}
+
+static void mr_put(struct zmr *zmr)
+{
+    struct mr_cache     *cache = zmr->cache;
+    bool                reap = false;
+    struct zmr          *old;
+
+    spin_lock(&cache->lock);
+    if (!--zmr->refs) {
+        if (zmr->cached) {
+            list_add_tail(&zmr->lru, &cache->lru);
+            if (++cache->n_lru > mr_cache_max) {
+                old = list_first_entry(&cache->lru, struct zmr, lru);
+                reap = zmr_uncache_locked(cache, old);
+            }
+        } else {
+            zmr_dead_add(zmr);
+            reap = true;
+        }
+    }
+    spin_unlock(&cache->lock);
+    if (reap)
+        schedule_work(&zmr_work);
+}
+
+/* Pin the pages of a new registration; it holds a use of the cache. */
+static struct zmr *zmr_pin(struct mr_cache *cache,
+                           const struct zhpeq_key_data *kdata)
+{
+    struct zmr          *ret;
+    ulong               start = kdata->vaddr & PAGE_MASK;
+    ulong               end = PAGE_ALIGN(kdata->vaddr + kdata->len);
+    ulong               limit = rlimit(RLIMIT_MEMLOCK) >> PAGE_SHIFT;
+    uint                flags = FOLL_LONGTERM;
+    ulong               npages;
+    long                pinned;
+    int                 rc = -ENOMEM;
+
+    /* PAGE_ALIGN() wraps to 0 at the top of the address space. */
+    if (!kdata->len || end <= start)
+        return ERR_PTR(-EINVAL);
+    npages = (end - start) >> PAGE_SHIFT;
+    /* Charge the pins before anything is sized from the user's length. */
+    if (atomic64_add_return(npages, &current->mm->pinned_vm) > limit &&
+        !capable(CAP_IPC_LOCK)) {
+        atomic64_sub(npages, &current->mm->pinned_vm);
+        return ERR_PTR(-ENOMEM);
+    }
+
+    ret = do_kmalloc(sizeof(*ret), GFP_KERNEL, true);
+    if (!ret) {
+        atomic64_sub(npages, &current->mm->pinned_vm);
+        return ERR_PTR(-ENOMEM);
+    }
+
+    ret->cache = cache;
+    ret->mm = current->mm;
+    mmgrab(ret->mm);
+    ret->npages = 0;
+    INIT_LIST_HEAD(&ret->lru);
+    ret->it.start = kdata->vaddr;
+    ret->it.last = kdata->vaddr + kdata->len - 1;
+    ret->owner = cache->owner;
+    ret->refs = 1;
+    ret->access = kdata->access;
+    ret->cached = false;
+    ret->desc.hdr.magic = 0;
+    spin_lock(&cache->lock);
+    ret->seq = cache->inval_seq;
+    spin_unlock(&cache->lock);
+
+    ret->pages = kvmalloc_array(npages, sizeof(*ret->pages), GFP_KERNEL);
+    if (!ret->pages)
+        goto fail;
+    /* Local gets and remote puts write the memory. */
+    if (kdata->access & (ZHPEQ_MR_GET | ZHPEQ_MR_PUT_REMOTE))
+        flags |= FOLL_WRITE;
+    for (; start < end; start += pinned << PAGE_SHIFT) {
+        pinned = pin_user_pages_fast(start, (end - start) >> PAGE_SHIFT,
+                                     flags, ret->pages + ret->npages);
+        if (pinned <= 0) {
+            rc = (pinned < 0 ? pinned : -EFAULT);
+            goto fail;
+        }
+        ret->npages += pinned;
+    }
+    mr_cache_hold(cache);
+
+    return ret;
+
+ fail:
+    if (ret->pages)
+        unpin_user_pages(ret->pages, ret->npages);
+    atomic64_sub(npages, &ret->mm->pinned_vm);
+    mmdrop(ret->mm);
+    kvfree(ret->pages);
+    do_kfree(ret);
+
+    return ERR_PTR(rc);
+}
+
+/* Hand the reference of a registration to fdata. */
+static int mr_ref_add(struct file_data *fdata, struct zmr *zmr)
+{
+    struct zmr_ref      *ref;
+
+    ref = do_kmalloc(sizeof(*ref), GFP_KERNEL, false);
+    if (ref) {
+        ref->zmr = zmr;
+        spin_lock(&fdata->io_lock);
+        if (!(fdata->state & STATE_CLOSED)) {
+            list_add_tail(&ref->list, &fdata->mr_list);
+            spin_unlock(&fdata->io_lock);
+            return 0;
+        }
+        spin_unlock(&fdata->io_lock);
+        do_kfree(ref);
+    }
+    mr_put(zmr);
+
+    return (ref ? -EIO : -ENOMEM);
+}
+
+static int mr_ref_del(struct file_data *fdata, uint64_t key)
+{
+    struct zmr_ref      *ref;
+
+    spin_lock(&fdata->io_lock);
+    list_for_each_entry(ref, &fdata->mr_list, list) {
+        if (ref->zmr->desc.v1.kdata.key == key) {
+            list_del(&ref->list);
+            spin_unlock(&fdata->io_lock);
+            mr_put(ref->zmr);
+            do_kfree(ref);
+            return 0;
+        }
+    }
+    spin_unlock(&fdata->io_lock);
+
+    return -EINVAL;
+}
+
+/* On close: drop the registrations of fdata and its use of the cache. */
+static void mr_release(struct file_data *fdata)
+{
+    struct zmr_ref      *ref;
+    struct zmr_ref      *next;
+    LIST_HEAD(refs);
+
+    spin_lock(&fdata->io_lock);
+    list_splice_init(&fdata->mr_list, &refs);
+    spin_unlock(&fdata->io_lock);
+    list_for_each_entry_safe(ref, next, &refs, list) {
+        mr_put(ref->zmr);
+        do_kfree(ref);
+    }
+    mr_cache_put(fdata->mr_cache);
+    fdata->mr_cache = NULL;
+}
+
+/* The helper's answer for a new registration. */
+static int mr_reg_done(struct io_entry *entry, int status)
+{
+    struct zmr          *zmr = entry->zmr;
+    struct mr_cache     *cache = zmr->cache;
+
+    entry->zmr = NULL;
+    if (status >= 0) {
+        zmr->desc = entry->op.rsp.helper_mr_reg.desc;
+        mr_cache_insert(zmr);
+        status = mr_ref_add(entry->fdata, zmr);
+    } else
+        mr_put(zmr);
+    mr_cache_put(cache);
+
+    return status;
+}
+
 static int zhpe_user_req_MR_REG(struct io_entry *entry)
 {
-    return -ENOSYS;
+    int                 ret = -EINVAL;
+    union zhpe_req      *req = &entry->op.req;
+    union zhpe_rsp      *rsp = &entry->op.rsp;
+    struct zhpeq_key_data kdata = req->mr_reg.kdata;
+    struct mr_cache     *cache;
+    struct zmr          *zmr;
+
+    if (!backend_zhpe())
+        return -ENOSYS;
+
+    if (!kdata.len || kdata.vaddr + kdata.len < kdata.vaddr)
+        goto done;
+    cache = mr_cache_get(entry->fdata);
+    if (IS_ERR(cache)) {
+        ret = PTR_ERR(cache);
+        goto done;
+    }
+    zmr = mr_cache_lookup(cache, &kdata);
+    if (zmr) {
+        ret = mr_ref_add(entry->fdata, zmr);
+        if (ret >= 0)
+            rsp->mr_reg.desc = zmr->desc;
+        goto done;
+    }
+    zmr = zmr_pin(cache, &kdata);
+    if (IS_ERR(zmr)) {
+        ret = PTR_ERR(zmr);
+        goto done;
+    }
+
+    /* The helper keeps the key table for the emulated bridge. */
+    entry->zmr = zmr;
+    req->hdr.opcode = ZHPE_OP_HELPER_MR_REG;
+    req->helper_mr_reg.owner = cache->owner;
+    req->helper_mr_reg.pid = task_tgid_nr(current);
+    ret = queue_io_helper(entry, sizeof(req->helper_mr_reg));
+    if (ret >= 0)
+        return ret;
+    ret = mr_reg_done(entry, ret);
+
+ done:
+    return queue_io_rsp(entry, sizeof(rsp->mr_reg), ret);
 }
 
 static int zhpe_user_req_MR_DEREG(struct io_entry *entry)
 {
-    return -ENOSYS;
+    union zhpe_req      *req = &entry->op.req;
+    union zhpe_rsp      *rsp = &entry->op.rsp;
+    int                 ret;
+
+    if (!backend_zhpe())
+        return -ENOSYS;
+
+    ret = mr_ref_del(entry->fdata, req->mr_dereg.desc.v1.kdata.key);
+
+    return queue_io_rsp(entry, sizeof(rsp->mr_dereg), ret);
+}
+
+#else
+
+static inline int mr_reg_done(struct io_entry *entry, int status)
+{
+    return status;
+}
+
+static inline void mr_release(struct file_data *fdata)
+{
+}
+
+static int zhpe_user_req_MR_REG(struct io_entry *entry)
+{
+    union zhpe_req      *req = &entry->op.req;
+
+    if (!backend_zhpe())
+        return -ENOSYS;
+
+    /* The helper keeps the key table for the emulated bridge. */
+    req->hdr.opcode = ZHPE_OP_HELPER_MR_REG;
+    req->helper_mr_reg.owner = entry->fdata->owner;
+    req->helper_mr_reg.pid = task_tgid_nr(current);
+    return queue_io_helper(entry, sizeof(req->helper_mr_reg));
+}
+
+static int zhpe_user_req_MR_DEREG(struct io_entry *entry)
+{
+    union zhpe_req      *req = &entry->op.req;
+
+    if (!backend_zhpe())
+        return -ENOSYS;
+
+    req->hdr.opcode = ZHPE_OP_HELPER_MR_DEREG;
+    req->helper_mr_dereg.owner = entry->fdata->owner;
+    return queue_io_helper(entry, sizeof(req->helper_mr_dereg));
 }
 
+#endif /* MR_CACHE */
+
 static int zhpe_user_req_NOP(struct io_entry *entry)
 {
     union zhpe_req      *req = &entry->op.req;
@@ -887,7 +1992,7 @@ static int zhpe_user_req_QALLOC(struct io_entry *entry)
     /* Allocate zpages and zmaps. */
     ret = -ENOMEM;
     for (i = 0; i < ARRAY_SIZE(sizes); i++) {
-        zpages[i] = zpages_alloc(sizes[i], false);
+        zpages[i] = zpool_get(sizes[i], (i > 0 && queue_contig));
         if (!zpages[i])
             goto done;
         zmaps[i] = zmap_alloc(zpages[i]);
@@ -902,16 +2007,28 @@ static int zhpe_user_req_QALLOC(struct io_entry *entry)
     rsp->qalloc.info.cq_off = zmaps[2]->offset;
     /* Set owner field to valid value; can't fail after this. */
     for (i = 0; i < ARRAY_SIZE(sizes); i++)
-        zmaps[i]->owner = entry->fdata;
+        zmap_set_owner(zmaps[i], entry->fdata);
     /* Make sure owner is seen before we advertise the queue anywhere. */
     smp_wmb();
     ret = 0;
 
+    if (backend_zhpe()) {
+        /* The helper maps the queue and responds for us. */
+        req->hdr.opcode = ZHPE_OP_HELPER_QALLOC;
+        req->helper_qalloc.owner = entry->fdata->owner;
+        req->helper_qalloc.pid = task_tgid_nr(current);
+        ret = queue_io_helper(entry, sizeof(req->helper_qalloc));
+        if (ret >= 0)
+            return ret;
+        (void)zmap_info(entry->fdata, &rsp->qalloc.info, true);
+        return queue_io_rsp(entry, sizeof(rsp->qalloc), ret);
+    }
+
  done:
     if (ret < 0) {
         for (i = 0; i < ARRAY_SIZE(sizes); i++) {
             if (zmaps[i])
-                zmap_free(zmaps[i]);
+                zmap_release(zmaps[i]);
             else if (zpages[i])
                 zpages_free(zpages[i]);
         }
@@ -922,33 +2039,23 @@ static int zhpe_user_req_QALLOC(struct io_entry *entry)
 
 static int zhpe_user_req_QFREE(struct io_entry *entry)
 {
-    int                 ret = 0;
+    int                 ret;
     struct file_data    *fdata = entry->fdata;
     union zhpe_req      *req = &entry->op.req;
     union zhpe_rsp      *rsp = &entry->op.rsp;
-    int                 count = 3;
-    struct zmap         *zmap;
-    struct zmap         *next;
 
-    spin_lock(&zmap_lock);
-    list_for_each_entry_safe(zmap, next, &zmap_list, list) {
-        if (zmap->offset == req->qfree.info.reg_off ||
-            zmap->offset == req->qfree.info.wq_off ||
-            zmap->offset == req->qfree.info.cq_off) {
-            if (zmap->owner != fdata) {
-                if (ret >= 0)
-                    ret = -EACCES;
-            } else {
-                list_del_init(&zmap->list);
-                zmap_free(zmap);
-            }
-            if (--count == 0)
-                break;
+    if (backend_zhpe()) {
+        /* The helper must unmap the queue before the pages are freed. */
+        ret = zmap_info(fdata, &req->qfree.info, false);
+        if (ret >= 0) {
+            req->hdr.opcode = ZHPE_OP_HELPER_QFREE;
+            req->helper_qfree.owner = fdata->owner;
+            ret = queue_io_helper(entry, sizeof(req->helper_qfree));
+            if (ret >= 0)
+                return ret;
         }
-    }
-    spin_unlock(&zmap_lock);
-    if (ret >= 0 && count)
-        ret = -ENOENT;
+    } else
+        ret = zmap_info(fdata, &req->qfree.info, true);
 
     return queue_io_rsp(entry, sizeof(rsp->qfree), ret);
 }
@@ -963,15 +2070,62 @@ static int zhpe_user_req_ZMMU_DEREG(struct io_entry *entry)
     return -ENOSYS;
 }
 
+static int zhpe_user_req_RING_INIT(struct io_entry *entry)
+{
+    int                 ret;
+    struct file_data    *fdata = entry->fdata;
+    union zhpe_req      *req = &entry->op.req;
+    union zhpe_rsp      *rsp = &entry->op.rsp;
+    struct cmd_ring     *ring;
+
+    ret = -EINVAL;
+    if (req->ring_init.entries <= ZHPE_RING_MAX)
+        ret = ring_alloc(fdata, req->ring_init.entries,
+                         req->ring_init.eventfd);
+    if (ret >= 0) {
+        ring = fdata->ring;
+        rsp->ring_init.ring_off = ring->zmap->offset;
+        rsp->ring_init.ring_size = ring->zmap->zpages->size;
+        rsp->ring_init.entries = ring->entries;
+    }
+
+    return queue_io_rsp(entry, sizeof(rsp->ring_init), ret);
+}
+
 static void helper_data_free(const char *callf, uint line, void *ptr)
 {
     struct helper_data  *hdata = (void *)ptr;
 
     if (hdata->task)
         put_task_struct(hdata->task);
+    ring_free(hdata->fdata.ring);
     _do_kfree(callf, line, hdata);
 }
 
+/*
+ * Ask the helper to drop the queues and registrations of a closing file;
+ * the zmaps are freed when it responds. Returns false if it can't be asked.
+ */
+static bool release_helper(struct file_data *fdata)
+{
+    struct io_entry     *entry;
+    union zhpe_req      *req;
+
+    entry = io_alloc(0, false, fdata, io_free);
+    if (!entry)
+        return false;
+    req = &entry->op.req;
+    req->hdr.opcode = ZHPE_OP_HELPER_RELEASE;
+    req->helper_release.owner = fdata->owner;
+    entry->hdr = req->hdr;
+    if (queue_io_helper(entry, sizeof(req->helper_release)) < 0) {
+        put_io_entry(entry);
+        return false;
+    }
+
+    return true;
+}
+
 static int zhpe_release(struct inode *inode, struct file *file)
 {
     struct file_data    *fdata = file->private_data;
@@ -979,7 +2133,9 @@ static int zhpe_release(struct inode *inode, struct file *file)
     spin_lock(&fdata->io_lock);
     fdata->state |= STATE_CLOSED;
     spin_unlock(&fdata->io_lock);
-    free_zmap_list(fdata);
+    mr_release(fdata);
+    if (!backend_zhpe() || !release_helper(fdata))
+        free_zmap_list(fdata);
     free_io_lists(fdata);
     put_file_data(fdata);
 
@@ -995,25 +2151,33 @@ static ssize_t zhpe_read(struct file *file, char __user *buf, size_t len,
     ssize_t             ret = 0;
     struct file_data    *fdata = file->private_data;
     struct io_entry     *entry;
+    struct io_entry     *next;
+    size_t              slots = 0;
+    size_t              n = 0;
+    LIST_HEAD(rd_batch);
 
     if (!len)
         goto done;
 
-    if (!tracker_sane(__FUNCTION__, __LINE__, helper_data)) {
-        ret = -EIO;
-        goto done;
-    }
-
     /*
      * Weird semantics: read must be big enough to read entire packet
-     * at once; if not, return -EINVAL;
+     * at once; if not, return -EINVAL; a read big enough for a batch
+     * returns as many responses as are ready, one per slot.
      */
+    if (len >= ZHPE_BATCH_MIN)
+        slots = len / sizeof(union zhpe_op);
     for (;;) {
         entry = NULL;
         spin_lock(&fdata->io_lock);
         if (!list_empty(&fdata->rd_list)) {
             entry = list_first_entry(&fdata->rd_list, struct io_entry, list);
-            if (len >= entry->data_len) {
+            if (slots) {
+                for (; n < slots && !list_empty(&fdata->rd_list); n++) {
+                    entry = list_first_entry(&fdata->rd_list,
+                                             struct io_entry, list);
+                    list_move_tail(&entry->list, &rd_batch);
+                }
+            } else if (len >= entry->data_len) {
                 list_del_init(&entry->list);
                 len = entry->data_len;
             } else
@@ -1033,62 +2197,282 @@ static ssize_t zhpe_read(struct file *file, char __user *buf, size_t len,
         if (ret < 0)
             goto done;
     }
-    ret = copy_to_user(buf, entry->data, len);
-    put_io_entry(entry);
+    if (!slots) {
+        ret = copy_to_user(buf, entry->data, len);
+        put_io_entry(entry);
+        goto done;
+    }
+    len = n * sizeof(union zhpe_op);
+    list_for_each_entry_safe(entry, next, &rd_batch, list) {
+        list_del_init(&entry->list);
+        if (ret >= 0 &&
+            (copy_to_user(buf, entry->data, entry->data_len) ||
+             clear_user(buf + entry->data_len,
+                        sizeof(union zhpe_op) - entry->data_len)))
+            ret = -EFAULT;
+        buf += sizeof(union zhpe_op);
+        put_io_entry(entry);
+    }
+
+ done:
+    debug_cond(DEBUG_IO, (ret /* != -EAGAIN*/),
+               "%s:%s,%u:ret = %ld len = %ld pid = %d\n",
+               driver_name, __FUNCTION__, __LINE__, ret, len,
+               task_pid_vnr(current));
+
+    return (ret < 0 ? ret : len);
+}
+
+/* len is the length of the request written; the ioctl passes 0. */
+static int zhpe_user_req(struct io_entry *entry, size_t len)
+{
+    int                 ret = -EINVAL;
+    struct zhpe_common_hdr *op_hdr = &entry->op.hdr;
+    size_t              op_len;
+
+#define USER_REQ_HANDLER(_op)                           \
+    case ZHPE_OP_ ## _op:                               \
+        debug(DEBUG_IO, "%s:%s:ZHPE_OP_" # _op,         \
+              driver_name, __FUNCTION__);               \
+        op_len = sizeof(struct zhpe_req_ ## _op);       \
+        if (len && len != op_len)                       \
+            goto done;                                  \
+        ret = zhpe_user_req_ ## _op(entry);             \
+        break;
+
+    switch (op_hdr->opcode) {
+
+    USER_REQ_HANDLER(INIT);
+    USER_REQ_HANDLER(MR_REG);
+    USER_REQ_HANDLER(MR_DEREG);
+    USER_REQ_HANDLER(NOP);
+    USER_REQ_HANDLER(QALLOC);
+    USER_REQ_HANDLER(QFREE);
+    USER_REQ_HANDLER(ZMMU_REG);
+    USER_REQ_HANDLER(ZMMU_DEREG);
+    USER_REQ_HANDLER(RING_INIT);
+
+    default:
+        printk(KERN_ERR "%s:%s,%u:Unexpected opcode 0x%02x\n",
+               driver_name, __FUNCTION__, __LINE__, op_hdr->opcode);
+        ret = -EIO;
+        break;
+    }
+
+#undef USER_REQ_HANDLER
+
+ done:
+    return ret;
+}
+
+/* A len of 0 is a batch slot: a union zhpe_op holding one request. */
+static int zhpe_write_one(struct file_data *fdata, const char __user *buf,
+                          size_t len, bool nonblock)
+{
+    int                 ret;
+    struct io_entry     *entry = NULL;
+    struct zhpe_common_hdr *op_hdr;
+    size_t              op_len;
+
+    entry = io_alloc(0, nonblock, fdata, io_free);
+    if (!entry) {
+        ret = (nonblock ? -EAGAIN : -ENOMEM);
+        goto done;
+    }
+    op_hdr = &entry->op.hdr;
+
+    op_len = sizeof(union zhpe_req);
+    if (len && op_len > len)
+        op_len = len;
+    ret = -EFAULT;
+    if (copy_from_user(op_hdr, buf, op_len))
+        goto done;
+    entry->hdr = *op_hdr;
+
+    ret = -EINVAL;
+    if (!expected_saw("version", ZHPE_OP_VERSION, op_hdr->version))
+        goto done;
+
+    ret = zhpe_user_req(entry, len);
+
+    /*
+     * If handler accepts op, it is no longer our responsibility to free
+     * the entry.
+     */
+    if (ret >= 0)
+        entry = NULL;
+
+ done:
+    put_io_entry(entry);
+
+    return ret;
+}
+
+static ssize_t zhpe_write(struct file *file, const char __user *buf,
+                          size_t len, loff_t *ppos)
+{
+    ssize_t             ret = 0;
+    struct file_data    *fdata = file->private_data;
+    bool                nonblock = !!(file->f_flags & O_NONBLOCK);
+    size_t              off;
+
+    if (!len)
+        goto done;
+
+    /*
+     * Weird semantics: requires write be a packet containing a single
+     * request or an array of union zhpe_op slots with a request in each.
+     */
+    if (len < sizeof(struct zhpe_common_hdr)) {
+        ret = -EINVAL;
+        printk(KERN_ERR "%s:%s,%u:Unexpected short write %lu\n",
+               driver_name, __FUNCTION__, __LINE__, len);
+        goto done;
+    }
+
+    if (len < ZHPE_BATCH_MIN) {
+        ret = zhpe_write_one(fdata, buf, len, nonblock);
+        goto done;
+    }
+    if (len % sizeof(union zhpe_op)) {
+        ret = -EINVAL;
+        goto done;
+    }
+    /* A batch that fails part way returns the slots accepted. */
+    for (off = 0; off < len; off += sizeof(union zhpe_op)) {
+        ret = zhpe_write_one(fdata, buf + off, 0, nonblock);
+        if (ret < 0) {
+            if (off)
+                len = off;
+            break;
+        }
+    }
+    if (off)
+        ret = 0;
+
+ done:
+    debug_cond(DEBUG_IO, (ret != -EAGAIN),
+               "%s:%s,%u:ret = %ld len = %ld pid = %d\n",
+               driver_name, __FUNCTION__, __LINE__, ret, len,
+               task_pid_vnr(current));
+
+    return (ret < 0 ? ret : len);
+}
+
+/*
+ * Submit what user space has queued in the SQ, bounded so that every
+ * request in flight has a CQ slot waiting for it, then optionally wait
+ * for completions. A request is handled exactly as if written, but its
+ * response is posted to the CQ.
+ */
+static long zhpe_ring_enter(struct file_data *fdata, void __user *uarg)
+{
+    long                ret = -EFAULT;
+    struct cmd_ring     *ring = READ_ONCE(fdata->ring);
+    struct zhpe_ring_enter arg;
+    struct io_entry     *entry;
+    uint32_t            qmask;
+    uint32_t            avail;
+    uint32_t            space;
+    uint32_t            n;
+    int                 rc;
+
+    if (copy_from_user(&arg, uarg, sizeof(arg)))
+        goto done;
+    ret = -ENXIO;
+    if (!ring)
+        goto done;
+    qmask = ring->entries - 1;
+
+    mutex_lock(&ring->sq_mutex);
+    avail = READ_ONCE(ring->hdr->sq_tail) - ring->sq_head;
+    smp_rmb();
+    if (avail > ring->entries) {
+        mutex_unlock(&ring->sq_mutex);
+        ret = -EINVAL;
+        goto done;
+    }
+    if (avail > arg.to_submit)
+        avail = arg.to_submit;
+    spin_lock(&ring->cq_lock);
+    space = ring->entries - ring->inflight - ring_cq_count(ring);
+    if (avail > space)
+        avail = space;
+    ring->inflight += avail;
+    spin_unlock(&ring->cq_lock);
+
+    for (n = 0; n < avail; n++) {
+        entry = io_alloc(0, false, fdata, io_free);
+        if (!entry) {
+            spin_lock(&ring->cq_lock);
+            ring->inflight -= avail - n;
+            spin_unlock(&ring->cq_lock);
+            break;
+        }
+        memcpy(&entry->op, &ring->sq[ring->sq_head & qmask],
+               sizeof(entry->op));
+        ring->sq_head++;
+        entry->hdr = entry->op.hdr;
+        entry->rsp_state = IO_RSP_RING;
+        if (entry->hdr.version != ZHPE_OP_VERSION ||
+            entry->hdr.opcode == ZHPE_OP_RING_INIT)
+            rc = -EINVAL;
+        else
+            rc = zhpe_user_req(entry, 0);
+        /* Errors the handler returns are posted like any response. */
+        if (rc < 0 && queue_io_rsp(entry, 0, rc) < 0)
+            put_io_entry(entry);
+    }
+    WRITE_ONCE(ring->hdr->sq_head, ring->sq_head);
+    mutex_unlock(&ring->sq_mutex);
+    ret = n;
+    if (!n && avail) {
+        ret = -ENOMEM;
+        goto done;
+    }
+
+    if (arg.min_complete) {
+        if (arg.min_complete > ring->entries)
+            arg.min_complete = ring->entries;
+        rc = wait_event_interruptible(fdata->io_wqh,
+                                      (ring_cq_count(ring) >=
+                                       arg.min_complete));
+        if (rc < 0 && !n)
+            ret = rc;
+    }
 
  done:
-    if (!tracker_sane(__FUNCTION__, __LINE__, helper_data) && ret >= 0)
-        ret = -EIO;
-
-    debug_cond(DEBUG_IO, (ret /* != -EAGAIN*/),
-               "%s:%s,%u:ret = %ld len = %ld pid = %d\n",
-               driver_name, __FUNCTION__, __LINE__, ret, len,
-               task_pid_vnr(current));
-
-    return (ret < 0 ? ret : len);
+    return ret;
 }
 
-static ssize_t zhpe_write(struct file *file, const char __user *buf,
-                          size_t len, loff_t *ppos)
+/*
+ * The request and its response in one syscall; the handlers are the
+ * same as for write(), but the response is handed straight back here
+ * instead of going through rd_list.
+ */
+static long zhpe_ioctl(struct file *file, uint cmd, ulong arg)
 {
-    ssize_t             ret = 0;
+    long                ret = -ENOTTY;
     struct file_data    *fdata = file->private_data;
-    bool                nonblock = !!(file->f_flags & O_NONBLOCK);
+    void __user         *uop = (void __user *)arg;
     struct io_entry     *entry = NULL;
     struct zhpe_common_hdr *op_hdr;
-    size_t              op_len;
-
-    if (!len)
-        goto done;
-
-    if (!tracker_sane(__FUNCTION__, __LINE__, helper_data)) {
-        ret = -EIO;
-        goto done;
-    }
+    size_t              len = 0;
 
-    /*
-     * Weird semantics: requires write be a packet containing a single
-     * request.
-     */
-    if (len < sizeof(*op_hdr)) {
-        ret = -EINVAL;
-        printk(KERN_ERR "%s:%s,%u:Unexpected short write %lu\n",
-               driver_name, __FUNCTION__, __LINE__, len);
+    if (cmd == ZHPE_IOC_RING_ENTER)
+        return zhpe_ring_enter(fdata, uop);
+    if (cmd != ZHPE_IOC_CMD)
         goto done;
-    }
 
-    entry = io_alloc(0, nonblock, fdata, io_free);
+    entry = io_alloc(0, false, fdata, io_free);
     if (!entry) {
-        ret = (nonblock ? -EAGAIN : -ENOMEM);
+        ret = -ENOMEM;
         goto done;
     }
     op_hdr = &entry->op.hdr;
 
-    op_len = sizeof(union zhpe_req);
-    if (op_len > len)
-        op_len = len;
-    ret = copy_from_user(op_hdr, buf, op_len);
-    if (ret < 0)
+    ret = -EFAULT;
+    if (copy_from_user(op_hdr, uop, sizeof(entry->op)))
         goto done;
     entry->hdr = *op_hdr;
 
@@ -1096,55 +2480,40 @@ static ssize_t zhpe_write(struct file *file, const char __user *buf,
     if (!expected_saw("version", ZHPE_OP_VERSION, op_hdr->version))
         goto done;
 
-#define USER_REQ_HANDLER(_op)                           \
-    case ZHPE_OP_ ## _op:                               \
-        debug(DEBUG_IO, "%s:%s:ZHPE_OP_" # _op,         \
-              driver_name, __FUNCTION__);               \
-        op_len = sizeof(struct zhpe_req_ ## _op);       \
-        if (len != op_len)                              \
-            goto done;                                  \
-        ret = zhpe_user_req_ ## _op(entry);             \
-        break;
-
-    switch (op_hdr->opcode) {
-
-    USER_REQ_HANDLER(INIT);
-    USER_REQ_HANDLER(MR_REG);
-    USER_REQ_HANDLER(MR_DEREG);
-    USER_REQ_HANDLER(NOP);
-    USER_REQ_HANDLER(QALLOC);
-    USER_REQ_HANDLER(QFREE);
-    USER_REQ_HANDLER(ZMMU_REG);
-    USER_REQ_HANDLER(ZMMU_DEREG);
-
-    default:
-        printk(KERN_ERR "%s:%s,%u:Unexpected opcode 0x%02x\n",
-               driver_name, __FUNCTION__, __LINE__, op_hdr->opcode);
-        ret = -EIO;
-        break;
+    /* One reference for the handler, one for us. */
+    entry->rsp_state = IO_RSP_IOCTL_WAIT;
+    get_io_entry(entry);
+    ret = zhpe_user_req(entry, 0);
+    if (ret < 0) {
+        put_io_entry(entry);
+        goto done;
     }
 
-#undef USER_REQ_HANDLER
-
-    /*
-     * If handler accepts op, it is no longer our responsibility to free
-     * the entry.
-     */
-    if (ret >= 0)
-        entry = NULL;
+    ret = wait_event_interruptible(fdata->io_wqh,
+                                   (READ_ONCE(entry->rsp_state) !=
+                                    IO_RSP_IOCTL_WAIT));
+    spin_lock(&fdata->io_lock);
+    if (entry->rsp_state == IO_RSP_IOCTL_WAIT) {
+        /* Interrupted: the response will be freed when it arrives. */
+        entry->rsp_state = IO_RSP_IOCTL_GONE;
+        spin_unlock(&fdata->io_lock);
+        goto done;
+    }
+    spin_unlock(&fdata->io_lock);
+    /* The response has been delivered; drop the handler's reference. */
+    put_io_entry(entry);
+    len = entry->data_len;
+    ret = (copy_to_user(uop, entry->data, len) ? -EFAULT : len);
 
  done:
     put_io_entry(entry);
 
-    if (!tracker_sane(__FUNCTION__, __LINE__, helper_data) && ret >= 0)
-        ret = -EIO;
-
-    debug_cond(DEBUG_IO, (ret != -EAGAIN),
+    debug_cond(DEBUG_IO, (ret < 0),
                "%s:%s,%u:ret = %ld len = %ld pid = %d\n",
                driver_name, __FUNCTION__, __LINE__, ret, len,
                task_pid_vnr(current));
 
-    return (ret < 0 ? ret : len);
+    return ret;
 }
 
 static uint zhpe_poll(struct file *file, struct poll_table_struct *wait)
@@ -1152,9 +2521,21 @@ static uint zhpe_poll(struct file *file, struct poll_table_struct *wait)
     uint                ret = 0;
     struct file_data    *fdata = file->private_data;
 
-    poll_wait(file, &poll_wqh, wait);
+    poll_wait(file, &fdata->poll_wqh, wait);
     ret |= (list_empty(&fdata->rd_list) ? 0 : POLLIN | POLLRDNORM);
-    ret |= ((uintptr_t)helper_data->tracker_free ? POLLOUT | POLLWRNORM : 0);
+    if (fdata->ring && ring_cq_count(fdata->ring))
+        ret |= POLLIN | POLLRDNORM;
+    /*
+     * Writability depends on the helper's tracker; only wait for it
+     * if asked to and there is no free index.
+     */
+    if (atomic_read(&helper_data->tracker_freecnt))
+        ret |= POLLOUT | POLLWRNORM;
+    else if (poll_requested_events(wait) & (POLLOUT | POLLWRNORM)) {
+        poll_wait(file, &helper_data->tracker_poll_wqh, wait);
+        if (atomic_read(&helper_data->tracker_freecnt))
+            ret |= POLLOUT | POLLWRNORM;
+    }
 
     return ret;
 }
@@ -1162,47 +2543,85 @@ static uint zhpe_poll(struct file *file, struct poll_table_struct *wait)
 /*
  * zhpe_vma_close() keeps vmas from being merged, so zhpe_mmap() will
  * be called on every mmap() and zhpe_vma_close/open() are used to track
- * when things are unmapped.
+ * when things are unmapped. Each vma holds a reference to its zpages,
+ * so the pages outlive a QFREE until they are unmapped.
+ *
+ * Nothing is mapped up front: pages are inserted by zhpe_vma_fault() on
+ * first touch, and mmap(MAP_POPULATE) prefaults a mapping through the
+ * same handler.
  *
  * mmap_sem will be held for write when this is called.
  */
 
 static void zhpe_vma_close(struct vm_area_struct *vma)
 {
+    zpages_free(vma->vm_private_data);
 }
 
 static void zhpe_vma_open(struct vm_area_struct *vma)
 {
+    zpages_get(vma->vm_private_data);
+}
+
+static vm_fault_t zhpe_fault(struct vm_area_struct *vma,
+                             struct vm_fault *vmf)
+{
+    struct zpages       *zpages = vma->vm_private_data;
+    ulong               i = vmf->pgoff - zpages->pgoff;
+    struct page         *page;
+
+    if (i >= zpages->size >> PAGE_SHIFT)
+        return VM_FAULT_SIGBUS;
+    page = virt_to_page(zpages->pages[i]);
+    get_page(page);
+    vmf->page = page;
+
+    return 0;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+
+static vm_fault_t zhpe_vma_fault(struct vm_fault *vmf)
+{
+    return zhpe_fault(vmf->vma, vmf);
+}
+
+#else
+
+static vm_fault_t zhpe_vma_fault(struct vm_area_struct *vma,
+                                 struct vm_fault *vmf)
+{
+    return zhpe_fault(vma, vmf);
 }
 
+#endif
+
 static struct vm_operations_struct zhpe_vm_ops = {
     .open               = zhpe_vma_open,
     .close              = zhpe_vma_close,
+    .fault              = zhpe_vma_fault,
 };
 
 static int zhpe_mmap(struct file *file, struct vm_area_struct *vma)
 {
     int                 ret = -ENOENT;
     struct file_data    *fdata = file->private_data;
-    pid_t               pid = task_tgid_vnr(current);
+    pid_t               pid = task_tgid_nr(current);
     struct zmap         *zmap;
-    struct zpages       *zpages;
-    ulong               vaddr;
-    ulong               i;
+    struct zpages       *zpages = NULL;
 
-    vma->vm_flags |= VM_MIXEDMAP;
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
     vma->vm_ops = &zhpe_vm_ops;
     vma->vm_private_data = NULL;
 
+    /* Take the pages while the zmap can't go away. */
     spin_lock(&zmap_lock);
-    list_for_each_entry(zmap, &zmap_list, list) {
-        if (vma->vm_pgoff << PAGE_SHIFT == zmap->offset &&
-            vma->vm_end - vma->vm_start == zmap->zpages->size) {
-            if (!zmap->owner || zmap->owner == fdata ||
-                (helper_pid == pid && zmap->owner != ZMAP_BAD_OWNER))
-                ret = 0;
-            break;
-        }
+    zmap = zmap_find(vma->vm_pgoff << PAGE_SHIFT);
+    if (zmap && vma->vm_end - vma->vm_start == zmap->zpages->size &&
+        (!zmap->owner || zmap->owner == fdata ||
+         (helper_pid == pid && zmap->owner != ZMAP_BAD_OWNER))) {
+        zpages = zpages_get(zmap->zpages);
+        ret = 0;
     }
     spin_unlock(&zmap_lock);
     if (ret < 0)
@@ -1220,31 +2639,14 @@ static int zhpe_mmap(struct file *file, struct vm_area_struct *vma)
         vma->vm_flags &= ~VM_MAYWRITE;
     }
 
-    zpages = zmap->zpages;
-    vma->vm_private_data = zmap;
-
-    for (vaddr = vma->vm_start, i = 0; vaddr < vma->vm_end;
-         vaddr += PAGE_SIZE, i++) {
-        ret = vm_insert_page(vma, vaddr, virt_to_page(zpages->pages[i]));
-        if (ret < 0) {
-            printk(KERN_ERR "%s:%s,%u:vm_insert_page() returned %d\n",
-                   driver_name, __FUNCTION__, __LINE__, ret);
-            break;
-        }
-    }
+    vma->vm_private_data = zpages;
     ret = 0;
 
  done:
     if (ret < 0) {
-        if (vma->vm_private_data) {
-            /*
-             * I don't think close gets called if we return error, so
-             * call it ourselves and clear vm_private_data in case I am
-             * wrong.
-             */
-            zhpe_vma_close(vma);
-            vma->vm_private_data = NULL;
-        }
+        /* close isn't called if we return an error. */
+        zpages_free(zpages);
+        vma->vm_private_data = NULL;
         printk(KERN_ERR "%s:%s,%u:ret = %d:start 0x%lx end 0x%lx off 0x%lx\n",
                driver_name, __FUNCTION__, __LINE__, ret,
                vma->vm_start, vma->vm_end, vma->vm_pgoff);
@@ -1261,6 +2663,8 @@ static const struct file_operations zhpe_fops = {
     .release            =       zhpe_release,
     .read               =       zhpe_read,
     .write              =       zhpe_write,
+    .unlocked_ioctl     =       zhpe_ioctl,
+    .compat_ioctl       =       zhpe_ioctl,
     .poll               =       zhpe_poll,
     .mmap               =       zhpe_mmap,
     .llseek             =       no_llseek,
@@ -1278,13 +2682,19 @@ static int zhpe_helper_release(struct inode *inode, struct file *file)
     spin_unlock(&fdata->io_lock);
     free_zmap_list(fdata);
     free_io_lists(fdata);
-    for (i = 0; i < hdata->tracker_max; i++) {
-        entry = hdata->tracker[i];
-        if ((uintptr_t)entry < hdata->tracker_max)
+    /* Claim whatever try_tracker_save() didn't back out. */
+    smp_mb();
+    for (i = 1; i < hdata->tracker_max; i++) {
+        entry = xchg(&hdata->tracker[i], NULL);
+        if (!entry)
             continue;
         debug(DEBUG_RELEASE, "%s:%s,%u:0x%04x entry 0x%p list %d\n",
               driver_name, __FUNCTION__, __LINE__, i, entry,
               !list_empty(&entry->list));
+        if (entry->hdr.opcode == ZHPE_OP_HELPER_RELEASE && entry->fdata)
+            free_zmap_list(entry->fdata);
+        if (entry->zmr)
+            (void)mr_reg_done(entry, -EIO);
         if (entry->fdata && queue_io_rsp(entry, 0, -EIO) >= 0)
             entry = NULL;
         put_io_entry(entry);
@@ -1302,6 +2712,58 @@ static void zhpe_helper_rsp_HELPER_NOP(struct helper_data *hdata,
         put_io_entry(entry);
 }
 
+static void zhpe_helper_rsp_HELPER_QALLOC(struct helper_data *hdata,
+                                          struct io_entry *entry)
+{
+    union zhpe_rsp      *rsp = &entry->op.rsp;
+    int                 status = rsp->hdr.status;
+
+    if (status < 0)
+        (void)zmap_info(entry->fdata, &rsp->qalloc.info, true);
+    if (queue_io_rsp(entry, sizeof(rsp->qalloc), status) < 0)
+        put_io_entry(entry);
+}
+
+static void zhpe_helper_rsp_HELPER_QFREE(struct helper_data *hdata,
+                                         struct io_entry *entry)
+{
+    union zhpe_rsp      *rsp = &entry->op.rsp;
+    int                 status = rsp->hdr.status;
+
+    if (status >= 0)
+        status = zmap_info(entry->fdata, &rsp->helper_qfree.info, true);
+    if (queue_io_rsp(entry, sizeof(rsp->qfree), status) < 0)
+        put_io_entry(entry);
+}
+
+static void zhpe_helper_rsp_HELPER_MR_REG(struct helper_data *hdata,
+                                          struct io_entry *entry)
+{
+    union zhpe_rsp      *rsp = &entry->op.rsp;
+    int                 status = rsp->hdr.status;
+
+    if (entry->zmr)
+        status = mr_reg_done(entry, status);
+    if (queue_io_rsp(entry, sizeof(rsp->mr_reg), status) < 0)
+        put_io_entry(entry);
+}
+
+static void zhpe_helper_rsp_HELPER_MR_DEREG(struct helper_data *hdata,
+                                            struct io_entry *entry)
+{
+    union zhpe_rsp      *rsp = &entry->op.rsp;
+
+    if (queue_io_rsp(entry, sizeof(rsp->mr_dereg), rsp->hdr.status) < 0)
+        put_io_entry(entry);
+}
+
+static void zhpe_helper_rsp_HELPER_RELEASE(struct helper_data *hdata,
+                                           struct io_entry *entry)
+{
+    free_zmap_list(entry->fdata);
+    put_io_entry(entry);
+}
+
 static int zhpe_helper_rsp_HELPER_INIT(struct helper_data *hdata,
                                        struct io_entry *entry)
 {
@@ -1318,6 +2780,46 @@ static int zhpe_helper_rsp_HELPER_INIT(struct helper_data *hdata,
     return 0;
 }
 
+/* Dispatch a helper response; op_len == 0 skips the length check. */
+static int helper_rsp(struct helper_data *hdata, struct io_entry *entry,
+                      size_t op_len)
+{
+    int                 ret = -EINVAL;
+
+#define HELPER_RSP_HANDLER(_op)                                 \
+    case ZHPE_OP_ ## _op | ZHPE_OP_RESPONSE:                    \
+        debug(DEBUG_IO, "%s:%s:ZHPE_OP_" # _op " RSP",          \
+              driver_name, __FUNCTION__);                       \
+        if (op_len && op_len != sizeof(struct zhpe_rsp_ ## _op)) \
+            goto done;                                          \
+        zhpe_helper_rsp_ ## _op(hdata, entry);                  \
+        break;
+
+    ret = 0;
+
+    switch (entry->op.hdr.opcode) {
+
+    HELPER_RSP_HANDLER(HELPER_NOP);
+    HELPER_RSP_HANDLER(HELPER_INIT);
+    HELPER_RSP_HANDLER(HELPER_QALLOC);
+    HELPER_RSP_HANDLER(HELPER_QFREE);
+    HELPER_RSP_HANDLER(HELPER_MR_REG);
+    HELPER_RSP_HANDLER(HELPER_MR_DEREG);
+    HELPER_RSP_HANDLER(HELPER_RELEASE);
+
+    default:
+        printk(KERN_WARNING "%s:%s,%u:Unexpected opcode 0x%02x\n",
+               driver_name, __FUNCTION__, __LINE__, entry->op.hdr.opcode);
+        ret = -EIO;
+        break;
+    }
+
+#undef HELPER_RSP_HANDLER
+
+ done:
+    return ret;
+}
+
 static ssize_t zhpe_helper_write(struct file *file, const char __user *buf,
                                  size_t len, loff_t *ppos)
 {
@@ -1331,14 +2833,9 @@ static ssize_t zhpe_helper_write(struct file *file, const char __user *buf,
     if (!len)
         goto done;
 
-    if (!tracker_sane(__FUNCTION__, __LINE__, helper_data)) {
-        ret = -EIO;
-        goto done;
-    }
-
     /*
      * Weird semantics: requires write be a packet containing a single
-     * request/response.
+     * response. Only used before the ring is up.
      */
     if (len < sizeof(hdr)) {
         ret = -EINVAL;
@@ -1347,85 +2844,41 @@ static ssize_t zhpe_helper_write(struct file *file, const char __user *buf,
         goto done;
     }
 
-    op_len = sizeof(hdr);
-    if (op_len > len)
-        op_len = len;
-    ret = copy_from_user(&hdr, buf, op_len);
+    ret = copy_from_user(&hdr, buf, sizeof(hdr));
     if (ret < 0)
         goto done;
 
     ret = -EINVAL;
     if (!expected_saw("version", ZHPE_OP_VERSION, hdr.version))
         goto done;
-    if (hdr.opcode & ZHPE_OP_RESPONSE) {
-        entry = tracker_fetch(hdata, hdr.index);
-        if (!entry)
-            goto done;
-        /* XXX: Override nonblock setting for fetched entry. */
-        entry->nonblock = nonblock;
-    } else {
-        entry = io_alloc(0, nonblock, &hdata->fdata, io_free);
-        if (!entry) {
-            ret = (nonblock ? -EAGAIN : -ENOMEM);
-            goto done;
-        }
-        entry->hdr = hdr;
+    if (!(hdr.opcode & ZHPE_OP_RESPONSE)) {
+        printk(KERN_WARNING "%s:%s,%u:Unexpected opcode 0x%02x\n",
+               driver_name, __FUNCTION__, __LINE__, hdr.opcode);
+        ret = -EIO;
+        goto done;
     }
+    entry = tracker_fetch(hdata, hdr.index);
+    if (!entry)
+        goto done;
+    /* XXX: Override nonblock setting for fetched entry. */
+    entry->nonblock = nonblock;
 
     op_len = sizeof(entry->op);
     if (op_len > len)
         op_len = len;
     ret = copy_from_user(&entry->op, buf, op_len);
 
-#define HELPER_REQ_HANDLER(_op)                         \
-    case ZHPE_OP_ ## _op:                               \
-        debug(DEBUG_IO, "%s:%s:ZHPE_OP_" # _op,         \
-              driver_name, __FUNCTION__);               \
-        if (op_len != sizeof(struct zhpe_req_ ## _op))  \
-            goto done;                                  \
-        ret = zhpe_helper_req_ ## _op(entry);           \
-        break;
-
-#define HELPER_RSP_HANDLER(_op)                         \
-    case ZHPE_OP_ ## _op | ZHPE_OP_RESPONSE:            \
-        debug(DEBUG_IO, "%s:%s:ZHPE_OP_" # _op " RSP",  \
-              driver_name, __FUNCTION__);               \
-        if (op_len != sizeof(struct zhpe_rsp_ ## _op))  \
-            goto done;                                  \
-        zhpe_helper_rsp_ ## _op(hdata, entry);          \
-        break;
-
-    ret = 0;
-
-    switch (hdr.opcode) {
-
-    HELPER_RSP_HANDLER(HELPER_NOP);
-    HELPER_RSP_HANDLER(HELPER_INIT);
-
-    default:
-        printk(KERN_WARNING "%s:%s,%u:Unexpected opcode 0x%02x\n",
-               driver_name, __FUNCTION__, __LINE__, hdr.opcode);
-        ret = -EIO;
-        break;
-    }
-
-#undef HELPER_REQ_HANDLER
-#undef HELPER_RSP_HANDLER
-
     /*
      * If handler accepts op, it is no longer our responsibility to free
-     * the entry. If the op is refused and is a response, then send the
-     * error back to the originator.
+     * the entry.
      */
+    ret = helper_rsp(hdata, entry, op_len);
     if (ret >= 0)
         entry = NULL;
 
  done:
     put_io_entry(entry);
 
-    if (!tracker_sane(__FUNCTION__, __LINE__, helper_data) && ret >= 0)
-        ret = -EIO;
-
     debug(DEBUG_IO, "%s:%s,%u:ret = %ld len = %ld pid = %d\n",
           driver_name, __FUNCTION__, __LINE__, ret, len,
           task_pid_vnr(current));
@@ -1433,6 +2886,71 @@ static ssize_t zhpe_helper_write(struct file *file, const char __user *buf,
     return (ret < 0 ? ret : len);
 }
 
+/*
+ * Doorbell: consume the responses the helper has posted to the CQ.
+ * Each slot is copied out and cq_head published before the tracker
+ * index is freed, so the CQ can never overflow. Returns the number of
+ * responses consumed.
+ */
+static long helper_ring_reap(struct helper_data *hdata)
+{
+    long                ret = 0;
+    struct cmd_ring     *ring = hdata->fdata.ring;
+    struct io_entry     *entry;
+    union zhpe_op       op;
+    uint32_t            tail;
+
+    if (!ring)
+        return -EINVAL;
+
+    mutex_lock(&ring->cq_mutex);
+    tail = READ_ONCE(ring->hdr->cq_tail);
+    smp_rmb();
+    for (; ring->cq_head != tail; ret++) {
+        op = ring->cq[ring->cq_head & (ring->entries - 1)];
+        ring->cq_head++;
+        smp_mb();
+        WRITE_ONCE(ring->hdr->cq_head, ring->cq_head);
+        if (!expected_saw("version", ZHPE_OP_VERSION, op.hdr.version) ||
+            !(op.hdr.opcode & ZHPE_OP_RESPONSE))
+            continue;
+        entry = tracker_fetch(hdata, op.hdr.index);
+        if (!entry)
+            continue;
+        entry->op = op;
+        if (helper_rsp(hdata, entry, 0) < 0)
+            put_io_entry(entry);
+    }
+    mutex_unlock(&ring->cq_mutex);
+
+    return ret;
+}
+
+static long zhpe_helper_ioctl(struct file *file, uint cmd, ulong arg)
+{
+    struct helper_data  *hdata = file->private_data;
+
+    if (cmd != ZHPE_IOC_HELPER_DOORBELL)
+        return -ENOTTY;
+
+    return helper_ring_reap(hdata);
+}
+
+static uint zhpe_helper_poll(struct file *file, struct poll_table_struct *wait)
+{
+    uint                ret = 0;
+    struct helper_data  *hdata = file->private_data;
+    struct cmd_ring     *ring = hdata->fdata.ring;
+
+    poll_wait(file, &hdata->fdata.poll_wqh, wait);
+    ret |= (list_empty(&hdata->fdata.rd_list) ? 0 : POLLIN | POLLRDNORM);
+    if (ring && (READ_ONCE(ring->hdr->sq_tail) !=
+                 READ_ONCE(ring->hdr->sq_head)))
+        ret |= POLLIN | POLLRDNORM;
+
+    return ret;
+}
+
 /* If any ops are added this, they must be cleared in zhpe_exit(). */
 
 static const struct file_operations zhpe_helper_fops = {
@@ -1440,7 +2958,9 @@ static const struct file_operations zhpe_helper_fops = {
     .release            =       zhpe_helper_release,
     .read               =       zhpe_read,
     .write              =       zhpe_helper_write,
-    .poll               =       zhpe_poll,
+    .unlocked_ioctl     =       zhpe_helper_ioctl,
+    .compat_ioctl       =       zhpe_helper_ioctl,
+    .poll               =       zhpe_helper_poll,
     .mmap               =       zhpe_mmap,
     .llseek             =       no_llseek,
 };
@@ -1456,7 +2976,7 @@ static int zhpe_open(struct inode *inode, struct file *file)
 {
     int                 ret = -ENOMEM;
     struct file_data    *fdata = NULL;
-    bool                is_helper = (helper_pid == task_pid_vnr(current));
+    bool                is_helper = (helper_pid == task_pid_nr(current));
     size_t              size;
     struct helper_data  *hdata;
     uint                i;
@@ -1465,7 +2985,8 @@ static int zhpe_open(struct inode *inode, struct file *file)
     const struct file_operations *fops_orig;
 
     if (is_helper)
-        size = sizeof(*hdata) + sizeof(hdata->tracker[0]) *tracker_max;
+        size = sizeof(*hdata) + (sizeof(hdata->tracker[0]) +
+                                 sizeof(hdata->tracker_next[0])) * tracker_max;
     else
         size = sizeof(*fdata);
     fdata = do_kmalloc(size, GFP_KERNEL, true);
@@ -1474,9 +2995,15 @@ static int zhpe_open(struct inode *inode, struct file *file)
 
     fdata->free = file_data_free;
     atomic_set(&fdata->count, 1);
+    fdata->owner = atomic64_inc_return(&owner_seq);
     spin_lock_init(&fdata->io_lock);
     init_waitqueue_head(&fdata->io_wqh);
+    init_waitqueue_head(&fdata->poll_wqh);
     INIT_LIST_HEAD(&fdata->rd_list);
+    INIT_LIST_HEAD(&fdata->zmap_list);
+    INIT_LIST_HEAD(&fdata->mr_list);
+    fdata->mr_cache = NULL;
+    fdata->ring = NULL;
 
     /* Are we being called from the main thread of the helper? */
     if (is_helper) {
@@ -1487,13 +3014,19 @@ static int zhpe_open(struct inode *inode, struct file *file)
         hdata->fdata.free = helper_data_free;
         /* Initialize tracker data; skip first slot: index == 0 reserved. */
         init_waitqueue_head(&hdata->tracker_wqh);
+        init_waitqueue_head(&hdata->tracker_poll_wqh);
         hdata->tracker_max = tracker_max;
-        for (i = 1; i < hdata->tracker_max - 1; i++)
-            hdata->tracker[i] = (void *)(uintptr_t)(i + 1);
-        hdata->tracker[i] = 0;
-        hdata->tracker_free = (void *)(uintptr_t)1;
-        hdata->tracker_freecnt = hdata->tracker_max - 1;
-        if (!tracker_sane(__FUNCTION__, __LINE__, hdata))
+        hdata->tracker_next = (void *)&hdata->tracker[tracker_max];
+        hdata->tracker_next[0] = 0;
+        for (i = 1; i < hdata->tracker_max; i++) {
+            hdata->tracker[i] = NULL;
+            hdata->tracker_next[i] = (i + 1 < hdata->tracker_max ? i + 1 : 0);
+        }
+        atomic64_set(&hdata->tracker_free, (hdata->tracker_max > 1 ? 1 : 0));
+        atomic_set(&hdata->tracker_freecnt, hdata->tracker_max - 1);
+        /* The SQ needs a slot for every index. */
+        ret = ring_alloc(&hdata->fdata, hdata->tracker_max, -1);
+        if (ret < 0)
             goto done;
         /* Extra count to make sure structure isn't freed until zhpe_exit. */
         get_file_data(&hdata->fdata);
@@ -1521,6 +3054,9 @@ static int zhpe_open(struct inode *inode, struct file *file)
             req->hdr.opcode = ZHPE_OP_HELPER_INIT;
             req->helper_init.shared_offset = shared_zmap->offset;
             req->helper_init.shared_size = shared_zmap->zpages->size;
+            req->helper_init.ring_off = hdata->fdata.ring->zmap->offset;
+            req->helper_init.ring_size = hdata->fdata.ring->zmap->zpages->size;
+            req->helper_init.ring_entries = hdata->fdata.ring->entries;
             ret = queue_io_helper(entry, sizeof(req->helper_init));
             if (ret < 0)
                 put_io_entry(entry);
@@ -1550,7 +3086,7 @@ static int helper_init(struct subprocess_info *info, struct cred *new)
 {
     pid_t               *pidp = info->data;
 
-    *pidp = task_pid_vnr(current);
+    *pidp = task_pid_nr(current);
 
     return 0;
 }
@@ -1597,14 +3133,14 @@ static int __init zhpe_init(void)
                driver_name, __FUNCTION__, backend);
         goto done;
     }
-    if (default_attr.backend != ZHPEQ_BACKEND_LIBFABRIC) {
-        printk(KERN_WARNING
-               "%s:%s:only LIBFABRIC backend supported at this time.\n",
-               driver_name, __FUNCTION__);
-        goto done;
-    }
 
     ret = -ENOMEM;
+    io_cache = kmem_cache_create("zhpe_io_entry", sizeof(struct io_entry),
+                                 0, SLAB_HWCACHE_ALIGN, NULL);
+    zmap_cache = kmem_cache_create("zhpe_zmap", sizeof(struct zmap),
+                                   0, SLAB_HWCACHE_ALIGN, NULL);
+    if (!io_cache || !zmap_cache)
+        goto done;
     zpages = zpages_alloc(sizeof(*shared_data), false);
     if (!zpages)
         goto done;
@@ -1615,13 +3151,21 @@ static int __init zhpe_init(void)
         goto done;
     }
     /* Make sure owner is seen before we advertise it. */
-    shared_zmap->owner = NULL;
+    zmap_set_owner(shared_zmap, NULL);
     smp_wmb();
     shared_data = zpages->pages[0];
     shared_data->magic = ZHPE_MAGIC;
     shared_data->version = ZHPE_SHARED_VERSION;
     shared_data->debug_flags = debug_flags;
     shared_data->default_attr = default_attr;
+    /* Let user space convert cycles without calibrating. */
+    if (tsc_khz && boot_cpu_has(X86_FEATURE_CONSTANT_TSC) &&
+        boot_cpu_has(X86_FEATURE_NONSTOP_TSC)) {
+        shared_data->tsc_freq = (uint64_t)tsc_khz * 1000;
+        clocks_calc_mult_shift(&shared_data->tsc_mult,
+                               &shared_data->tsc_shift,
+                               shared_data->tsc_freq, NSEC_PER_SEC, 600);
+    }
     check_off = zpages->size - sizeof(ulong);
     if (check_off >= sizeof(*shared_data)) {
         check_val = shared_zmap->offset + check_off;
@@ -1679,6 +3223,10 @@ static void zhpe_exit(void)
     struct io_entry     *entry;
     union zhpe_req      *req;
 
+#if MR_CACHE
+    /* Unpin dead registrations while the helper can still drop them. */
+    flush_work(&zmr_work);
+#endif
     /*
      * The only thing that can be accessing the driver, now, is the helper.
      * If the helper never opened the control file, skip to the end.
@@ -1726,7 +3274,13 @@ done:
                driver_name, __FUNCTION__);
         wait_event(helper_wqh, free_zmap_list(NULL));
     }
+    zpool_drain();
 
+    kmem_cache_destroy(zmap_cache);
+    kmem_cache_destroy(io_cache);
+
+#if !defined(NDEBUG)
     printk(KERN_INFO "%s:%s mem_total %lu\n",
                  driver_name, __FUNCTION__, atomic64_read(&mem_total));
+#endif
 }
@@ -34,10 +34,16 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE
+
+#include <limits.h>
 #include <poll.h>
 #include <pthread.h>
+#include <sched.h>
 
 #include <sys/mman.h>
+#include <sys/queue.h>
+#include <sys/uio.h>
 
 #include <zhpe.h>
 #include <zhpeq_util.h>
@@ -45,12 +51,110 @@
 #define OPEN_TRIES      (10)
 #define POLL_TIMEOUT    (1000)
 
+/*
+ * The zhpe backend is emulated by a pool of data movers that poll the
+ * rings of every queue on the node, the way the bridge would, and copy
+ * between registered regions with process_vm_readv/writev.
+ */
+#define MOVER_THREADS   (2)
+#define MOVER_SPIN_NS   (20000)
+#define MOVER_SLEEP_NS  (1000)
+#define MOVER_SLEEP_MAX_NS (100000)
+#define MOVER_BOUNCE    ((size_t)1 << 20)
+
+#define MR_TAB_MIN      (1024)
+
+/*
+ * Requests from the ring are handled by a pool of workers, pinned to the
+ * CPUs of each NUMA node; responses complete out of order.
+ */
+#define WORKERS_PER_NODE (2)
+#define WORKER_MAX      (32)
+#define NODE_PATH       "/sys/devices/system/node"
+#define KEY_MASK_ADDR   (((uint64_t)1 << ZHPE_KEY_SHIFT) - 1)
+
 static char             *dev_name = "/dev/" DRIVER_NAME;
 static int               dev_fd = -1;
 
 static struct zhpe_shared_data *shared_data;
 static uint debug_flags;
 
+/* Request/response ring shared with the driver, once HELPER_INIT is done. */
+static struct zhpe_ring_hdr *ring;
+static union zhpe_op    *ring_sq;
+static union zhpe_op    *ring_cq;
+static uint32_t         ring_mask;
+static pthread_mutex_t  ring_cq_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t         ring_cq_tail;
+
+struct worker {
+    pthread_t           thread;
+    cpu_set_t           cpus;
+    bool                pinned;
+    bool                started;
+};
+
+/*
+ * Requests the dispatcher has taken from the SQ; there is never more
+ * than a ring's worth outstanding, so work_ops[] is indexed like the ring.
+ */
+static struct worker    workers[WORKER_MAX];
+static uint             n_workers;
+static pthread_mutex_t  work_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t   work_idle_cond = PTHREAD_COND_INITIALIZER;
+static union zhpe_op    *work_ops;
+static uint32_t         work_head;
+static uint32_t         work_tail;
+static uint             work_busy;
+static bool             workers_halt;
+static int              workers_error;
+
+struct hqueue {
+    STAILQ_ENTRY(hqueue) list;
+    uint64_t            owner;
+    pid_t               pid;
+    struct zhpe_info    info;
+    struct zhpe_hw_reg  *reg;
+    union zhpe_hw_wq_entry *wq;
+    union zhpe_hw_cq_entry *cq;
+    uint32_t            wq_head;
+    uint32_t            cq_tail;
+};
+
+STAILQ_HEAD(hqueue_head, hqueue);
+
+struct mover {
+    pthread_t           thread;
+    pthread_mutex_t     mutex;
+    struct hqueue_head  queues;
+    uint                n_queues;
+    void                *bounce;
+    bool                started;
+};
+
+/* A registered region; the key is the index. pid == 0 if free. */
+struct hmr {
+    uint64_t            owner;
+    uint64_t            vaddr;
+    uint64_t            len;
+    pid_t               pid;
+    uint32_t            access;
+};
+
+static struct mover     movers[MOVER_THREADS];
+static volatile bool    movers_halt;
+
+static pthread_rwlock_t mr_rwlock = PTHREAD_RWLOCK_INITIALIZER;
+static struct hmr       *mr_tab;
+static uint32_t         *mr_free;
+static uint64_t         mr_n_free;
+static uint64_t         mr_hwm;
+static uint64_t         mr_max;
+
+/* Remote atomics are read-modify-write, so they are done one at a time. */
+static pthread_mutex_t  atm_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 #if defined(NDEBUG)
 #define debug_cond(_mask, _cond, _fmt, ...) do {} while (0)
 #define debug(_mask, _fmt, ...) do {} while (0)
@@ -78,24 +182,964 @@ static void usage(void)
 }
 
 static int write_rsp(const char *callf, uint line,
-                     union zhpe_rsp *rsp, size_t len, int status)
+                     union zhpe_rsp *rsp, size_t len)
 {
     ssize_t             res;
 
+    res = write(dev_fd, rsp, len);
+    return check_func_io(callf, line, "write", dev_name, len, res, 0);
+}
+
+static inline uint8_t cq_valid(uint32_t idx, uint32_t qmask)
+{
+    return ((idx & (qmask + 1)) ? 0 : ZHPE_HW_CQ_VALID);
+}
+
+/*
+ * The pids in QALLOC and MR_REG requests are global: the driver takes
+ * them in the initial pid namespace, where the helper runs, so they can
+ * be handed to process_vm_*() as they are.
+ */
+static int vm_io(pid_t pid, void *buf, uint64_t addr, size_t len, bool write)
+{
+    struct iovec        liov = { .iov_base = buf, .iov_len = len };
+    struct iovec        riov = { .iov_base = TO_PTR(addr), .iov_len = len };
+    ssize_t             res;
+
+    if (write)
+        res = process_vm_writev(pid, &liov, 1, &riov, 1, 0);
+    else
+        res = process_vm_readv(pid, &liov, 1, &riov, 1, 0);
+    if (res == -1)
+        return -errno;
+    if (res != len)
+        return -EFAULT;
+
+    return 0;
+}
+
+static int vm_copy(struct mover *mover, pid_t dst_pid, uint64_t dst,
+                   pid_t src_pid, uint64_t src, size_t len)
+{
+    int                 ret = 0;
+    size_t              n;
+
+    for (; len > 0; len -= n, src += n, dst += n) {
+        n = (len < MOVER_BOUNCE ? len : MOVER_BOUNCE);
+        ret = vm_io(src_pid, mover->bounce, src, n, false);
+        if (ret < 0)
+            break;
+        ret = vm_io(dst_pid, mover->bounce, dst, n, true);
+        if (ret < 0)
+            break;
+    }
+
+    return ret;
+}
+
+/* Translate a zaddr into the pid and vaddr of the region it names. */
+static int mr_lookup(uint64_t zaddr, size_t len, uint32_t access,
+                     struct hmr *mr_out)
+{
+    int                 ret = -EINVAL;
+    uint64_t            key = zaddr >> ZHPE_KEY_SHIFT;
+    uint64_t            off = zaddr & KEY_MASK_ADDR;
+    struct hmr          *mr;
+
+    pthread_rwlock_rdlock(&mr_rwlock);
+    if (key < mr_hwm) {
+        mr = &mr_tab[key];
+        if (mr->pid && (mr->access & access) == access &&
+            off + len <= mr->len) {
+            *mr_out = *mr;
+            mr_out->vaddr += off;
+            ret = 0;
+        }
+    }
+    pthread_rwlock_unlock(&mr_rwlock);
+
+    return ret;
+}
+
+static int mr_lookup_lcl(struct hqueue *hq, uint64_t zaddr, size_t len,
+                         uint32_t access, struct hmr *mr_out)
+{
+    int                 ret;
+
+    ret = mr_lookup(zaddr, len, access, mr_out);
+    if (ret >= 0 && mr_out->pid != hq->pid)
+        ret = -EINVAL;
+
+    return ret;
+}
+
+static int atm_calc(uint16_t opcode, bool is64, uint64_t old,
+                    uint64_t op0, uint64_t op1, uint64_t *new)
+{
+    int64_t             sold = (is64 ? (int64_t)old : (int32_t)old);
+    int64_t             sop0 = (is64 ? (int64_t)op0 : (int32_t)op0);
+
+    switch (opcode) {
+
+    case ZHPE_HW_OPCODE_ATM_SWAP:
+        *new = op0;
+        break;
+
+    case ZHPE_HW_OPCODE_ATM_ADD:
+        *new = old + op0;
+        break;
+
+    case ZHPE_HW_OPCODE_ATM_AND:
+        *new = old & op0;
+        break;
+
+    case ZHPE_HW_OPCODE_ATM_OR:
+        *new = old | op0;
+        break;
+
+    case ZHPE_HW_OPCODE_ATM_XOR:
+        *new = old ^ op0;
+        break;
+
+    case ZHPE_HW_OPCODE_ATM_SMIN:
+        *new = (sop0 < sold ? op0 : old);
+        break;
+
+    case ZHPE_HW_OPCODE_ATM_SMAX:
+        *new = (sop0 > sold ? op0 : old);
+        break;
+
+    case ZHPE_HW_OPCODE_ATM_UMIN:
+        *new = (op0 < old ? op0 : old);
+        break;
+
+    case ZHPE_HW_OPCODE_ATM_UMAX:
+        *new = (op0 > old ? op0 : old);
+        break;
+
+    case ZHPE_HW_OPCODE_ATM_CAS:
+        /* operands[1] is the compare value. */
+        *new = (old == op1 ? op0 : old);
+        break;
+
+    default:
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+/*
+ * Atomics are atomic with respect to other fabric atomics, which all come
+ * through here, but not with respect to CPU atomics in the target.
+ */
+static int atm_do(union zhpe_hw_wq_entry *wqe, struct hmr *rem,
+                  struct zhpeq_result *result)
+{
+    int                 ret;
+    uint16_t            opcode = wqe->hdr.opcode & ~ZHPE_HW_OPCODE_FENCE;
+    bool                is64 = ((wqe->atm.size & ZHPE_HW_ATOMIC_SIZE_MASK) ==
+                                ZHPE_HW_ATOMIC_SIZE_64);
+    size_t              len = (is64 ? sizeof(uint64_t) : sizeof(uint32_t));
+    union zhpeq_atomic  old = { .u64 = 0 };
+    union zhpeq_atomic  new = { .u64 = 0 };
+    uint64_t            op0;
+    uint64_t            op1;
+
+    if (rem->vaddr & (len - 1))
+        return -EINVAL;
+    if (is64) {
+        op0 = wqe->atm.operands[0].u64;
+        op1 = wqe->atm.operands[1].u64;
+    } else {
+        op0 = wqe->atm.operands[0].u32;
+        op1 = wqe->atm.operands[1].u32;
+    }
+
+    mutex_lock(&atm_mutex);
+    ret = vm_io(rem->pid, &old, rem->vaddr, len, false);
+    if (ret < 0)
+        goto unlock;
+    ret = atm_calc(opcode, is64, (is64 ? old.u64 : old.u32), op0, op1,
+                   &new.u64);
+    if (ret < 0)
+        goto unlock;
+    if (!is64)
+        new.u32 = new.u64;
+    if (memcmp(&new, &old, len))
+        ret = vm_io(rem->pid, &new, rem->vaddr, len, true);
+ unlock:
+    mutex_unlock(&atm_mutex);
+    if (ret >= 0)
+        memcpy(result->data, &old, len);
+
+    return ret;
+}
+
+static int wqe_do(struct mover *mover, struct hqueue *hq,
+                  union zhpe_hw_wq_entry *wqe, struct zhpeq_result *result)
+{
+    int                 ret = -EINVAL;
+    uint16_t            opcode = wqe->hdr.opcode & ~ZHPE_HW_OPCODE_FENCE;
+    struct hmr          lcl;
+    struct hmr          rem;
+    size_t              len;
+
+    /* Entries are done in order, so fences need no work. */
+    switch (opcode) {
+
+    case ZHPE_HW_OPCODE_NOP:
+        ret = 0;
+        break;
+
+    case ZHPE_HW_OPCODE_PUT:
+        len = wqe->dma.len;
+        ret = mr_lookup_lcl(hq, wqe->dma.lcl_addr, len, ZHPEQ_MR_PUT, &lcl);
+        if (ret < 0)
+            break;
+        ret = mr_lookup(wqe->dma.rem_addr, len, ZHPEQ_MR_PUT_REMOTE, &rem);
+        if (ret < 0)
+            break;
+        ret = vm_copy(mover, rem.pid, rem.vaddr, lcl.pid, lcl.vaddr, len);
+        break;
+
+    case ZHPE_HW_OPCODE_GET:
+        len = wqe->dma.len;
+        ret = mr_lookup_lcl(hq, wqe->dma.lcl_addr, len, ZHPEQ_MR_GET, &lcl);
+        if (ret < 0)
+            break;
+        ret = mr_lookup(wqe->dma.rem_addr, len, ZHPEQ_MR_GET_REMOTE, &rem);
+        if (ret < 0)
+            break;
+        ret = vm_copy(mover, lcl.pid, lcl.vaddr, rem.pid, rem.vaddr, len);
+        break;
+
+    case ZHPE_HW_OPCODE_PUTIMM:
+        len = wqe->imm.len;
+        if (len > ZHPEQ_IMM_MAX)
+            break;
+        ret = mr_lookup(wqe->imm.rem_addr, len, ZHPEQ_MR_PUT_REMOTE, &rem);
+        if (ret < 0)
+            break;
+        ret = vm_io(rem.pid, wqe->imm.data, rem.vaddr, len, true);
+        break;
+
+    case ZHPE_HW_OPCODE_GETIMM:
+        len = wqe->imm.len;
+        if (len > ZHPEQ_IMM_MAX)
+            break;
+        ret = mr_lookup(wqe->imm.rem_addr, len, ZHPEQ_MR_GET_REMOTE, &rem);
+        if (ret < 0)
+            break;
+        ret = vm_io(rem.pid, result->data, rem.vaddr, len, false);
+        break;
+
+    default:
+        if (opcode < ZHPE_HW_OPCODE_ATM_SWAP ||
+            opcode > ZHPE_HW_OPCODE_ATM_CAS)
+            break;
+        len = (((wqe->atm.size & ZHPE_HW_ATOMIC_SIZE_MASK) ==
+                ZHPE_HW_ATOMIC_SIZE_64) ?
+               sizeof(uint64_t) : sizeof(uint32_t));
+        ret = mr_lookup(wqe->atm.rem_addr, len,
+                        ZHPEQ_MR_GET_REMOTE | ZHPEQ_MR_PUT_REMOTE, &rem);
+        if (ret < 0)
+            break;
+        ret = atm_do(wqe, &rem, result);
+        break;
+    }
+
+    return ret;
+}
+
+/* Consume the new entries on a queue; returns true if there were any. */
+static bool hqueue_process(struct mover *mover, struct hqueue *hq)
+{
+    struct zhpe_hw_reg  *reg = hq->reg;
+    uint32_t            qmask = hq->info.qlen - 1;
+    uint32_t            wq_tail = reg->wq_tail & qmask;
+    union zhpe_hw_wq_entry *wqe;
+    union zhpe_hw_cq_entry *cqe;
+    int                 rc;
+
+    if (hq->wq_head == wq_tail)
+        return false;
+    smp_rmb();
+
+    for (; hq->wq_head != wq_tail; hq->wq_head = (hq->wq_head + 1) & qmask) {
+        wqe = hq->wq + hq->wq_head;
+        cqe = hq->cq + (hq->cq_tail & qmask);
+        rc = wqe_do(mover, hq, wqe, &cqe->entry.result);
+        cqe->entry.index = wqe->hdr.cmp_index;
+        cqe->entry.status = (rc < 0 ? ZHPEQ_CQ_STATUS_FABRIC_UNRECOVERABLE :
+                             ZHPEQ_CQ_STATUS_SUCCESS);
+        smp_wmb();
+        cqe->entry.valid = cq_valid(hq->cq_tail, qmask);
+        hq->cq_tail++;
+    }
+    reg->wq_head = hq->wq_head;
+    reg->cq_tail = hq->cq_tail & qmask;
+
+    return true;
+}
+
+static void *mover_thread(void *arg)
+{
+    struct mover        *mover = arg;
+    struct timespec     ts_sleep = { 0, 0 };
+    struct timespec     ts_beg;
+    struct timespec     ts_end;
+    struct hqueue       *hq;
+    bool                busy;
+
+    if (gettime_raw(&ts_beg) < 0)
+        return NULL;
+
+    while (!movers_halt) {
+        busy = false;
+        mutex_lock(&mover->mutex);
+        STAILQ_FOREACH(hq, &mover->queues, list)
+            busy |= hqueue_process(mover, hq);
+        mutex_unlock(&mover->mutex);
+
+        if (gettime_raw(&ts_end) < 0)
+            break;
+        if (busy) {
+            ts_beg = ts_end;
+            ts_sleep.tv_nsec = 0;
+            continue;
+        }
+        if (ts_delta(&ts_beg, &ts_end) < MOVER_SPIN_NS)
+            continue;
+        /* There is no doorbell to wait on: back off while idle. */
+        if (!ts_sleep.tv_nsec)
+            ts_sleep.tv_nsec = MOVER_SLEEP_NS;
+        else if (ts_sleep.tv_nsec < MOVER_SLEEP_MAX_NS)
+            ts_sleep.tv_nsec *= 2;
+        nanosleep(&ts_sleep, NULL);
+    }
+
+    return NULL;
+}
+
+static int movers_start(void)
+{
+    int                 ret = 0;
+    struct mover        *mover;
+    uint                i;
+
+    for (i = 0; i < MOVER_THREADS; i++) {
+        mover = &movers[i];
+        mutex_init(&mover->mutex, NULL);
+        STAILQ_INIT(&mover->queues);
+        mover->bounce = do_malloc(MOVER_BOUNCE);
+        if (!mover->bounce) {
+            ret = -ENOMEM;
+            break;
+        }
+        ret = -pthread_create(&mover->thread, NULL, mover_thread, mover);
+        if (ret < 0) {
+            print_func_err(__FUNCTION__, __LINE__, "pthread_create", "",
+                           ret);
+            break;
+        }
+        mover->started = true;
+    }
+
+    return ret;
+}
+
+static void hqueue_free(struct hqueue *hq)
+{
+    if (!hq)
+        return;
+
+    if (hq->reg)
+        munmap(hq->reg, hq->info.rsize);
+    if (hq->wq)
+        munmap(hq->wq, hq->info.qsize);
+    if (hq->cq)
+        munmap(hq->cq, hq->info.qsize);
+    do_free(hq);
+}
+
+static void movers_stop(void)
+{
+    struct mover        *mover;
+    struct hqueue       *hq;
+    uint                i;
+
+    movers_halt = true;
+    for (i = 0; i < MOVER_THREADS; i++) {
+        mover = &movers[i];
+        if (mover->started)
+            pthread_join(mover->thread, NULL);
+        while ((hq = STAILQ_FIRST(&mover->queues))) {
+            STAILQ_REMOVE_HEAD(&mover->queues, list);
+            hqueue_free(hq);
+        }
+        do_free(mover->bounce);
+    }
+}
+
+/*
+ * Remove the queues of owner; if reg_off is not ~0, only the queue
+ * with those registers. Returns the number of queues removed.
+ */
+static uint hqueue_remove(uint64_t owner, uint64_t reg_off)
+{
+    uint                ret = 0;
+    struct mover        *mover;
+    struct hqueue       *hq;
+    struct hqueue       *next;
+    uint                i;
+
+    for (i = 0; i < MOVER_THREADS; i++) {
+        mover = &movers[i];
+        mutex_lock(&mover->mutex);
+        for (hq = STAILQ_FIRST(&mover->queues); hq; hq = next) {
+            next = STAILQ_NEXT(hq, list);
+            if (hq->owner != owner ||
+                (reg_off != ~(uint64_t)0 && hq->info.reg_off != reg_off))
+                continue;
+            STAILQ_REMOVE(&mover->queues, hq, hqueue, list);
+            mover->n_queues--;
+            hqueue_free(hq);
+            ret++;
+        }
+        mutex_unlock(&mover->mutex);
+    }
+
+    return ret;
+}
+
+static void *helper_mmap(size_t size, off_t offset, int *error)
+{
+    void                *ret;
+
+    ret = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, dev_fd,
+               offset);
+    if (ret == MAP_FAILED) {
+        *error = -errno;
+        print_func_err(__FUNCTION__, __LINE__, "mmap", dev_name, *error);
+        ret = NULL;
+    }
+
+    return ret;
+}
+
+static int helper_qalloc(union zhpe_op *op)
+{
+    int                 ret = -ENOMEM;
+    struct zhpe_req_HELPER_QALLOC *req = &op->req.helper_qalloc;
+    struct hqueue       *hq;
+    struct mover        *mover;
+    uint                i;
+
+    hq = do_calloc(1, sizeof(*hq));
+    if (!hq)
+        goto done;
+    hq->owner = req->owner;
+    hq->pid = req->pid;
+    hq->info = req->info;
+    hq->reg = helper_mmap(hq->info.rsize, hq->info.reg_off, &ret);
+    if (!hq->reg)
+        goto done;
+    hq->wq = helper_mmap(hq->info.qsize, hq->info.wq_off, &ret);
+    if (!hq->wq)
+        goto done;
+    hq->cq = helper_mmap(hq->info.qsize, hq->info.cq_off, &ret);
+    if (!hq->cq)
+        goto done;
+
+    /* Give the queue to the mover with the fewest. */
+    for (i = 1, mover = movers; i < MOVER_THREADS; i++) {
+        if (movers[i].n_queues < mover->n_queues)
+            mover = &movers[i];
+    }
+    mutex_lock(&mover->mutex);
+    STAILQ_INSERT_TAIL(&mover->queues, hq, list);
+    mover->n_queues++;
+    mutex_unlock(&mover->mutex);
+    hq = NULL;
+    ret = 0;
+
+ done:
+    hqueue_free(hq);
+
+    return ret;
+}
+
+static int helper_qfree(union zhpe_op *op)
+{
+    struct zhpe_req_HELPER_QFREE *req = &op->req.helper_qfree;
+
+    return (hqueue_remove(req->owner, req->info.reg_off) ? 0 : -ENOENT);
+}
+
+static int mr_key_alloc(void)
+{
+    uint64_t            max;
+    void                *new;
+
+    if (mr_n_free)
+        return mr_free[--mr_n_free];
+    if (mr_hwm == mr_max) {
+        max = (mr_max ? mr_max * 2 : MR_TAB_MIN);
+        if (max > ZHPE_KEY_MAX)
+            max = ZHPE_KEY_MAX;
+        if (max == mr_max)
+            return -ENOSPC;
+        new = realloc(mr_tab, max * sizeof(*mr_tab));
+        if (!new)
+            return -ENOMEM;
+        mr_tab = new;
+        new = realloc(mr_free, max * sizeof(*mr_free));
+        if (!new)
+            return -ENOMEM;
+        mr_free = new;
+        mr_max = max;
+    }
+
+    return mr_hwm++;
+}
+
+static int helper_mr_reg(union zhpe_op *op)
+{
+    int                 ret = -EINVAL;
+    struct zhpe_req_HELPER_MR_REG req = op->req.helper_mr_reg;
+    struct zhpe_mr_desc_v1 *desc = &op->rsp.helper_mr_reg.desc.v1;
+    struct hmr          *mr;
+
+    if (!req.kdata.len || req.kdata.len > KEY_MASK_ADDR + 1 || !req.pid)
+        goto done;
+
+    pthread_rwlock_wrlock(&mr_rwlock);
+    ret = mr_key_alloc();
+    if (ret >= 0) {
+        mr = &mr_tab[ret];
+        mr->owner = req.owner;
+        mr->pid = req.pid;
+        mr->vaddr = req.kdata.vaddr;
+        mr->len = req.kdata.len;
+        mr->access = req.kdata.access;
+    }
+    pthread_rwlock_unlock(&mr_rwlock);
+    if (ret < 0)
+        goto done;
+
+    desc->hdr.magic = ZHPE_MAGIC;
+    desc->hdr.version = ZHPE_MR_V1;
+    desc->kdata = req.kdata;
+    desc->kdata.key = ret;
+    desc->kdata.zaddr = ((uint64_t)ret << ZHPE_KEY_SHIFT);
+    ret = 0;
+
+ done:
+    return ret;
+}
+
+static int helper_mr_dereg(union zhpe_op *op)
+{
+    int                 ret = -EINVAL;
+    struct zhpe_req_HELPER_MR_DEREG *req = &op->req.helper_mr_dereg;
+    uint64_t            key = req->desc.v1.kdata.key;
+
+    pthread_rwlock_wrlock(&mr_rwlock);
+    if (key < mr_hwm && mr_tab[key].pid && mr_tab[key].owner == req->owner) {
+        mr_tab[key].pid = 0;
+        mr_free[mr_n_free++] = key;
+        ret = 0;
+    }
+    pthread_rwlock_unlock(&mr_rwlock);
+
+    return ret;
+}
+
+/* A client closed the device: drop everything it had. */
+static int helper_release(union zhpe_op *op)
+{
+    struct zhpe_req_HELPER_RELEASE *req = &op->req.helper_release;
+    uint64_t            key;
+
+    (void)hqueue_remove(req->owner, ~(uint64_t)0);
+
+    pthread_rwlock_wrlock(&mr_rwlock);
+    for (key = 0; key < mr_hwm; key++) {
+        if (mr_tab[key].pid && mr_tab[key].owner == req->owner) {
+            mr_tab[key].pid = 0;
+            mr_free[mr_n_free++] = key;
+        }
+    }
+    pthread_rwlock_unlock(&mr_rwlock);
+
+    return 0;
+}
+
+static int helper_init(union zhpe_op *op)
+{
+    int                 ret = -EINVAL;
+    struct zhpe_req_HELPER_INIT req = op->req.helper_init;
+
+    shared_data = helper_mmap(req.shared_size, req.shared_offset, &ret);
+    if (!shared_data)
+        goto done;
+    ret = -EINVAL;
+    if (!expected_saw("shared_magic", ZHPE_MAGIC, shared_data->magic))
+        goto done;
+    if (!expected_saw("shared_version", ZHPE_SHARED_VERSION,
+                      shared_data->version))
+        goto done;
+
+    debug_flags = shared_data->debug_flags;
+
+    if (!req.ring_entries || (req.ring_entries & (req.ring_entries - 1)))
+        goto done;
+    ring = helper_mmap(req.ring_size, req.ring_off, &ret);
+    if (!ring)
+        goto done;
+    ret = -EINVAL;
+    if (!expected_saw("ring_entries", req.ring_entries, ring->entries))
+        goto done;
+    ring_sq = (void *)ring + ring->sq_off;
+    ring_cq = (void *)ring + ring->cq_off;
+    ring_mask = ring->entries - 1;
+    ret = 0;
+
+ done:
+    return ret;
+}
+
+/*
+ * Handle one request in place. Returns the length of the response,
+ * 0 if the helper should exit, or a fatal error.
+ */
+static ssize_t helper_op(union zhpe_op *op)
+{
+    ssize_t             ret = -EINVAL;
+    union zhpe_rsp      *rsp = &op->rsp;
+    int                 status = 0;
+
+    if (!expected_saw("version", ZHPE_OP_VERSION, op->hdr.version))
+        goto done;
+
+    switch (op->hdr.opcode)  {
+
+    case ZHPE_OP_HELPER_EXIT:
+        debug(DEBUG_IO, "%s,%u:ZHPE_OP_HELPER_EXIT", __FUNCTION__, __LINE__);
+        ret = 0;
+        goto done;
+
+    case ZHPE_OP_HELPER_INIT:
+        debug(DEBUG_IO, "%s,%u:ZHPE_OP_HELPER_INIT", __FUNCTION__, __LINE__);
+        ret = helper_init(op);
+        if (ret < 0)
+            goto done;
+        ret = sizeof(rsp->helper_init);
+        break;
+
+    case ZHPE_OP_HELPER_NOP:
+        debug(DEBUG_IO, "%s,%u:ZHPE_OP_HELPER_NOP", __FUNCTION__, __LINE__);
+        ret = sizeof(rsp->helper_nop);
+        break;
+
+    case ZHPE_OP_HELPER_QALLOC:
+        debug(DEBUG_IO, "%s,%u:ZHPE_OP_HELPER_QALLOC",
+              __FUNCTION__, __LINE__);
+        status = helper_qalloc(op);
+        ret = sizeof(rsp->helper_qalloc);
+        break;
+
+    case ZHPE_OP_HELPER_QFREE:
+        debug(DEBUG_IO, "%s,%u:ZHPE_OP_HELPER_QFREE",
+              __FUNCTION__, __LINE__);
+        status = helper_qfree(op);
+        ret = sizeof(rsp->helper_qfree);
+        break;
+
+    case ZHPE_OP_HELPER_MR_REG:
+        debug(DEBUG_IO, "%s,%u:ZHPE_OP_HELPER_MR_REG",
+              __FUNCTION__, __LINE__);
+        status = helper_mr_reg(op);
+        ret = sizeof(rsp->helper_mr_reg);
+        break;
+
+    case ZHPE_OP_HELPER_MR_DEREG:
+        debug(DEBUG_IO, "%s,%u:ZHPE_OP_HELPER_MR_DEREG",
+              __FUNCTION__, __LINE__);
+        status = helper_mr_dereg(op);
+        ret = sizeof(rsp->helper_mr_dereg);
+        break;
+
+    case ZHPE_OP_HELPER_RELEASE:
+        debug(DEBUG_IO, "%s,%u:ZHPE_OP_HELPER_RELEASE",
+              __FUNCTION__, __LINE__);
+        status = helper_release(op);
+        ret = sizeof(rsp->helper_release);
+        break;
+
+    default:
+        print_err("%s,%u:Unexpected opcode 0x%02x",
+                  __FUNCTION__, __LINE__, op->hdr.opcode);
+        goto done;
+    }
+
     rsp->hdr.version = ZHPE_OP_VERSION;
     rsp->hdr.opcode |= ZHPE_OP_RESPONSE;
     rsp->hdr.status = status;
 
-    res = write(dev_fd, rsp, len);
-    return check_func_io(callf, line, "write", dev_name, len, res, 0);
+ done:
+    return ret;
+}
+
+static void ring_post(union zhpe_op *op)
+{
+    mutex_lock(&ring_cq_mutex);
+    /* The driver keeps a CQ slot free for every request. */
+    ring_cq[ring_cq_tail & ring_mask] = *op;
+    smp_wmb_wb();
+    ring->cq_tail = ++ring_cq_tail;
+    mutex_unlock(&ring_cq_mutex);
+}
+
+static int ring_doorbell(void)
+{
+    int                 ret = 0;
+
+    if (ioctl(dev_fd, ZHPE_IOC_HELPER_DOORBELL) == -1) {
+        ret = -errno;
+        print_func_err(__FUNCTION__, __LINE__, "ioctl", dev_name, -ret);
+    }
+
+    return ret;
+}
+
+static void *worker_thread(void *arg)
+{
+    union zhpe_op       op;
+    ssize_t             len;
+    bool                last;
+
+    for (;;) {
+        mutex_lock(&work_mutex);
+        while (work_head == work_tail && !workers_halt)
+            cond_wait(&work_cond, &work_mutex);
+        if (work_head == work_tail) {
+            mutex_unlock(&work_mutex);
+            break;
+        }
+        op = work_ops[work_head++ & ring_mask];
+        work_busy++;
+        mutex_unlock(&work_mutex);
+
+        len = helper_op(&op);
+        if (len > 0)
+            ring_post(&op);
+
+        mutex_lock(&work_mutex);
+        if (len <= 0 && !workers_error)
+            workers_error = (len < 0 ? len : -EINVAL);
+        work_busy--;
+        last = (work_head == work_tail);
+        if (last && !work_busy)
+            cond_broadcast(&work_idle_cond);
+        mutex_unlock(&work_mutex);
+        /* Ring the doorbell once the queued work runs out. */
+        if (last && len > 0)
+            (void)ring_doorbell();
+    }
+
+    return NULL;
+}
+
+/* Wait until every request handed to the workers has completed. */
+static void workers_drain(void)
+{
+    mutex_lock(&work_mutex);
+    while (work_head != work_tail || work_busy)
+        cond_wait(&work_idle_cond, &work_mutex);
+    mutex_unlock(&work_mutex);
+}
+
+/* Parse a sysfs cpulist, e.g. "0-3,8-11"; returns the number of CPUs. */
+static uint cpulist_parse(const char *list, cpu_set_t *cpus)
+{
+    uint                ret = 0;
+    char                *end;
+    ulong               beg;
+    ulong               last;
+
+    CPU_ZERO(cpus);
+    while (*list) {
+        beg = strtoul(list, &end, 10);
+        if (end == list)
+            break;
+        last = beg;
+        list = end;
+        if (*list == '-') {
+            list++;
+            last = strtoul(list, &end, 10);
+            if (end == list)
+                break;
+            list = end;
+        }
+        for (; beg <= last && beg < CPU_SETSIZE; beg++, ret++)
+            CPU_SET(beg, cpus);
+        if (*list != ',')
+            break;
+        list++;
+    }
+
+    return ret;
+}
+
+/*
+ * WORKERS_PER_NODE workers for each NUMA node with CPUs, pinned to them;
+ * if the topology can't be read, WORKERS_PER_NODE unpinned workers.
+ */
+static void workers_layout(void)
+{
+    char                path[PATH_MAX];
+    char                buf[4096];
+    cpu_set_t           cpus;
+    FILE                *fp;
+    uint                node;
+    uint                i;
+
+    for (node = 0; n_workers < WORKER_MAX; node++) {
+        snprintf(path, sizeof(path), NODE_PATH "/node%u/cpulist", node);
+        fp = fopen(path, "r");
+        if (!fp)
+            break;
+        if (!fgets(buf, sizeof(buf), fp))
+            buf[0] = '\0';
+        fclose(fp);
+        if (!cpulist_parse(buf, &cpus))
+            continue;
+        for (i = 0; i < WORKERS_PER_NODE && n_workers < WORKER_MAX; i++) {
+            workers[n_workers].cpus = cpus;
+            workers[n_workers].pinned = true;
+            n_workers++;
+        }
+    }
+    if (!n_workers)
+        n_workers = WORKERS_PER_NODE;
+}
+
+static int workers_start(void)
+{
+    int                 ret = -ENOMEM;
+    struct worker       *worker;
+    uint                i;
+
+    work_ops = do_calloc(ring_mask + 1, sizeof(*work_ops));
+    if (!work_ops)
+        goto done;
+
+    workers_layout();
+    for (i = 0; i < n_workers; i++) {
+        worker = &workers[i];
+        ret = -pthread_create(&worker->thread, NULL, worker_thread, NULL);
+        if (ret < 0) {
+            print_func_err(__FUNCTION__, __LINE__, "pthread_create", "",
+                           ret);
+            goto done;
+        }
+        worker->started = true;
+        /* Only a hint: run anywhere if the CPUs are unavailable. */
+        if (worker->pinned)
+            (void)pthread_setaffinity_np(worker->thread,
+                                         sizeof(worker->cpus),
+                                         &worker->cpus);
+    }
+    debug(DEBUG_IO, "%s,%u:%u workers", __FUNCTION__, __LINE__, n_workers);
+    ret = 0;
+
+ done:
+    return ret;
+}
+
+static void workers_stop(void)
+{
+    uint                i;
+
+    mutex_lock(&work_mutex);
+    workers_halt = true;
+    cond_broadcast(&work_cond);
+    mutex_unlock(&work_mutex);
+    for (i = 0; i < n_workers; i++) {
+        if (workers[i].started)
+            pthread_join(workers[i].thread, NULL);
+    }
+    do_free(work_ops);
+}
+
+/*
+ * Move every request in the SQ to the workers; if there were none, set
+ * wakeup and sleep in poll() until the driver posts more. RELEASE waits
+ * for the requests before it to complete, so nothing of the owner's can
+ * outlive it, and EXIT waits for everything. Returns 0 if the helper
+ * should exit, < 0 on a fatal error.
+ */
+static int ring_process(void)
+{
+    int                 ret = 1;
+    uint32_t            sq_head = ring->sq_head;
+    uint32_t            n = 0;
+    struct pollfd       pfd = { .fd = dev_fd, .events = POLLIN };
+    union zhpe_op       op;
+    ssize_t             len;
+
+    while (sq_head != ring->sq_tail) {
+        smp_rmb();
+        op = ring_sq[sq_head & ring_mask];
+        ring->sq_head = ++sq_head;
+        if (op.hdr.opcode == ZHPE_OP_HELPER_EXIT ||
+            op.hdr.opcode == ZHPE_OP_HELPER_RELEASE) {
+            workers_drain();
+            len = helper_op(&op);
+            if (len <= 0) {
+                ret = len;
+                break;
+            }
+            ring_post(&op);
+            ret = ring_doorbell();
+            if (ret < 0)
+                break;
+            ret = 1;
+            continue;
+        }
+        mutex_lock(&work_mutex);
+        work_ops[work_tail++ & ring_mask] = op;
+        cond_signal(&work_cond);
+        mutex_unlock(&work_mutex);
+        n++;
+    }
+    mutex_lock(&work_mutex);
+    if (workers_error)
+        ret = workers_error;
+    mutex_unlock(&work_mutex);
+    if (n || ret <= 0)
+        goto done;
+
+    ring->wakeup = 1;
+    /* Pairs with the barrier after the driver advances sq_tail. */
+    smp_mb();
+    if (sq_head == ring->sq_tail &&
+        poll(&pfd, 1, POLL_TIMEOUT) == -1 && errno != EINTR) {
+        ret = -errno;
+        print_func_err(__FUNCTION__, __LINE__, "poll", dev_name, -ret);
+    }
+    ring->wakeup = 0;
+
+ done:
+    return ret;
 }
 
 int main(int argc, char **argv)
 {
     int                 ret = 1;
     union zhpe_op       op;
-    union zhpe_req      *req = &op.req;
-    union zhpe_rsp      *rsp = &op.rsp;
     int                 rc;
     ssize_t             res;
     uint                i;
@@ -137,67 +1181,35 @@ int main(int argc, char **argv)
         sleep(ZHPE_HELPER_OPEN_SLEEP);
     }
 
-    for (;;) {
+    if (movers_start() < 0)
+        goto done;
+
+    /* Requests are read() until HELPER_INIT sets up the ring. */
+    while (!ring) {
         res = read(dev_fd, &op, sizeof(op));
         if (res == -1) {
             print_func_err(__FUNCTION__, __LINE__, "read", "", errno);
             goto done;
         }
-        if (!expected_saw("version", ZHPE_OP_VERSION, op.hdr.version))
-            goto done;
-
-        switch (op.hdr.opcode)  {
-
-        case ZHPE_OP_HELPER_EXIT:
-            debug(DEBUG_IO, "%s,%u:ZHPE_OP_HELPER_EXIT",
-                  __FUNCTION__, __LINE__);
-            ret = 0;
-            goto done;
-
-        case ZHPE_OP_HELPER_INIT:
-            shared_data = mmap(NULL, req->helper_init.shared_size,
-                               PROT_READ | PROT_WRITE, MAP_SHARED,
-                               dev_fd, req->helper_init.shared_offset);
-            if (shared_data == MAP_FAILED) {
-                shared_data = NULL;
-                print_func_err(__FUNCTION__, __LINE__, "mmap", dev_name,
-                               errno);
-                goto done;
-            }
-            if (!expected_saw("shared_magic", ZHPE_MAGIC, shared_data->magic))
-                goto done;
-            if (!expected_saw("shared_version", ZHPE_SHARED_VERSION,
-                              shared_data->version))
-                goto done;
-
-            debug_flags = shared_data->debug_flags;
-
-            debug(DEBUG_IO, "%s,%u:ZHPE_OP_HELPER_INIT",
-                  __FUNCTION__, __LINE__);
-            if (write_rsp(__FUNCTION__, __LINE__, rsp,
-                          sizeof(rsp->helper_init), 0) < 0)
-                goto done;
-            break;
-
-        case ZHPE_OP_HELPER_NOP:
-            debug(DEBUG_IO, "%s,%u:ZHPE_OP_HELPER_NOP",
-                  __FUNCTION__, __LINE__);
-            if (write_rsp(__FUNCTION__, __LINE__, rsp,
-                          sizeof(rsp->helper_nop), 0) < 0) {
-                print_err("seq %lu", rsp->helper_nop.seq);
-                goto done;
-            }
-            break;
-
-        default:
-            print_err("%s,%u:Unexpected opcode 0x%02x",
-                      __FUNCTION__, __LINE__, op.hdr.opcode);
+        res = helper_op(&op);
+        if (res <= 0) {
+            ret = (res < 0);
             goto done;
         }
+        if (write_rsp(__FUNCTION__, __LINE__, &op.rsp, res) < 0)
+            goto done;
     }
 
+    if (workers_start() < 0)
+        goto done;
+    while ((rc = ring_process()) > 0)
+        ;
+    ret = (rc < 0);
+
  done:
-    /* Clean up any running threads. Really shouldn't be any. */
+    /* Clean up any running threads. */
+    workers_stop();
+    movers_stop();
     print_info("exit");
 
     return ret;
@@ -59,6 +59,8 @@ struct backend_ops {
     int                 (*qalloc)(struct zhpeq_dom *zdom, struct zhpeq *zq);
     int                 (*qfree)(struct zhpeq *zq);
     int                 (*open)(struct zhpeq *zq, int sock_fd);
+    int                 (*open_many)(struct zhpeq *zq, size_t count,
+                                     const int *sock_fds, int *open_idx);
     int                 (*close)(struct zhpeq *zq, int open_idx);
     int                 (*wq_signal)(struct zhpeq *zq);
     ssize_t             (*cq_poll)(struct zhpeq *zq, size_t len);
@@ -101,6 +103,7 @@ struct zhpeq {
     union zhpe_hw_cq_entry *cq;
     void                **context;
     void                *backend_data;
+    size_t              qmem_len;       /* Driverless queue mapping */
     uint32_t            q_head;         /* Shadow for wq and cq */
     pthread_spinlock_t __attribute__ ((aligned(64))) tail_lock;
     uint32_t            tail_reserved;
@@ -114,6 +117,8 @@ static inline uint8_t cq_valid(uint32_t idx, uint32_t qmask)
 }
 
 extern struct backend_ops libfabric_ops;
+extern struct backend_ops shm_ops;
+extern struct backend_ops zhpe_ops;
 
 #define likely(x)		__builtin_expect((x), 1)
 #define unlikely(x)		__builtin_expect((x), 0)
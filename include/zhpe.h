@@ -39,6 +39,7 @@
 
 #ifdef __KERNEL__
 
+#include <linux/ioctl.h>
 #include <linux/uio.h>
 #include <asm/byteorder.h>
 
@@ -56,6 +57,7 @@ typedef unsigned long long ullong;
 #include <stddef.h>
 #include <stdint.h>
 
+#include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/uio.h>
 
@@ -77,6 +79,12 @@ enum {
     ZHPE_OP_HELPER_INIT,
     ZHPE_OP_HELPER_NOP,
     ZHPE_OP_HELPER_EXIT,
+    ZHPE_OP_HELPER_QALLOC,
+    ZHPE_OP_HELPER_QFREE,
+    ZHPE_OP_HELPER_MR_REG,
+    ZHPE_OP_HELPER_MR_DEREG,
+    ZHPE_OP_HELPER_RELEASE,
+    ZHPE_OP_RING_INIT,
     ZHPE_OP_RESPONSE = 0x80,
     ZHPE_OP_VERSION = 1,
 };
@@ -99,6 +107,13 @@ enum {
 #define ZHPE_MR_V1      (1U)
 #define ZHPE_MR_REMOTE  ((uint32_t)1 << 31)
 
+/*
+ * With the emulated zhpe backend, the helper assigns node-wide keys and
+ * a zaddr is the key above the offset into the region.
+ */
+#define ZHPE_KEY_SHIFT  (43)
+#define ZHPE_KEY_MAX    ((uint64_t)1 << (64 - ZHPE_KEY_SHIFT))
+
 struct zhpe_mr_desc_common_hdr {
     uint32_t            magic;
     uint32_t            version;
@@ -207,6 +222,20 @@ struct zhpe_rsp_ZMMU_DEREG {
     struct zhpe_common_hdr hdr;
 };
 
+/* eventfd is -1 or an eventfd signalled as completions are posted. */
+struct zhpe_req_RING_INIT {
+    struct zhpe_common_hdr hdr;
+    uint32_t            entries;
+    int32_t             eventfd;
+};
+
+struct zhpe_rsp_RING_INIT {
+    struct zhpe_common_hdr hdr;
+    uint64_t            ring_off;
+    uint64_t            ring_size;
+    uint32_t            entries;
+};
+
 struct zhpe_req_HELPER_EXIT {
     struct zhpe_common_hdr hdr;
 };
@@ -219,6 +248,9 @@ struct zhpe_req_HELPER_INIT {
     struct zhpe_common_hdr hdr;
     uint64_t            shared_offset;
     uint64_t            shared_size;
+    uint64_t            ring_off;
+    uint64_t            ring_size;
+    uint32_t            ring_entries;
 };
 
 struct zhpe_rsp_HELPER_INIT {
@@ -235,6 +267,66 @@ struct zhpe_rsp_HELPER_NOP {
     uint64_t            seq;
 };
 
+/*
+ * Requests the driver forwards to the helper when the zhpe backend is
+ * in use. owner identifies the open file, pid the process whose memory
+ * is described. Each response begins like the user response it becomes.
+ */
+
+struct zhpe_req_HELPER_QALLOC {
+    struct zhpe_common_hdr hdr;
+    struct zhpe_info   info;
+    uint64_t            owner;
+    int32_t             pid;
+};
+
+struct zhpe_rsp_HELPER_QALLOC {
+    struct zhpe_common_hdr hdr;
+    struct zhpe_info   info;
+};
+
+struct zhpe_req_HELPER_QFREE {
+    struct zhpe_common_hdr hdr;
+    struct zhpe_info   info;
+    uint64_t            owner;
+};
+
+struct zhpe_rsp_HELPER_QFREE {
+    struct zhpe_common_hdr hdr;
+    struct zhpe_info   info;
+};
+
+struct zhpe_req_HELPER_MR_REG {
+    struct zhpe_common_hdr hdr;
+    struct zhpeq_key_data kdata;
+    uint64_t            owner;
+    int32_t             pid;
+};
+
+struct zhpe_rsp_HELPER_MR_REG {
+    struct zhpe_common_hdr hdr;
+    union zhpe_mr_desc  desc;
+};
+
+struct zhpe_req_HELPER_MR_DEREG {
+    struct zhpe_common_hdr hdr;
+    union zhpe_mr_desc  desc;
+    uint64_t            owner;
+};
+
+struct zhpe_rsp_HELPER_MR_DEREG {
+    struct zhpe_common_hdr hdr;
+};
+
+struct zhpe_req_HELPER_RELEASE {
+    struct zhpe_common_hdr hdr;
+    uint64_t            owner;
+};
+
+struct zhpe_rsp_HELPER_RELEASE {
+    struct zhpe_common_hdr hdr;
+};
+
 union zhpe_req {
     struct zhpe_common_hdr hdr;
     struct zhpe_req_INIT init;
@@ -245,9 +337,15 @@ union zhpe_req {
     struct zhpe_req_QFREE qfree;
     struct zhpe_req_ZMMU_REG zmmu_reg;
     struct zhpe_req_ZMMU_DEREG zmmu_dereg;
+    struct zhpe_req_RING_INIT ring_init;
     struct zhpe_req_HELPER_EXIT helper_exit;
     struct zhpe_req_HELPER_INIT helper_init;
     struct zhpe_req_HELPER_NOP helper_nop;
+    struct zhpe_req_HELPER_QALLOC helper_qalloc;
+    struct zhpe_req_HELPER_QFREE helper_qfree;
+    struct zhpe_req_HELPER_MR_REG helper_mr_reg;
+    struct zhpe_req_HELPER_MR_DEREG helper_mr_dereg;
+    struct zhpe_req_HELPER_RELEASE helper_release;
 };
 
 union zhpe_rsp {
@@ -259,10 +357,16 @@ union zhpe_rsp {
     struct zhpe_rsp_QALLOC qalloc;
     struct zhpe_rsp_QFREE qfree;
     struct zhpe_rsp_ZMMU_REG zmmu_reg;
+    struct zhpe_rsp_RING_INIT ring_init;
     struct zhpe_rsp_ZMMU_DEREG zmmu_dereg;
     struct zhpe_rsp_HELPER_EXIT helper_exit;
     struct zhpe_rsp_HELPER_INIT helper_init;
     struct zhpe_rsp_HELPER_NOP helper_nop;
+    struct zhpe_rsp_HELPER_QALLOC helper_qalloc;
+    struct zhpe_rsp_HELPER_QFREE helper_qfree;
+    struct zhpe_rsp_HELPER_MR_REG helper_mr_reg;
+    struct zhpe_rsp_HELPER_MR_DEREG helper_mr_dereg;
+    struct zhpe_rsp_HELPER_RELEASE helper_release;
 };
 
 union zhpe_op {
@@ -271,13 +375,36 @@ union zhpe_op {
     union zhpe_rsp     rsp;
 };
 
-#define ZHPE_SHARED_VERSION    (1)
+/*
+ * Batches: a write of at least ZHPE_BATCH_MIN bytes is an array of
+ * union zhpe_op slots with a request in each; a read with room for
+ * ZHPE_BATCH_MIN bytes returns the responses that are ready, one per
+ * slot, in completion order. Use hdr.index to match them up.
+ */
+#define ZHPE_BATCH_MIN  (2 * sizeof(union zhpe_op))
 
+/*
+ * A user request and its response in one syscall: the driver reads the
+ * request from the union zhpe_op the argument points to and writes the
+ * response over it; it returns the response length.
+ */
+#define ZHPE_IOC_MAGIC  ('Z')
+#define ZHPE_IOC_CMD    _IOWR(ZHPE_IOC_MAGIC, 1, union zhpe_op)
+
+#define ZHPE_SHARED_VERSION    (2)
+
+/*
+ * tsc_freq is the kernel's calibrated TSC frequency in Hz, or 0 if the
+ * TSC isn't invariant; nsec = (cycles * tsc_mult) >> tsc_shift.
+ */
 struct zhpe_shared_data {
     uint                magic;
     uint                version;
     uint                debug_flags;
     struct zhpeq_attr   default_attr;
+    uint64_t            tsc_freq;
+    uint32_t            tsc_mult;
+    uint32_t            tsc_shift;
 };
 
 #define ZHPE_HW_ENTRY_LEN (64)
@@ -374,6 +501,51 @@ struct zhpe_hw_reg {
     zhpe_hw_reg16_t     cq_tail;
 };
 
+/*
+ * Control ring, set up by ZHPE_OP_RING_INIT and mmap()ed at ring_off: a
+ * submission and a completion queue of union zhpe_op slots. User space
+ * fills SQ slots and advances sq_tail, then ZHPE_IOC_RING_ENTER submits
+ * up to to_submit of them and, optionally, waits for min_complete
+ * completions; it returns the number submitted. The driver posts
+ * responses to the CQ as they complete, in any order, and advances
+ * cq_tail; user space consumes them and advances cq_head. Indices are
+ * free running; slot is index & (entries - 1). Completions also make
+ * the file readable for poll().
+ */
+#define ZHPE_RING_MAX   (4096)
+
+typedef volatile uint32_t __attribute__ ((aligned(64))) zhpe_ring_idx_t;
+
+struct zhpe_ring_hdr {
+    uint32_t            entries;
+    uint32_t            sq_off;
+    uint32_t            cq_off;
+    zhpe_ring_idx_t     sq_head;        /* Driver */
+    zhpe_ring_idx_t     sq_tail;        /* User */
+    zhpe_ring_idx_t     cq_head;        /* User */
+    zhpe_ring_idx_t     cq_tail;        /* Driver */
+    zhpe_ring_idx_t     wakeup;         /* Helper */
+};
+
+struct zhpe_ring_enter {
+    uint32_t            to_submit;
+    uint32_t            min_complete;
+};
+
+#define ZHPE_IOC_RING_ENTER _IOW(ZHPE_IOC_MAGIC, 2, struct zhpe_ring_enter)
+
+/*
+ * The helper's ring, advertised in ZHPE_OP_HELPER_INIT, has the same
+ * layout with the roles swapped: the driver posts requests to the SQ
+ * and the helper posts responses to the CQ. The helper sets wakeup
+ * before it sleeps in poll() and the driver only wakes it if wakeup is
+ * set. After posting a batch of responses, the helper rings the doorbell
+ * with ZHPE_IOC_HELPER_DOORBELL and the driver consumes the CQ.
+ */
+#define ZHPE_IOC_HELPER_DOORBELL _IO(ZHPE_IOC_MAGIC, 3)
+
 int zhpe_driver_cmd(union zhpe_op *buf, size_t req_len, size_t rsp_len);
 
+int zhpe_driver_cmds(union zhpe_op *ops, size_t n_ops);
+
 #endif /* _ZHPE_H_ */
@@ -299,6 +299,8 @@ enum {
     ZHPEQ_CQ_STATUS_FABRIC_UNRECOVERABLE = 0x21,
     ZHPEQ_CQ_STATUS_FABRIC_NO_RESOURCES  = 0x22,
     ZHPEQ_CQ_STATUS_FABRIC_ACCESS        = 0x23,
+    /* Software only: the queue was freed before the operation ran. */
+    ZHPEQ_CQ_STATUS_CANCELED             = 0x80,
 };
 
 struct zhpeq_result {
@@ -319,13 +321,23 @@ struct zhpeq_cq_entry {
 enum zhpeq_backend {
     ZHPEQ_BACKEND_ZHPE = 1,
     ZHPEQ_BACKEND_LIBFABRIC,
+    ZHPEQ_BACKEND_SHM,
     ZHPEQ_BACKEND_MAX,
 };
 
+/* Engine placement: engine_cpus is a CPU list ("2,4-7"); engine_numa is
+ * a node number, "auto" for the node local to the provider's device, or
+ * "none". If NULL, the ZHPEQ_ENGINE_CPUS and ZHPEQ_ENGINE_NUMA environment
+ * variables are used. With scalable_ep (or ZHPEQ_SCALABLE_EP=1), the domain
+ * opens one scalable endpoint and each zhpeq gets a tx context on it.
+ */
 struct zhpeq_backend_libfabric_params {
     enum zhpeq_backend  backend;
     const char          *provider_name;
     const char          *domain_name;
+    const char          *engine_cpus;
+    const char          *engine_numa;
+    bool                scalable_ep;
 };
 
 union zhpeq_backend_params {
@@ -394,6 +406,9 @@ int zhpeq_free(struct zhpeq *zq);
 
 int zhpeq_backend_open(struct zhpeq *zq, int sock_fd);
 
+int zhpeq_backend_open_many(struct zhpeq *zq, size_t count,
+                            const int *sock_fds, int *open_idx);
+
 int zhpeq_backend_close(struct zhpeq *zq, int open_idx);
 
 ssize_t zhpeq_cq_read(struct zhpeq *zq, struct zhpeq_cq_entry *entries,
@@ -449,6 +464,8 @@ void zhpeq_print_info(struct zhpeq *zq);
 
 int zhpeq_active(struct zhpeq *zq);
 
+int zhpeq_quiesce(struct zhpeq *zq);
+
 _EXTERN_C_END
 
 #ifdef _EXTERN_C_SET
@@ -96,6 +96,11 @@ static inline void atomic_store_lazy_ptr(void **p, void *v)
 
 #define TO_PTR(_int)    (void *)(uintptr_t)(_int)
 
+#ifndef container_of
+#define container_of(_ptr, _type, _field)                       \
+    ((_type *)((char *)(_ptr) - offsetof(_type, _field)))
+#endif
+
 #define FREE(_ptr,_free)                                        \
 do {                                                            \
     if (_ptr) {                                                 \
@@ -276,11 +281,31 @@ void print_urange_err(const char *callf, uint line, const char *name,
 char *get_cpuinfo_val(FILE *fp, char *buf, size_t buf_size,
                       uint field, const char *name, ...);
 
+/* nsec = (cycles * mult) >> shift; valid once freq is set. */
+struct zhpeq_tsc {
+    uint64_t            freq;
+    uint32_t            mult;
+    uint32_t            shift;
+};
+
+extern struct zhpeq_tsc zhpeq_tsc;
+
 uint64_t get_tsc_freq(void);
 
+/* Use a frequency and conversion calibrated elsewhere, e.g. the driver. */
+void set_tsc_freq(uint64_t freq, uint32_t mult, uint32_t shift);
+
+static inline uint64_t cycles_to_nsec(uint64_t delta)
+{
+    if (!zhpeq_tsc.freq)
+        (void)get_tsc_freq();
+
+    return ((unsigned __int128)delta * zhpeq_tsc.mult) >> zhpeq_tsc.shift;
+}
+
 static inline double cycles_to_usec(uint64_t delta, uint64_t loops)
 {
-    return (delta * 1.0e6) / ((double)get_tsc_freq() * loops);
+    return cycles_to_nsec(delta) / (1.0e3 * loops);
 }
 
 static inline uint64_t get_cycles(volatile uint32_t *cpup)
@@ -529,6 +554,14 @@ static inline void smp_wmb(void)
     asm volatile("sfence":::"memory");
 }
 
+/* Orders stores to ordinary write-back memory; x86 is TSO, so a
+ * compiler barrier is sufficient. Use smp_wmb() for anything else.
+ */
+static inline void smp_wmb_wb(void)
+{
+    asm volatile("":::"memory");
+}
+
 #endif
 
 #ifndef _BARRIER_DEFINED
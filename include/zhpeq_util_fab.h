@@ -78,6 +78,7 @@ struct fab_conn {
     struct fid_cq       *rx_cq;
     struct fid_av       *av;
     struct fid_ep       *ep;
+    struct fid_ep       *sep;
     struct fid_pep      *pep;
     struct fab_mrmem    mrmem;
     bool                allocated;
@@ -177,6 +178,14 @@ int _fab_av_xchg_addr(const char *callf, uint line, struct fab_conn *conn,
 #define fab_av_xchg_addr(...) \
     _fab_av_xchg_addr(__FUNCTION__, __LINE__, __VA_ARGS__)
 
+/* Send our address on every socket, then receive all the peer addresses. */
+int _fab_av_xchg_addr_many(const char *callf, uint line,
+                           struct fab_conn *conn, size_t count,
+                           const int *sock_fds, union sockaddr_in46 *ep_addrs);
+
+#define fab_av_xchg_addr_many(...) \
+    _fab_av_xchg_addr_many(__FUNCTION__, __LINE__, __VA_ARGS__)
+
 int _fab_av_xchg(const char *callf, uint line, struct fab_conn *conn,
                  int sock_fd, int timeout, fi_addr_t *fi_addr);
 
@@ -189,6 +198,19 @@ int _fab_av_insert(const char *callf, uint line, struct fab_conn *conn,
 #define fab_av_insert(...) \
     _fab_av_insert(__FUNCTION__, __LINE__, __VA_ARGS__)
 
+int _fab_av_insert_many(const char *callf, uint line, struct fab_conn *conn,
+                        union sockaddr_in46 *saddrs, size_t count,
+                        fi_addr_t *fi_addrs);
+
+#define fab_av_insert_many(...) \
+    _fab_av_insert_many(__FUNCTION__, __LINE__, __VA_ARGS__)
+
+int _fab_av_remove_many(const char *callf, uint line, struct fab_conn *conn,
+                        fi_addr_t *fi_addrs, size_t count);
+
+#define fab_av_remove_many(...) \
+    _fab_av_remove_many(__FUNCTION__, __LINE__, __VA_ARGS__)
+
 int _fab_av_remove(const char *callf, uint line, struct fab_conn *conn,
                    fi_addr_t fi_addr);
 
@@ -221,6 +243,21 @@ int _fab_ep_setup(const char *callf, uint line,
 #define fab_ep_setup(...) \
     _fab_ep_setup(__FUNCTION__, __LINE__, __VA_ARGS__)
 
+/* A scalable endpoint: sep is the endpoint; ep is its only rx context. */
+int _fab_sep_setup(const char *callf, uint line, struct fab_conn *conn,
+                   size_t tx_ctx_cnt, size_t rx_size);
+
+#define fab_sep_setup(...) \
+    _fab_sep_setup(__FUNCTION__, __LINE__, __VA_ARGS__)
+
+/* conn gets tx context idx of sep_conn's endpoint and its own tx_cq. */
+int _fab_sep_tx_setup(const char *callf, uint line,
+                      struct fab_conn *sep_conn, struct fab_conn *conn,
+                      int idx, size_t tx_size);
+
+#define fab_sep_tx_setup(...) \
+    _fab_sep_tx_setup(__FUNCTION__, __LINE__, __VA_ARGS__)
+
 int _fab_eq_cm_event(const char *callf, uint line,
                      struct fab_conn *conn, int timeout, uint32_t expected,
                      struct fi_eq_cm_entry *entry);
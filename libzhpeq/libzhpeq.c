@@ -41,12 +41,21 @@
 
 #define LIBNAME         "libzhpeq"
 #define BACKNAME        "libzhpeq_backend.so"
+#define BACKEND_ENV     "ZHPEQ_BACKEND"
+#define DRIVERLESS_ENV  "ZHPEQ_DRIVERLESS"
+#define POPULATE_ENV    "ZHPEQ_QUEUE_POPULATE"
+
+#define HUGE_PAGE_SIZE  ((size_t)1 << 21)
 
 static int              dev_fd = -1;
 static const char       *dev_name = "/dev/" DRIVER_NAME;
+static bool             driverless;
+static int              q_map_flags;
+static size_t           q_page_size;
 
 static struct backend_ops *b_reg[ZHPEQ_BACKEND_MAX];
 static struct backend_ops *b_ops;
+static enum zhpeq_backend b_backend;
 
 static struct zhpe_shared_data *shared_data;
 
@@ -269,15 +278,15 @@ static inline void zhpeq_timing_commit(struct zhpeq *zq, uint32_t qindex,
 
 /* For the moment, we will do all driver I/O synchronously.*/
 
-int zhpe_driver_cmd(union zhpe_op *op, size_t req_len, size_t rsp_len)
+/* Cleared if the driver predates ZHPE_IOC_CMD. */
+static bool             dev_ioctl = true;
+
+static ssize_t driver_cmd_rw(union zhpe_op *op, size_t req_len,
+                             size_t rsp_len)
 {
-    int                 ret = 0;
-    int                 opcode = op->hdr.opcode;
+    ssize_t             ret;
     ssize_t             res;
 
-    op->hdr.version = ZHPE_OP_VERSION;
-    op->hdr.index = 0;
-
     res = write(dev_fd, op, req_len);
     ret = check_func_io(__FUNCTION__, __LINE__, "write", dev_name,
                         req_len, res, 0);
@@ -289,6 +298,43 @@ int zhpe_driver_cmd(union zhpe_op *op, size_t req_len, size_t rsp_len)
                         rsp_len, res, 0);
     if (ret < 0)
         goto done;
+    ret = res;
+
+ done:
+    return ret;
+}
+
+static int driver_cmd_one(union zhpe_op *op, size_t req_len, size_t rsp_len)
+{
+    int                 ret = 0;
+    int                 opcode = op->hdr.opcode;
+    ssize_t             res = -ENOTTY;
+
+    op->hdr.version = ZHPE_OP_VERSION;
+    op->hdr.index = 0;
+
+    /* One syscall, with the response written over the request. */
+    if (dev_ioctl) {
+        res = ioctl(dev_fd, ZHPE_IOC_CMD, op);
+        if (res == -1) {
+            res = -errno;
+            if (res == -ENOTTY)
+                dev_ioctl = false;
+            else {
+                ret = res;
+                print_func_err(__FUNCTION__, __LINE__, "ioctl", dev_name,
+                               ret);
+                goto done;
+            }
+        }
+    }
+    if (res == -ENOTTY) {
+        res = driver_cmd_rw(op, req_len, rsp_len);
+        if (res < 0) {
+            ret = res;
+            goto done;
+        }
+    }
     ret = -EIO;
     if (res < sizeof(op->hdr)) {
         print_err("%s,%u:Unexpected short read %lu\n",
@@ -330,13 +376,17 @@ static int _zhpe_munmap(const char *callf, uint line,
     _zhpe_munmap(__FUNCTION__, __LINE__, _addr, _length)
 
 
-static void *_zhpe_mmap(const char *callf, uint line,
-                        size_t size, int prot, off_t offset, int *error)
+/*
+ * The driver faults pages in on first touch; flags may add MAP_POPULATE
+ * to prefault the whole mapping instead.
+ */
+static void *_zhpe_mmap(const char *callf, uint line, size_t size,
+                        int prot, int flags, off_t offset, int *error)
 {
     void                *ret;
     int                 err = 0;
 
-    ret = mmap(NULL, size, prot, MAP_SHARED, dev_fd, offset);
+    ret = mmap(NULL, size, prot, MAP_SHARED | flags, dev_fd, offset);
     if (ret == MAP_FAILED) {
         err = -errno;
         ret = NULL;
@@ -351,6 +401,244 @@ static void *_zhpe_mmap(const char *callf, uint line,
 #define zhpe_mmap(...) \
     _zhpe_mmap(__FUNCTION__, __LINE__, __VA_ARGS__)
 
+/*
+ * Control ring, set up by zhpeq_init(). Callers post their ops to the SQ
+ * and one of them at a time, the leader, submits everything posted with
+ * ZHPE_IOC_RING_ENTER and reaps the CQ for all of them, so commands
+ * issued concurrently share syscalls. An op's index is its slot in
+ * ring_slots[]. If the ring fails, it is abandoned and commands go
+ * through driver_cmd_one().
+ */
+#define RING_ENTRIES    (64)
+
+struct ring_slot {
+    union zhpe_op       *op;
+    size_t              *left;
+    int                 *err;
+    int                 opcode;
+};
+
+static pthread_mutex_t  ring_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   ring_cond = PTHREAD_COND_INITIALIZER;
+static struct zhpe_ring_hdr *ring_hdr;
+static bool             ring_entering;
+static uint32_t         ring_sq_tail;
+static uint32_t         ring_cq_head;
+static struct ring_slot ring_slots[RING_ENTRIES];
+static uint16_t         ring_free[RING_ENTRIES];
+static uint             ring_nfree;
+
+static void ring_init(void)
+{
+    union zhpe_op       op;
+    union zhpe_req      *req = &op.req;
+    union zhpe_rsp      *rsp = &op.rsp;
+    struct zhpe_ring_hdr *hdr;
+    uint                i;
+
+    req->hdr.opcode = ZHPE_OP_RING_INIT;
+    req->ring_init.entries = RING_ENTRIES;
+    req->ring_init.eventfd = -1;
+    if (driver_cmd_one(&op, sizeof(req->ring_init),
+                       sizeof(rsp->ring_init)) < 0)
+        return;
+    if (!expected_saw("ring_entries", RING_ENTRIES, rsp->ring_init.entries))
+        return;
+    hdr = zhpe_mmap(rsp->ring_init.ring_size, PROT_READ | PROT_WRITE,
+                    MAP_POPULATE, rsp->ring_init.ring_off, NULL);
+    if (!hdr)
+        return;
+    ring_sq_tail = hdr->sq_tail;
+    ring_cq_head = hdr->cq_head;
+    for (i = 0; i < RING_ENTRIES; i++)
+        ring_free[i] = i;
+    ring_nfree = RING_ENTRIES;
+    ring_hdr = hdr;
+}
+
+/* Must hold ring_mutex; rsp is NULL if the op failed with status. */
+static void ring_complete(uint16_t index, union zhpe_op *rsp, int status)
+{
+    struct ring_slot    *slot = &ring_slots[index];
+    union zhpe_op       *op = slot->op;
+
+    if (rsp) {
+        *op = *rsp;
+        status = op->hdr.status;
+        if (!expected_saw("opcode", slot->opcode | ZHPE_OP_RESPONSE,
+                          op->hdr.opcode))
+            status = -EIO;
+        else if (status < 0)
+            print_err("%s,%u:zhpe command 0x%02x returned error %d:%s\n",
+                      __FUNCTION__, __LINE__, op->hdr.opcode,
+                      -status, strerror(-status));
+    } else
+        op->hdr.status = status;
+    if (status < 0 && *slot->err >= 0)
+        *slot->err = status;
+    (*slot->left)--;
+    slot->op = NULL;
+    ring_free[ring_nfree++] = index;
+}
+
+/* Must hold ring_mutex. */
+static void ring_reap(void)
+{
+    union zhpe_op       *cq = (void *)ring_hdr + ring_hdr->cq_off;
+    uint32_t            qmask = ring_hdr->entries - 1;
+    union zhpe_op       *rsp;
+    uint16_t            index;
+
+    for (; ring_cq_head != ring_hdr->cq_tail; ring_cq_head++) {
+        smp_rmb();
+        rsp = &cq[ring_cq_head & qmask];
+        index = rsp->hdr.index;
+        if (index >= RING_ENTRIES || !ring_slots[index].op) {
+            print_err("%s,%u:Unexpected ring index %u\n",
+                      __FUNCTION__, __LINE__, index);
+            continue;
+        }
+        ring_complete(index, rsp, 0);
+    }
+    ring_hdr->cq_head = ring_cq_head;
+}
+
+/*
+ * Must hold ring_mutex. After a hard error, fail the ops the driver
+ * hasn't taken and wait for the ones it has, so no completion is left
+ * to be matched against a later caller's slot; if even that fails,
+ * abandon the ring and fail everything outstanding.
+ */
+static void ring_fail(int err)
+{
+    union zhpe_op       *sq = (void *)ring_hdr + ring_hdr->sq_off;
+    uint32_t            qmask = ring_hdr->entries - 1;
+    uint32_t            sq_head = ring_hdr->sq_head;
+    struct zhpe_ring_enter enter = {
+        .to_submit      = 0,
+        .min_complete   = 1,
+    };
+    uint                i;
+
+    while (ring_sq_tail != sq_head) {
+        ring_sq_tail--;
+        ring_complete(sq[ring_sq_tail & qmask].hdr.index, NULL, err);
+    }
+    ring_hdr->sq_tail = ring_sq_tail;
+
+    while (ring_nfree < RING_ENTRIES) {
+        if (ioctl(dev_fd, ZHPE_IOC_RING_ENTER, &enter) == -1) {
+            if (errno == EINTR)
+                continue;
+            print_func_err(__FUNCTION__, __LINE__, "ioctl", dev_name,
+                           -errno);
+            for (i = 0; i < RING_ENTRIES; i++) {
+                if (ring_slots[i].op)
+                    ring_complete(i, NULL, err);
+            }
+            ring_hdr = NULL;
+            break;
+        }
+        ring_reap();
+    }
+}
+
+/* Each op is replaced by its response; returns the first error. */
+static int ring_cmds(union zhpe_op *ops, size_t n_ops)
+{
+    int                 ret = 0;
+    size_t              left = n_ops;
+    size_t              posted = 0;
+    struct zhpe_ring_enter enter = {
+        .to_submit      = RING_ENTRIES,
+        .min_complete   = 1,
+    };
+    struct ring_slot    *slot;
+    union zhpe_op       *sq;
+    uint32_t            qmask;
+    uint16_t            index;
+    int                 rc;
+
+    mutex_lock(&ring_mutex);
+    while (left && ring_hdr) {
+        sq = (void *)ring_hdr + ring_hdr->sq_off;
+        qmask = ring_hdr->entries - 1;
+        for (; posted < n_ops && ring_nfree; posted++) {
+            index = ring_free[--ring_nfree];
+            slot = &ring_slots[index];
+            slot->op = &ops[posted];
+            slot->left = &left;
+            slot->err = &ret;
+            slot->opcode = ops[posted].hdr.opcode;
+            ops[posted].hdr.version = ZHPE_OP_VERSION;
+            ops[posted].hdr.index = index;
+            sq[ring_sq_tail++ & qmask] = ops[posted];
+        }
+        smp_wmb();
+        ring_hdr->sq_tail = ring_sq_tail;
+        /* The leader will submit ours with its own. */
+        if (ring_entering) {
+            cond_wait(&ring_cond, &ring_mutex);
+            continue;
+        }
+        ring_entering = true;
+        mutex_unlock(&ring_mutex);
+        rc = 0;
+        if (ioctl(dev_fd, ZHPE_IOC_RING_ENTER, &enter) == -1)
+            rc = -errno;
+        mutex_lock(&ring_mutex);
+        ring_entering = false;
+        if (rc < 0 && rc != -EINTR) {
+            print_func_err(__FUNCTION__, __LINE__, "ioctl", dev_name, rc);
+            ring_fail(rc);
+        } else
+            ring_reap();
+        cond_broadcast(&ring_cond);
+    }
+    mutex_unlock(&ring_mutex);
+
+    /* The ring was abandoned before these were posted. */
+    for (; posted < n_ops; posted++) {
+        rc = driver_cmd_one(&ops[posted], sizeof(ops[posted].req),
+                            sizeof(ops[posted].rsp));
+        if (rc < 0 && ret >= 0)
+            ret = rc;
+    }
+
+    return ret;
+}
+
+int zhpe_driver_cmd(union zhpe_op *op, size_t req_len, size_t rsp_len)
+{
+    if (ring_hdr)
+        return ring_cmds(op, 1);
+
+    return driver_cmd_one(op, req_len, rsp_len);
+}
+
+/*
+ * Issue n_ops commands, each replaced by its response, with one syscall
+ * per ring full rather than one per command. Returns the first error.
+ * Without a ring, it falls back to one syscall each.
+ */
+int zhpe_driver_cmds(union zhpe_op *ops, size_t n_ops)
+{
+    int                 ret = 0;
+    int                 rc;
+    size_t              i;
+
+    if (ring_hdr)
+        return ring_cmds(ops, n_ops);
+
+    for (i = 0; i < n_ops; i++) {
+        rc = driver_cmd_one(&ops[i], sizeof(ops[i].req), sizeof(ops[i].rsp));
+        if (rc < 0 && ret >= 0)
+            ret = rc;
+    }
+
+    return ret;
+}
+
 static void __attribute__((constructor)) lib_init(void)
 {
     void                *dlhandle = dlopen(BACKNAME, RTLD_NOW);
@@ -369,6 +657,7 @@ int zhpeq_register_backend(enum zhpeq_backend backend, void *ops)
 
     case ZHPEQ_BACKEND_ZHPE:
     case ZHPEQ_BACKEND_LIBFABRIC:
+    case ZHPEQ_BACKEND_SHM:
         b_reg[backend] = ops;
         break;
 
@@ -380,44 +669,21 @@ int zhpeq_register_backend(enum zhpeq_backend backend, void *ops)
     return ret;
 }
 
-int zhpeq_init(int api_version)
+static int shared_init_driver(void)
 {
     int                 ret;
-    static int          init_status = 1;
     union zhpe_op       op;
     union zhpe_req      *req = &op.req;
     union zhpe_rsp      *rsp = &op.rsp;
     ulong               check_val;
     ulong               check_off;
 
-    ret = init_status;
-    if (ret <= 0)
-        return ret;
-
-    dev_fd = open(dev_name, O_RDWR);
-    if (dev_fd == -1) {
-        ret = -errno;
-        goto done;
-    }
-
-    ret = -EINVAL;
-    if (!expected_saw("api_version", ZHPEQ_API_VERSION, api_version))
-        goto done;
-    if (api_version != ZHPEQ_API_VERSION)
-        goto done;
-    if (!expected_saw("sizeof(zhpe_hw_wq_entry)",
-                      ZHPE_ENTRY_LEN, sizeof(union zhpe_hw_wq_entry)))
-        goto done;
-    if (!expected_saw("sizeof(zhpeq_cq_entry)",
-                      ZHPE_ENTRY_LEN, sizeof(struct zhpeq_cq_entry)))
-        goto done;
-
     req->hdr.opcode = ZHPE_OP_INIT;
-    ret = zhpe_driver_cmd(&op, sizeof(req->init), sizeof(rsp->init));
+    ret = driver_cmd_one(&op, sizeof(req->init), sizeof(rsp->init));
     if (ret < 0)
         goto done;
 
-    shared_data = zhpe_mmap(rsp->init.shared_size, PROT_READ,
+    shared_data = zhpe_mmap(rsp->init.shared_size, PROT_READ, MAP_POPULATE,
                             rsp->init.shared_offset, &ret);
     if (!shared_data)
         goto done;
@@ -435,18 +701,118 @@ int zhpeq_init(int api_version)
         if (!expected_saw("shared_check_last", check_off, check_val))
             goto done;
     }
+    ret = 0;
 
-    switch (shared_data->default_attr.backend) {
+ done:
+    return ret;
+}
 
+/* Without the driver, the attributes are the driver's defaults. */
+static int shared_init_local(void)
+{
+    static struct zhpe_shared_data local_data = {
+        .magic              = ZHPE_MAGIC,
+        .version            = ZHPE_SHARED_VERSION,
+        .default_attr       = {
+            .backend        = ZHPEQ_BACKEND_LIBFABRIC,
+            .max_tx_queues  = 1024,
+            .max_rx_queues  = 1024,
+            .max_hw_qlen    = 65535,
+            .max_sw_qlen    = 65535,
+            .max_dma_len    = (1U << 31),
+        },
+    };
+    long                rcl;
+
+    rcl = sysconf(_SC_PAGESIZE);
+    if (rcl == -1) {
+        print_func_err(__FUNCTION__, __LINE__, "sysconf", "_SC_PAGESIZE",
+                       errno);
+        return -errno;
+    }
+    q_page_size = rcl;
+    shared_data = &local_data;
+
+    return 0;
+}
+
+int zhpeq_init(int api_version)
+{
+    int                 ret;
+    static int          init_status = 1;
+    const char          *env;
+
+    ret = init_status;
+    if (ret <= 0)
+        return ret;
+
+    /*
+     * Run without /dev/zhpe only if asked to: a missing driver is an
+     * error, not a reason to quietly pick another backend.
+     */
+    env = getenv(DRIVERLESS_ENV);
+    driverless = (env && strcmp(env, "0"));
+    /* Queues are faulted in as they are used unless asked to prefault. */
+    env = getenv(POPULATE_ENV);
+    if (env && strcmp(env, "0"))
+        q_map_flags = MAP_POPULATE;
+    if (!driverless) {
+        dev_fd = open(dev_name, O_RDWR);
+        if (dev_fd == -1) {
+            ret = -errno;
+            print_func_err(__FUNCTION__, __LINE__, "open", dev_name, ret);
+            if (ret == -ENOENT)
+                print_info("%s:set %s=1 to run without the driver\n",
+                           LIBNAME, DRIVERLESS_ENV);
+            goto done;
+        }
+    }
+
+    ret = -EINVAL;
+    if (!expected_saw("api_version", ZHPEQ_API_VERSION, api_version))
+        goto done;
+    if (api_version != ZHPEQ_API_VERSION)
+        goto done;
+    if (!expected_saw("sizeof(zhpe_hw_wq_entry)",
+                      ZHPE_ENTRY_LEN, sizeof(union zhpe_hw_wq_entry)))
+        goto done;
+    if (!expected_saw("sizeof(zhpeq_cq_entry)",
+                      ZHPE_ENTRY_LEN, sizeof(struct zhpeq_cq_entry)))
+        goto done;
+
+    if (driverless)
+        ret = shared_init_local();
+    else
+        ret = shared_init_driver();
+    if (ret < 0)
+        goto done;
+    /* Without the ring, commands are still issued one at a time. */
+    if (!driverless)
+        ring_init();
+    /* The driver's calibration saves parsing /proc/cpuinfo. */
+    if (shared_data->tsc_freq)
+        set_tsc_freq(shared_data->tsc_freq, shared_data->tsc_mult,
+                     shared_data->tsc_shift);
+
+    /* The environment may select the same-host backend instead. */
+    b_backend = shared_data->default_attr.backend;
+    env = getenv(BACKEND_ENV);
+    if (env && !strcmp(env, "shm"))
+        b_backend = ZHPEQ_BACKEND_SHM;
+
+    switch (b_backend) {
+
+    case ZHPEQ_BACKEND_ZHPE:
     case ZHPEQ_BACKEND_LIBFABRIC:
-        b_ops = b_reg[shared_data->default_attr.backend];
+    case ZHPEQ_BACKEND_SHM:
+        b_ops = b_reg[b_backend];
         if (b_ops)
             break;
         /* FALLTHROUGH */
 
     default:
         print_err("%s,%u:Unsupported backend %d\n",
-                  __FUNCTION__, __LINE__, shared_data->default_attr.backend);
+                  __FUNCTION__, __LINE__, b_backend);
         goto done;
     }
 
@@ -468,6 +834,7 @@ int zhpeq_query_attr(struct zhpeq_attr *attr)
         goto done;
 
     *attr = shared_data->default_attr;
+    attr->backend = b_backend;
     ret = 0;
 
  done:
@@ -499,8 +866,7 @@ int zhpeq_domain_alloc(const union zhpeq_backend_params *params,
         goto done;
     *zdom_out = NULL;
     if (params &&
-        !expected_saw("params->backend", shared_data->default_attr.backend,
-                      params->backend))
+        !expected_saw("params->backend", b_backend, params->backend))
         goto done;
 
     ret = -ENOMEM;
@@ -534,6 +900,14 @@ int zhpeq_free(struct zhpeq *zq)
     if (ret >= 0 && rc < 0)
         ret = rc;
 
+    if (driverless) {
+        /* One mapping holds registers, wq, and cq. */
+        rc = zhpe_munmap(zq->reg, zq->qmem_len);
+        if (ret >= 0 && rc < 0)
+            ret = rc;
+        goto free_zq;
+    }
+
     /* Unmap registers, wq, and cq. */
     rc = zhpe_munmap(zq->reg, zq->info.rsize);
     if (ret >= 0 && rc < 0)
@@ -553,6 +927,7 @@ int zhpeq_free(struct zhpeq *zq)
         if (ret >= 0 && rc < 0)
             ret = rc;
     }
+ free_zq:
     if (zq->tail_lock_init)
         spin_destroy(&zq->tail_lock);
 
@@ -563,6 +938,57 @@ int zhpeq_free(struct zhpeq *zq)
     return ret;
 }
 
+/*
+ * Without the driver, registers, wq, and cq come from a single shared
+ * anonymous mapping, using huge pages when the queue is big enough and
+ * they are available. The layout matches what the driver would hand out.
+ */
+static int qmem_alloc_local(struct zhpeq *zq, uint32_t qlen)
+{
+    int                 ret = -ENOMEM;
+    size_t              qsize;
+    size_t              len;
+    void                *mem = MAP_FAILED;
+
+    /* qlen + 1 rounded up to the next power of 2, as the driver does. */
+    zq->info.qlen = 1U << (32 - __builtin_clz(qlen));
+    zq->info.rsize = q_page_size;
+    qsize = (qlen * ZHPE_HW_ENTRY_LEN + q_page_size - 1) & ~(q_page_size - 1);
+    zq->info.qsize = qsize;
+    zq->info.reg_off = 0;
+    zq->info.wq_off = zq->info.rsize;
+    zq->info.cq_off = zq->info.wq_off + qsize;
+    len = zq->info.cq_off + qsize;
+
+    zq->context = calloc(zq->info.qlen, sizeof(*zq->context));
+    if (!zq->context)
+        goto done;
+
+    if (len >= HUGE_PAGE_SIZE) {
+        len = (len + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+        mem = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+    if (mem == MAP_FAILED) {
+        len = zq->info.cq_off + qsize;
+        mem = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    }
+    if (mem == MAP_FAILED) {
+        ret = -errno;
+        print_func_err(__FUNCTION__, __LINE__, "mmap", "", ret);
+        goto done;
+    }
+    zq->qmem_len = len;
+    zq->reg = mem;
+    zq->wq = mem + zq->info.wq_off;
+    zq->cq = mem + zq->info.cq_off;
+    ret = 0;
+
+ done:
+    return ret;
+}
+
 int zhpeq_alloc(struct zhpeq_dom *zdom, int qlen, struct zhpeq **zq_out)
 {
     int                 ret = -EINVAL;
@@ -586,6 +1012,13 @@ int zhpeq_alloc(struct zhpeq_dom *zdom, int qlen, struct zhpeq **zq_out)
     spin_init(&zq->tail_lock, PTHREAD_PROCESS_PRIVATE);
     zq->tail_lock_init = true;
 
+    if (driverless) {
+        ret = qmem_alloc_local(zq, qlen);
+        if (ret < 0)
+            goto done;
+        goto backend;
+    }
+
     req->hdr.opcode = ZHPE_OP_QALLOC;
     req->qalloc.qlen = qlen;
     ret = zhpe_driver_cmd(&op, sizeof(req->qalloc), sizeof(rsp->qalloc));
@@ -593,24 +1026,26 @@ int zhpeq_alloc(struct zhpeq_dom *zdom, int qlen, struct zhpeq **zq_out)
         goto done;
     zq->info = rsp->qalloc.info;
 
+    ret = -ENOMEM;
     zq->context = calloc(zq->info.qlen, sizeof(*zq->context));
     if (!zq->context)
         goto done;
 
     /* Map registers, wq, and cq. */
-    zq->reg = zhpe_mmap(zq->info.rsize, PROT_READ | PROT_WRITE,
+    zq->reg = zhpe_mmap(zq->info.rsize, PROT_READ | PROT_WRITE, MAP_POPULATE,
                         zq->info.reg_off, &ret);
     if (!zq->reg)
         goto done;
-    zq->wq = zhpe_mmap(zq->info.qsize, PROT_READ | PROT_WRITE,
+    zq->wq = zhpe_mmap(zq->info.qsize, PROT_READ | PROT_WRITE, q_map_flags,
                        zq->info.wq_off, &ret);
     if (!zq->wq)
         goto done;
-    zq->cq = zhpe_mmap(zq->info.qsize, PROT_READ | PROT_WRITE,
+    zq->cq = zhpe_mmap(zq->info.qsize, PROT_READ | PROT_WRITE, q_map_flags,
                        zq->info.cq_off, &ret);
     if (!zq->cq)
         goto done;
 
+ backend:
     ret = b_ops->qalloc(zdom, zq);
 
  done:
@@ -632,6 +1067,37 @@ int zhpeq_backend_open(struct zhpeq *zq, int sock_fd)
     return ret;
 }
 
+int zhpeq_backend_open_many(struct zhpeq *zq, size_t count,
+                            const int *sock_fds, int *open_idx)
+{
+    int                 ret = -EINVAL;
+    size_t              i;
+
+    if (!zq || !sock_fds || !open_idx)
+        goto done;
+    ret = 0;
+    if (!count)
+        goto done;
+
+    if (b_ops->open_many) {
+        ret = b_ops->open_many(zq, count, sock_fds, open_idx);
+        goto done;
+    }
+    for (i = 0; i < count; i++) {
+        ret = b_ops->open(zq, sock_fds[i]);
+        if (ret < 0) {
+            while (i > 0)
+                (void)b_ops->close(zq, open_idx[--i]);
+            goto done;
+        }
+        open_idx[i] = ret;
+    }
+    ret = 0;
+
+ done:
+    return ret;
+}
+
 int zhpeq_backend_close(struct zhpeq *zq, int open_idx)
 {
     int                 ret = -EINVAL;
@@ -1046,7 +1512,7 @@ void zhpeq_print_info(struct zhpeq *zq)
     const char          *b_str = "unknown";
     struct zhpeq_attr   *attr = &shared_data->default_attr;
 
-    switch (attr->backend) {
+    switch (b_backend) {
 
     case ZHPEQ_BACKEND_ZHPE:
         b_str = "zhpe";
@@ -1056,6 +1522,10 @@ void zhpeq_print_info(struct zhpeq *zq)
         b_str = "libfabric";
         break;
 
+    case ZHPEQ_BACKEND_SHM:
+        b_str = "shm";
+        break;
+
     default:
         break;
     }
@@ -1086,3 +1556,27 @@ int zhpeq_active(struct zhpeq *zq)
  done:
     return ret;
 }
+
+/*
+ * Non-blocking check that every committed WQE has a CQ entry; it doesn't
+ * care whether the entries have been read. Returns 0 when quiescent and
+ * -EAGAIN otherwise.
+ */
+int zhpeq_quiesce(struct zhpeq *zq)
+{
+    int                 ret = -EINVAL;
+    uint32_t            qmask;
+    uint32_t            tail;
+
+    if (!zq)
+        goto done;
+    qmask = zq->info.qlen - 1;
+    spin_lock(&zq->tail_lock);
+    tail = zq->tail_commit;
+    spin_unlock(&zq->tail_lock);
+    smp_rmb();
+    ret = ((zq->reg->cq_tail & qmask) == (tail & qmask) ? 0 : -EAGAIN);
+
+ done:
+    return ret;
+}
@@ -38,5 +38,7 @@
 
 static void __attribute__((constructor)) lib_init(void)
 {
+    zhpeq_register_backend(ZHPEQ_BACKEND_ZHPE, &zhpe_ops);
     zhpeq_register_backend(ZHPEQ_BACKEND_LIBFABRIC, &libfabric_ops);
+    zhpeq_register_backend(ZHPEQ_BACKEND_SHM, &shm_ops);
 }
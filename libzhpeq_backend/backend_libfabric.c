@@ -38,26 +38,90 @@
 
 #include <zhpeq_util_fab.h>
 
+#include <limits.h>
+#include <sched.h>
+
+#include <linux/mempolicy.h>
+
 #include <sys/queue.h>
+#include <sys/syscall.h>
 
 #define FIVERSION       FI_VERSION(1, 5)
 
 #define SLEEP_THRESHOLD_NS (20000)
+/* How long a closing queue waits for posted operations to complete. */
+#define DRAIN_TIMEOUT_NS   (1000000000)
+
+/* open_idx is returned as an int. */
+#define AV_MAX          (INT_MAX)
+
+#define ENGINE_CPUS_ENV "ZHPEQ_ENGINE_CPUS"
+#define ENGINE_NUMA_ENV "ZHPEQ_ENGINE_NUMA"
+#define ENGINE_NUMA_MAX (1024)
 
-#define AV_MAX          (16383)
+#define SCALABLE_EP_ENV "ZHPEQ_SCALABLE_EP"
+#define SEP_TX_MAX      (1024)
 
-#define KEY_SHIFT       47
+/*
+ * A zaddr is a key index over an offset into the registration: 21 bits of
+ * index (2M keys, local or imported) and registrations of up to 8 TiB. The
+ * key table entry holds the base address.
+ */
+#define KEY_SHIFT       43
 #define KEY_MASK_ADDR   (((uint64_t)1 << KEY_SHIFT) - 1)
 #define KEYTAB_SHIFT    (64 - KEY_SHIFT)
 #define KEYTAB_SIZE     ((size_t)1 << KEYTAB_SHIFT)
 
+/* Key tables are paged: pages are allocated as the high-water mark grows. */
+#define KEYTAB_PAGE_SHIFT (10)
+#define KEYTAB_PAGE_SIZE ((size_t)1 << KEYTAB_PAGE_SHIFT)
+#define KEYTAB_PAGES    (KEYTAB_SIZE >> KEYTAB_PAGE_SHIFT)
+#define KEYTAB_PAGE(_idx) ((_idx) >> KEYTAB_PAGE_SHIFT)
+#define KEYTAB_OFF(_idx) ((_idx) & (KEYTAB_PAGE_SIZE - 1))
+
 #define TO_KEYIDX(_addr) ((_addr) >> KEY_SHIFT)
 #define TO_ADDR(_addr)  ((_addr) & KEY_MASK_ADDR)
 
+/*
+ * mr is tagged with bit 0 while the entry is on the free list and is
+ * NULL if the entry was never handed out.
+ */
+struct lcl_mr {
+    struct fid_mr       *mr;
+    uint64_t            vaddr;
+};
+
+/*
+ * A peer in the shared AV of a scalable endpoint. Every queue of a peer
+ * process has the same address, so the peer is inserted and handshaken
+ * once and queue opens take a reference: a second AV entry for the same
+ * address would break the directed FI_PEEK in fab_av_wait_recv(). status
+ * is 1 while the handshake is in progress, 0 when done, and negative if
+ * it failed and the entry has been unlinked.
+ */
+struct sep_peer {
+    STAILQ_ENTRY(sep_peer) list;
+    union sockaddr_in46 ep_addr;
+    fi_addr_t           fi_addr;
+    uint64_t            ref;
+    int                 status;
+};
+
+STAILQ_HEAD(sep_peer_head, sep_peer);
+
 struct zdom_data {
     struct fab_dom      fab_dom;
-    struct fid_mr       **lcl_mr;
+    struct lcl_mr       **lcl_mr;
     union free_index    lcl_mr_free;
+    uint32_t            lcl_mr_hwm;
+    cpu_set_t           engine_cpus;
+    int                 engine_node;
+    bool                engine_pin;
+    pthread_mutex_t     sep_mutex;
+    pthread_cond_t      sep_cond;
+    bool                *sep_tx_used;
+    size_t              sep_tx_cnt;
+    struct sep_peer_head sep_peers;
 };
 
 enum engine_init {
@@ -101,19 +165,54 @@ static inline void unpack_kdata(const struct key_data_packed *pdata,
  * deleting all the sockets derived from it. Seems stupid.
  */
 
+/* rkey is the free list link while the entry is not in use. */
 struct rkey {
     uint64_t            rkey;
     uint64_t            av_idx;
+    uint64_t            vaddr;
+    bool                used;
 };
 
+enum context_op {
+    CONTEXT_OP_WRITE,
+    CONTEXT_OP_READ,
+    CONTEXT_OP_ATM_SUM,
+    CONTEXT_OP_ATM_CSWAP,
+};
+
+/*
+ * The context holds the fully decoded operation so that a post that
+ * returns FI_EAGAIN can be retried later without going back to the WQE.
+ */
+
 struct context {
     struct fi_context2  opaque;
+    STAILQ_ENTRY(context) pend_list;
     struct zhpeq_result *result;
     ZHPEQ_TIMING_CODE(struct zhpeq_timing_stamp timestamp);
+    uint64_t            flags;
+    fi_addr_t           addr;
+    void                *ldsc;
+    struct iovec        iov;
+    struct fi_rma_iov   rma_iov;
+    enum fi_datatype    datatype;
     uint16_t            cmp_index;
     uint8_t             result_len;
+    uint8_t             op;
+    bool                active;
+};
+
+STAILQ_HEAD(context_head, context);
+
+/* Operations waiting on a destination that returned FI_EAGAIN. */
+struct pend_dest {
+    STAILQ_ENTRY(pend_dest) list;
+    struct context_head pend;
+    fi_addr_t           addr;
 };
 
+STAILQ_HEAD(pend_dest_head, pend_dest);
+
 #ifdef ZHPEQ_TIMING
 
 #define lfabt_cmdpost(_data, _wqe, _ctxt)                               \
@@ -148,11 +247,16 @@ do {                                                                    \
 #define AV_OP_INSERT_INIT (4)
 #define AV_OP_REMOVE_INIT (AV_OP_INSERT_INIT + 1)
 
+/* Inserts and handshakes count peers; a single open has count 1. */
 struct av_op {
     struct av_op        *next;
     struct av_op        *prev;
-    union sockaddr_in46 ep_addr;
-    fi_addr_t           fi_addr;
+    union sockaddr_in46 *ep_addrs;
+    fi_addr_t           *fi_addrs;
+    bool                *recv_done;
+    size_t              count;
+    size_t              next_send;
+    size_t              n_recv;
     pthread_cond_t      cond;
     int                 status;
 };
@@ -160,20 +264,34 @@ struct av_op {
 struct stuff {
     struct fab_conn     fab_conn;
     struct fab_conn     fab_listener;
+    /* Owner of the AV and rx side: fab_conn or the domain's endpoint. */
+    struct fab_conn     *av_conn;
+    struct zdom_data    *bdom;
+    int                 sep_tx;
     union free_index    rkey_free;
-    struct rkey         *rkey;
+    uint32_t            rkey_hwm;
+    struct rkey         **rkey;
     pthread_mutex_t     wq_mutex;
     pthread_cond_t      wq_cond;
     uint64_t            wq_signal;
     uint64_t            wq_signal_seen;
     pthread_t           wq_thread;
     struct context      *context;
+    size_t              context_len;
     struct context      *context_free;
+    uint32_t            n_context;
+    struct pend_dest    *pend_dest;
+    struct pend_dest_head pend_active;
+    struct pend_dest_head pend_free;
+    uint64_t            tx_queued;
+    uint64_t            tx_completed;
     struct zhpeq_result *results;
+    size_t              results_len;
     struct fid_mr       *results_mr;
     void                *results_desc;
     struct av_op        *av_cur;
     uint32_t            cq_tail;
+    uint32_t            cq_pend;
     enum engine_init    engine_init;
     volatile bool       halt;
     bool                allocated;
@@ -223,6 +341,80 @@ static inline void conn_wq_signal(struct stuff *conn, bool locked)
         mutex_unlock(&conn->wq_mutex);
 }
 
+static void **keytab_alloc(void)
+{
+    return do_calloc(KEYTAB_PAGES, sizeof(void *));
+}
+
+static void keytab_free(void **pages)
+{
+    size_t              i;
+
+    if (!pages)
+        return;
+    for (i = 0; i < KEYTAB_PAGES; i++)
+        do_free(pages[i]);
+    do_free(pages);
+}
+
+/*
+ * Take a never-used index when the free list is empty, allocating its
+ * page if it is the first on it. If the page cannot be allocated, the
+ * index is lost; that only happens if we're out of memory anyway.
+ */
+static int32_t keytab_new(void **pages, uint32_t *hwm, size_t entry_size)
+{
+    int32_t             ret;
+    uint32_t            index = __sync_fetch_and_add(hwm, 1);
+    void                **pagep;
+    void                *page;
+
+    if (index >= KEYTAB_SIZE) {
+        ret = -ENOSPC;
+        goto done;
+    }
+    ret = index;
+    pagep = &pages[KEYTAB_PAGE(index)];
+    if (atomic_load_lazy_ptr(pagep))
+        goto done;
+    page = do_calloc(KEYTAB_PAGE_SIZE, entry_size);
+    if (!page) {
+        ret = -ENOMEM;
+        goto done;
+    }
+    if (!__sync_bool_compare_and_swap(pagep, NULL, page))
+        do_free(page);
+
+ done:
+    return ret;
+}
+
+/* NULL if the page was never allocated: the index was never handed out. */
+static inline struct rkey *rkey_entry(struct stuff *conn, uint32_t index)
+{
+    struct rkey         *page = conn->rkey[KEYTAB_PAGE(index)];
+
+    return (likely(page != NULL) ? &page[KEYTAB_OFF(index)] : NULL);
+}
+
+static inline struct lcl_mr *lcl_mr_entry(struct zdom_data *bdom,
+                                          uint32_t index)
+{
+    struct lcl_mr       *page = bdom->lcl_mr[KEYTAB_PAGE(index)];
+
+    return (likely(page != NULL) ? &page[KEYTAB_OFF(index)] : NULL);
+}
+
+/* Release engine_alloc() memory. */
+static void engine_free(void *ptr, size_t size)
+{
+    if (!ptr)
+        return;
+    size = (size + page_size - 1) & ~(page_size - 1);
+    if (munmap(ptr, size) == -1)
+        print_func_err(__FUNCTION__, __LINE__, "munmap", "", -errno);
+}
+
 static int stuff_free(struct stuff *stuff)
 {
     int                 ret = 0;
@@ -257,12 +449,19 @@ static int stuff_free(struct stuff *stuff)
         break;
     }
 
-    do_free(stuff->context);
+    engine_free(stuff->context, stuff->context_len);
+    do_free(stuff->pend_dest);
     if (stuff->results_mr)
         fi_close(&stuff->results_mr->fid);
-    do_free(stuff->results);
+    engine_free(stuff->results, stuff->results_len);
     fab_conn_free(&stuff->fab_conn);
     fab_conn_free(&stuff->fab_listener);
+    keytab_free((void **)stuff->rkey);
+    if (stuff->sep_tx >= 0) {
+        mutex_lock(&stuff->bdom->sep_mutex);
+        stuff->bdom->sep_tx_used[stuff->sep_tx] = false;
+        mutex_unlock(&stuff->bdom->sep_mutex);
+    }
 
     if (stuff->allocated)
         free(stuff);
@@ -275,12 +474,22 @@ static int lfab_domain_free(struct zhpeq_dom *zdom)
 {
     int                 ret = 0;
     struct zdom_data    *bdom = zdom->backend_data;
+    struct sep_peer     *peer;
 
     if (!bdom)
         goto done;
 
-    free(bdom->lcl_mr);
+    keytab_free((void **)bdom->lcl_mr);
     ret = fab_conn_free(&bdom->fab_dom.fab_conn);
+    if (bdom->sep_tx_used) {
+        while ((peer = STAILQ_FIRST(&bdom->sep_peers))) {
+            STAILQ_REMOVE_HEAD(&bdom->sep_peers, list);
+            do_free(peer);
+        }
+        do_free(bdom->sep_tx_used);
+        mutex_destroy(&bdom->sep_mutex);
+        cond_destroy(&bdom->sep_cond);
+    }
     free(bdom);
     zdom->backend_data = NULL;
 
@@ -288,6 +497,255 @@ static int lfab_domain_free(struct zhpeq_dom *zdom)
     return ret;
 }
 
+static int parse_cpulist(const char *name, const char *sp, cpu_set_t *set)
+{
+    int                 ret = -EINVAL;
+    const char          *cp = sp;
+    char                *ep;
+    ulong               beg;
+    ulong               end;
+
+    CPU_ZERO(set);
+    for (;;) {
+        while (*cp == ' ' || *cp == '\t' || *cp == '\n')
+            cp++;
+        if (!*cp)
+            break;
+        errno = 0;
+        beg = strtoul(cp, &ep, 10);
+        if (errno || ep == cp)
+            goto error;
+        end = beg;
+        if (*ep == '-') {
+            cp = ep + 1;
+            end = strtoul(cp, &ep, 10);
+            if (errno || ep == cp || end < beg)
+                goto error;
+        }
+        if (end >= CPU_SETSIZE)
+            goto error;
+        for (; beg <= end; beg++)
+            CPU_SET(beg, set);
+        cp = ep;
+        if (*cp == ',')
+            cp++;
+        else if (*cp && *cp != '\n')
+            goto error;
+    }
+    if (CPU_COUNT(set)) {
+        ret = 0;
+        goto done;
+    }
+
+ error:
+    print_err("%s,%u:Could not parse %s = %s as a CPU list\n",
+              __FUNCTION__, __LINE__, name, sp);
+ done:
+    return ret;
+}
+
+static int read_sysfs(const char *path, char *buf, size_t buf_len)
+{
+    int                 ret;
+    int                 fd;
+    ssize_t             len;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return -errno;
+    len = read(fd, buf, buf_len - 1);
+    ret = (len < 0 ? -errno : 0);
+    close(fd);
+    if (ret >= 0)
+        buf[len] = '\0';
+
+    return ret;
+}
+
+/* Return the NUMA node of the provider's device, or -1 if unknown. */
+static int device_numa_node(struct fi_info *info)
+{
+    int                 ret = -1;
+    char                path[PATH_MAX];
+    char                buf[32];
+    struct fi_pci_attr  *pci;
+
+    if (info->nic && info->nic->bus_attr &&
+        info->nic->bus_attr->bus_type == FI_BUS_PCI) {
+        pci = &info->nic->bus_attr->attr.pci;
+        snprintf(path, sizeof(path),
+                 "/sys/bus/pci/devices/%04x:%02x:%02x.%x/numa_node",
+                 pci->domain_id, pci->bus_id, pci->device_id,
+                 pci->function_id);
+    } else if (info->domain_attr && info->domain_attr->name)
+        /* verbs domains are named for their device. */
+        snprintf(path, sizeof(path),
+                 "/sys/class/infiniband/%s/device/numa_node",
+                 info->domain_attr->name);
+    else
+        goto done;
+    if (read_sysfs(path, buf, sizeof(buf)) < 0)
+        goto done;
+    ret = atoi(buf);
+
+ done:
+    return ret;
+}
+
+static int engine_placement(const union zhpeq_backend_params *params,
+                            struct zdom_data *bdom)
+{
+    int                 ret = 0;
+    const char          *cpus = NULL;
+    const char          *numa = NULL;
+    char                path[PATH_MAX];
+    char                buf[4096];
+    char                *ep;
+
+    bdom->engine_node = -1;
+    if (params) {
+        cpus = params->libfabric.engine_cpus;
+        numa = params->libfabric.engine_numa;
+    }
+    if (!cpus)
+        cpus = getenv(ENGINE_CPUS_ENV);
+    if (!numa)
+        numa = getenv(ENGINE_NUMA_ENV);
+
+    if (!numa || !*numa || !strcmp(numa, "none"))
+        ;
+    else if (!strcmp(numa, "auto")) {
+        bdom->engine_node = device_numa_node(bdom->fab_dom.fab_conn.info);
+        if (bdom->engine_node < 0)
+            print_info("%s,%u:No NUMA node for device; not placing engine\n",
+                       __FUNCTION__, __LINE__);
+    } else {
+        errno = 0;
+        bdom->engine_node = strtol(numa, &ep, 10);
+        if (errno || *ep || bdom->engine_node < 0 ||
+            bdom->engine_node >= ENGINE_NUMA_MAX) {
+            print_err("%s,%u:Could not parse %s = %s as a NUMA node\n",
+                      __FUNCTION__, __LINE__, ENGINE_NUMA_ENV, numa);
+            ret = -EINVAL;
+            goto done;
+        }
+    }
+
+    /* An explicit CPU list wins; otherwise, use the CPUs of the node. */
+    if (cpus && *cpus) {
+        ret = parse_cpulist(ENGINE_CPUS_ENV, cpus, &bdom->engine_cpus);
+        if (ret < 0)
+            goto done;
+        bdom->engine_pin = true;
+    } else if (bdom->engine_node >= 0) {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+                 bdom->engine_node);
+        ret = read_sysfs(path, buf, sizeof(buf));
+        if (ret < 0) {
+            print_func_err(__FUNCTION__, __LINE__, "read_sysfs", path, ret);
+            goto done;
+        }
+        ret = parse_cpulist(path, buf, &bdom->engine_cpus);
+        if (ret < 0)
+            goto done;
+        bdom->engine_pin = true;
+    }
+
+ done:
+    return ret;
+}
+
+/*
+ * Engine data is allocated on the engine's node, if there is one. It is
+ * mapped rather than taken from the heap so the node policy does not
+ * stay on pages malloc() hands out later.
+ */
+static void *engine_alloc(struct zdom_data *bdom, size_t size)
+{
+    void                *ret;
+    ulong               nodemask[ENGINE_NUMA_MAX / (8 * sizeof(ulong))];
+
+    size = (size + page_size - 1) & ~(page_size - 1);
+    ret = mmap(NULL, size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ret == MAP_FAILED) {
+        print_func_errn(__FUNCTION__, __LINE__, "mmap", size, false, -errno);
+        return NULL;
+    }
+    if (bdom->engine_node < 0)
+        return ret;
+
+    memset(nodemask, 0, sizeof(nodemask));
+    nodemask[bdom->engine_node / (8 * sizeof(ulong))] |=
+        1UL << (bdom->engine_node % (8 * sizeof(ulong)));
+    /*
+     * Only a preference: failure is not fatal. The kernel uses only
+     * maxnode - 1 bits of the mask.
+     */
+    if (syscall(SYS_mbind, ret, size, MPOL_PREFERRED, nodemask,
+                ENGINE_NUMA_MAX + 1, MPOL_MF_MOVE) == -1)
+        print_func_err(__FUNCTION__, __LINE__, "mbind", "", -errno);
+
+    return ret;
+}
+
+static int sep_setup(const union zhpeq_backend_params *params,
+                     struct zdom_data *bdom)
+{
+    int                 ret = 0;
+    struct fab_conn     *fab_conn = &bdom->fab_dom.fab_conn;
+    const char          *env;
+    size_t              cnt;
+
+    if (!params || !params->libfabric.scalable_ep) {
+        env = getenv(SCALABLE_EP_ENV);
+        if (!env || strcmp(env, "1"))
+            goto done;
+    }
+
+    cnt = fab_conn->info->domain_attr->max_ep_tx_ctx;
+    if (cnt > SEP_TX_MAX)
+        cnt = SEP_TX_MAX;
+    if (cnt <= 1) {
+        print_info("%s,%u:provider has no tx contexts;"
+                   " using an endpoint per queue\n", __FUNCTION__, __LINE__);
+        goto done;
+    }
+    ret = fab_sep_setup(fab_conn, cnt, 0);
+    if (ret < 0)
+        goto done;
+    ret = -ENOMEM;
+    bdom->sep_tx_used = do_calloc(cnt, sizeof(*bdom->sep_tx_used));
+    if (!bdom->sep_tx_used)
+        goto done;
+    bdom->sep_tx_cnt = cnt;
+    STAILQ_INIT(&bdom->sep_peers);
+    mutex_init(&bdom->sep_mutex, NULL);
+    cond_init(&bdom->sep_cond, NULL);
+    ret = 0;
+
+ done:
+    return ret;
+}
+
+static int sep_tx_alloc(struct zdom_data *bdom)
+{
+    int                 ret = -ENOSPC;
+    size_t              i;
+
+    mutex_lock(&bdom->sep_mutex);
+    for (i = 0; i < bdom->sep_tx_cnt; i++) {
+        if (!bdom->sep_tx_used[i]) {
+            bdom->sep_tx_used[i] = true;
+            ret = i;
+            break;
+        }
+    }
+    mutex_unlock(&bdom->sep_mutex);
+
+    return ret;
+}
+
 static int lfab_domain(const union zhpeq_backend_params *params,
                        struct zhpeq_dom *zdom)
 {
@@ -295,7 +753,6 @@ static int lfab_domain(const union zhpeq_backend_params *params,
     const char          *provider = NULL;
     const char          *domain = NULL;
     struct zdom_data    *bdom;
-    size_t              i;
 
     if (params) {
         provider = params->libfabric.provider_name;
@@ -306,17 +763,20 @@ static int lfab_domain(const union zhpeq_backend_params *params,
     if (!bdom)
         goto done;
     fab_dom_init(&bdom->fab_dom);
-    bdom->lcl_mr = do_calloc(KEYTAB_SIZE, sizeof(*bdom->lcl_mr));
+    bdom->lcl_mr = (struct lcl_mr **)keytab_alloc();
     if (!bdom->lcl_mr)
         goto done;
-    bdom->lcl_mr_free.index = 1;
-    for (i = 0; i < KEYTAB_SIZE - 1; i++)
-        bdom->lcl_mr[i] = TO_PTR(((i + 1) << 1) | 1);
-    bdom->lcl_mr[i] = TO_PTR(-1);
+    bdom->lcl_mr_free.index = FREE_END;
 
     ret = fab_av_domain(provider, domain, &bdom->fab_dom);
     if (ret < 0)
         goto done;
+    ret = engine_placement(params, bdom);
+    if (ret < 0)
+        goto done;
+    ret = sep_setup(params, bdom);
+    if (ret < 0)
+        goto done;
 
  done:
 
@@ -327,19 +787,21 @@ static struct stuff *stuff_alloc(struct fab_dom *dom)
 {
     struct stuff        *ret = NULL;
     int                 err = 0;
-    size_t              req;
-    size_t              i;
 
-    req = sizeof(*ret) + sizeof(*ret->rkey) * KEYTAB_SIZE;
-    ret = do_calloc(1, req);
+    ret = do_calloc(1, sizeof(*ret));
     if (!ret)
         goto done;
     ret->allocated = true;
-    ret->rkey = (void *)ret + sizeof(*ret);
-    ret->rkey_free.index = 0;
-    for (i = 0; i < KEYTAB_SIZE - 1; i++)
-        ret->rkey[i].rkey = i + 1;
-    ret->rkey[i].rkey = FI_KEY_NOTAVAIL;
+    ret->av_conn = &ret->fab_conn;
+    ret->sep_tx = -1;
+    ret->rkey_free.index = FREE_END;
+    ret->rkey = (struct rkey **)keytab_alloc();
+    if (!ret->rkey) {
+        err = -ENOMEM;
+        goto done;
+    }
+    STAILQ_INIT(&ret->pend_active);
+    STAILQ_INIT(&ret->pend_free);
     fab_conn_init(dom, &ret->fab_conn);
     fab_conn_init(dom, &ret->fab_listener);
 
@@ -372,9 +834,20 @@ static int lfab_qalloc(struct zhpeq_dom *zdom, struct zhpeq *zq)
     if (!conn)
         goto done;
     zq->backend_data = conn;
+    conn->bdom = bdom;
     fab_conn = &conn->fab_conn;
 
-    ret = fab_ep_setup(fab_conn, NULL, 0, 0);
+    if (bdom->sep_tx_used) {
+        ret = sep_tx_alloc(bdom);
+        if (ret < 0) {
+            print_func_err(__FUNCTION__, __LINE__, "sep_tx_alloc", "", ret);
+            goto done;
+        }
+        conn->sep_tx = ret;
+        conn->av_conn = &bdom->fab_dom.fab_conn;
+        ret = fab_sep_tx_setup(conn->av_conn, fab_conn, conn->sep_tx, 0);
+    } else
+        ret = fab_ep_setup(fab_conn, NULL, 0, 0);
     if (ret < 0)
         goto done;
 
@@ -388,16 +861,24 @@ static int lfab_qalloc(struct zhpeq_dom *zdom, struct zhpeq *zq)
     /* FIXME: Looks like per-AV limit of 7. Need to handle this. */
     req = 7;
 #endif
-    conn->context = do_malloc(req * sizeof(*conn->context));
+    conn->context_len = req * sizeof(*conn->context);
+    conn->context = engine_alloc(bdom, conn->context_len);
     if (!conn->context)
         goto done;
+    /* A destination can only be pending if it holds a context. */
+    conn->pend_dest = do_malloc(req * sizeof(*conn->pend_dest));
+    if (!conn->pend_dest)
+        goto done;
+    conn->n_context = req;
     while (req > 0) {
         req--;
         conn->context[req].opaque.internal[0] = conn->context_free;
         conn->context_free = &conn->context[req];
+        STAILQ_INSERT_HEAD(&conn->pend_free, &conn->pend_dest[req], list);
     }
     req = zq->info.qlen * sizeof(*conn->results);
-    conn->results = do_malloc(req);
+    conn->results_len = req;
+    conn->results = engine_alloc(bdom, req);
     if (!conn->results)
         goto done;
     ret = fi_mr_reg(fab_conn->domain, conn->results, req,
@@ -432,72 +913,312 @@ static inline int do_av_op(struct stuff *conn, struct av_op *av_op)
     return av_op->status;
 }
 
+static struct sep_peer *sep_peer_find(struct zdom_data *bdom,
+                                      const union sockaddr_in46 *ep_addr)
+{
+    struct sep_peer     *peer;
+
+    STAILQ_FOREACH(peer, &bdom->sep_peers, list) {
+        if (!sockaddr_cmp(&peer->ep_addr, ep_addr))
+            break;
+    }
+
+    return peer;
+}
+
+static void sep_peer_put(struct sep_peer *peer)
+{
+    /*
+     * Handshaken peers stay in the AV until the domain is freed even when
+     * unreferenced: the peer still has our entry and would not answer a
+     * second handshake.
+     */
+    if (!--peer->ref && peer->status < 0)
+        do_free(peer);
+}
+
+/* Take a reference on each peer, inserting and handshaking new ones. */
+static int sep_open(struct stuff *conn, size_t count,
+                    const union sockaddr_in46 *ep_addrs, fi_addr_t *fi_addrs)
+{
+    int                 ret = -ENOMEM;
+    struct zdom_data    *bdom = conn->bdom;
+    struct sep_peer     **peers;
+    struct sep_peer     **ins;
+    struct sep_peer     *peer;
+    struct av_op        av_op = {
+        .status         = AV_OP_INSERT_INIT,
+    };
+    size_t              i;
+
+    peers = do_calloc(count, sizeof(*peers));
+    ins = do_malloc(count * sizeof(*ins));
+    av_op.ep_addrs = do_malloc(count * sizeof(*av_op.ep_addrs));
+    av_op.fi_addrs = do_malloc(count * sizeof(*av_op.fi_addrs));
+    av_op.recv_done = do_calloc(count, sizeof(*av_op.recv_done));
+    if (!peers || !ins || !av_op.ep_addrs || !av_op.fi_addrs ||
+        !av_op.recv_done)
+        goto done;
+
+    ret = 0;
+    mutex_lock(&bdom->sep_mutex);
+    for (i = 0; i < count; i++) {
+        peer = sep_peer_find(bdom, &ep_addrs[i]);
+        if (!peer) {
+            peer = do_calloc(1, sizeof(*peer));
+            if (!peer) {
+                ret = -ENOMEM;
+                break;
+            }
+            sockaddr_cpy(&peer->ep_addr, &ep_addrs[i]);
+            peer->fi_addr = FI_ADDR_UNSPEC;
+            peer->status = 1;
+            STAILQ_INSERT_TAIL(&bdom->sep_peers, peer, list);
+            ins[av_op.count] = peer;
+            sockaddr_cpy(&av_op.ep_addrs[av_op.count], &ep_addrs[i]);
+            av_op.fi_addrs[av_op.count] = FI_ADDR_UNSPEC;
+            av_op.count++;
+        }
+        peer->ref++;
+        peers[i] = peer;
+    }
+    mutex_unlock(&bdom->sep_mutex);
+
+    /* Peers being handshaken by another queue are waited for below. */
+    if (ret >= 0 && av_op.count)
+        ret = do_av_op(conn, &av_op);
+    if (ret < 0 && av_op.count && av_op.fi_addrs[0] != FI_ADDR_UNSPEC) {
+        av_op.status = AV_OP_REMOVE_INIT;
+        (void)do_av_op(conn, &av_op);
+    }
+
+    mutex_lock(&bdom->sep_mutex);
+    for (i = 0; i < av_op.count; i++) {
+        peer = ins[i];
+        if (ret < 0) {
+            peer->status = ret;
+            STAILQ_REMOVE(&bdom->sep_peers, peer, sep_peer, list);
+        } else {
+            peer->fi_addr = av_op.fi_addrs[i];
+            peer->status = 0;
+        }
+    }
+    if (av_op.count)
+        cond_broadcast(&bdom->sep_cond);
+    for (i = 0; i < count && peers[i]; i++) {
+        while (peers[i]->status > 0)
+            cond_wait(&bdom->sep_cond, &bdom->sep_mutex);
+        if (peers[i]->status < 0 && ret >= 0)
+            ret = peers[i]->status;
+    }
+    for (i = 0; i < count; i++) {
+        fi_addrs[i] = FI_ADDR_UNSPEC;
+        if (!peers[i])
+            continue;
+        if (ret < 0)
+            sep_peer_put(peers[i]);
+        else
+            fi_addrs[i] = peers[i]->fi_addr;
+    }
+    mutex_unlock(&bdom->sep_mutex);
+
+ done:
+    do_free(peers);
+    do_free(ins);
+    do_free(av_op.ep_addrs);
+    do_free(av_op.fi_addrs);
+    do_free(av_op.recv_done);
+
+    return ret;
+}
+
+static int sep_close(struct zdom_data *bdom, size_t count,
+                     const fi_addr_t *fi_addrs)
+{
+    int                 ret = 0;
+    struct sep_peer     *peer;
+    size_t              i;
+
+    mutex_lock(&bdom->sep_mutex);
+    for (i = 0; i < count; i++) {
+        STAILQ_FOREACH(peer, &bdom->sep_peers, list) {
+            if (!peer->status && peer->fi_addr == fi_addrs[i])
+                break;
+        }
+        if (!peer || !peer->ref) {
+            print_err("%s,%u:av %lu not open\n",
+                      __FUNCTION__, __LINE__, fi_addrs[i]);
+            ret = -FI_EINVAL;
+            continue;
+        }
+        sep_peer_put(peer);
+    }
+    mutex_unlock(&bdom->sep_mutex);
+
+    return ret;
+}
+
 static int lfab_open(struct zhpeq *zq, int sock_fd)
 {
     int                 ret;
     struct stuff        *conn = zq->backend_data;
-    struct fab_conn     *fab_conn = &conn->fab_conn;
+    union sockaddr_in46 ep_addr;
+    fi_addr_t           fi_addr = FI_ADDR_UNSPEC;
+    bool                recv_done = false;
     struct av_op        av_op = {
         .status         = AV_OP_INSERT_INIT,
-        .fi_addr        = FI_ADDR_UNSPEC,
+        .ep_addrs       = &ep_addr,
+        .fi_addrs       = &fi_addr,
+        .recv_done      = &recv_done,
+        .count          = 1,
     };
 
-    ret = fab_av_xchg_addr(fab_conn, sock_fd, &av_op.ep_addr);
+    ret = fab_av_xchg_addr(conn->av_conn, sock_fd, &ep_addr);
     if (ret < 0)
         goto done;
-    ret = do_av_op(conn, &av_op);
+    if (conn->sep_tx >= 0)
+        ret = sep_open(conn, 1, &ep_addr, &fi_addr);
+    else
+        ret = do_av_op(conn, &av_op);
     if (ret >= 0) {
-        ret = av_op.fi_addr;
-        if (av_op.fi_addr > AV_MAX) {
+        ret = fi_addr;
+        if (fi_addr > AV_MAX) {
             print_err("%s,%u:av %lu exceeds AV_MAX %u\n",
-                      __FUNCTION__, __LINE__, av_op.fi_addr, AV_MAX);
+                      __FUNCTION__, __LINE__, fi_addr, AV_MAX);
             ret = -FI_EINVAL;
         }
     }
  done:
-    if (ret < 0 && av_op.fi_addr != FI_ADDR_UNSPEC) {
-        av_op.status = AV_OP_REMOVE_INIT;
-        (void)do_av_op(conn, &av_op);
+    if (ret < 0 && fi_addr != FI_ADDR_UNSPEC) {
+        if (conn->sep_tx >= 0)
+            (void)sep_close(conn->bdom, 1, &fi_addr);
+        else {
+            av_op.status = AV_OP_REMOVE_INIT;
+            (void)do_av_op(conn, &av_op);
+        }
     }
 
     return ret;
 }
 
+static int lfab_open_many(struct zhpeq *zq, size_t count,
+                          const int *sock_fds, int *open_idx)
+{
+    int                 ret = -ENOMEM;
+    struct stuff        *conn = zq->backend_data;
+    struct av_op        av_op = {
+        .status         = AV_OP_INSERT_INIT,
+        .count          = count,
+    };
+    size_t              i;
+
+    av_op.ep_addrs = do_malloc(count * sizeof(*av_op.ep_addrs));
+    av_op.fi_addrs = do_malloc(count * sizeof(*av_op.fi_addrs));
+    av_op.recv_done = do_calloc(count, sizeof(*av_op.recv_done));
+    if (!av_op.ep_addrs || !av_op.fi_addrs || !av_op.recv_done)
+        goto done;
+    for (i = 0; i < count; i++)
+        av_op.fi_addrs[i] = FI_ADDR_UNSPEC;
+
+    ret = fab_av_xchg_addr_many(conn->av_conn, count, sock_fds,
+                                av_op.ep_addrs);
+    if (ret < 0)
+        goto done;
+    if (conn->sep_tx >= 0)
+        ret = sep_open(conn, count, av_op.ep_addrs, av_op.fi_addrs);
+    else
+        ret = do_av_op(conn, &av_op);
+    if (ret < 0)
+        goto done;
+    for (i = 0; i < count; i++) {
+        if (av_op.fi_addrs[i] > AV_MAX) {
+            print_err("%s,%u:av %lu exceeds AV_MAX %u\n",
+                      __FUNCTION__, __LINE__, av_op.fi_addrs[i], AV_MAX);
+            ret = -FI_EINVAL;
+            goto done;
+        }
+        open_idx[i] = av_op.fi_addrs[i];
+    }
+ done:
+    if (ret < 0 && av_op.fi_addrs && av_op.fi_addrs[0] != FI_ADDR_UNSPEC) {
+        if (conn->sep_tx >= 0)
+            (void)sep_close(conn->bdom, count, av_op.fi_addrs);
+        else {
+            av_op.status = AV_OP_REMOVE_INIT;
+            (void)do_av_op(conn, &av_op);
+        }
+    }
+    do_free(av_op.ep_addrs);
+    do_free(av_op.fi_addrs);
+    do_free(av_op.recv_done);
+
+    return ret;
+}
+
 static int lfab_close(struct zhpeq *zq, int open_idx)
 {
     struct stuff        *conn = zq->backend_data;
+    fi_addr_t           fi_addr = open_idx;
     struct av_op        av_op = {
         .status         = AV_OP_REMOVE_INIT,
-        .fi_addr        = open_idx,
+        .fi_addrs       = &fi_addr,
+        .count          = 1,
     };
 
+    if (conn->sep_tx >= 0)
+        return sep_close(conn->bdom, 1, &fi_addr);
+
     return do_av_op(conn, &av_op);
 }
 
+/* Place context on free list. */
+static inline void context_put(struct stuff *conn, struct context *context)
+{
+    context->active = false;
+    context->opaque.internal[0] = conn->context_free;
+    conn->context_free = context;
+}
+
 static inline void cq_write(struct zhpeq *zq, void *vcontext, int status)
 {
-    struct zhpe_hw_reg *reg = zq->reg;
     struct stuff        *conn = zq->backend_data;
     struct context      *context = vcontext;
     uint32_t            qmask = zq->info.qlen - 1;
-    union zhpe_hw_cq_entry *cqe = zq->cq + (conn->cq_tail & qmask);
+    union zhpe_hw_cq_entry *cqe = zq->cq + (conn->cq_pend & qmask);
 
     lfabt_cmddone(context, cqe);
 
+    /* The valid bit is set by cq_flush(). */
     cqe->entry.index = context->cmp_index;
-    cqe->entry.status = (status < 0 ? ZHPEQ_CQ_STATUS_FABRIC_UNRECOVERABLE :
-                         ZHPEQ_CQ_STATUS_SUCCESS);
+    if (likely(status >= 0))
+        cqe->entry.status = ZHPEQ_CQ_STATUS_SUCCESS;
+    else if (status == -ECANCELED || status == -FI_ECANCELED)
+        cqe->entry.status = ZHPEQ_CQ_STATUS_CANCELED;
+    else
+        cqe->entry.status = ZHPEQ_CQ_STATUS_FABRIC_UNRECOVERABLE;
     if (context->result)
         memcpy(cqe->entry.result.data, context->result->data,
                context->result_len);
-    smp_wmb();
+    conn->cq_pend++;
+    context_put(conn, context);
+}
+
+/* Publish all entries written since the last flush with one barrier. */
+static inline void cq_flush(struct zhpeq *zq)
+{
+    struct zhpe_hw_reg *reg = zq->reg;
+    struct stuff        *conn = zq->backend_data;
+    uint32_t            qmask = zq->info.qlen - 1;
+    uint32_t            cq_tail = conn->cq_tail;
+
+    if (cq_tail == conn->cq_pend)
+        return;
+    smp_wmb_wb();
+    for (; cq_tail != conn->cq_pend; cq_tail++)
+        zq->cq[cq_tail & qmask].entry.valid = cq_valid(cq_tail, qmask);
     /* The following two events can be seen out of order: don't care. */
-    cqe->entry.valid = cq_valid(conn->cq_tail, qmask);
-    conn->cq_tail++;
-    reg->cq_tail  = (conn->cq_tail & qmask);
-    /* Place context on free list. */
-    context->opaque.internal[0] = conn->context_free;
-    conn->context_free = context;
+    conn->cq_tail = cq_tail;
+    reg->cq_tail  = (cq_tail & qmask);
 }
 
 static void cq_update(void *arg, void *vcqe, bool err)
@@ -520,6 +1241,293 @@ static int retry_none(void *args)
     return 1;
 }
 
+static ssize_t context_post_rma(struct stuff *conn, struct context *context)
+{
+    ssize_t             ret;
+    struct fi_msg_rma   msg = {
+        .msg_iov        = &context->iov,
+        .desc           = &context->ldsc,
+        .iov_count      = 1,
+        .addr           = context->addr,
+        .rma_iov        = &context->rma_iov,
+        .rma_iov_count  = 1,
+        .context        = context,
+    };
+
+    if (context->op == CONTEXT_OP_WRITE) {
+        ret = fi_writemsg(conn->fab_conn.ep, &msg, context->flags);
+        if (ret < 0 && ret != -FI_EAGAIN)
+            print_func_fi_err(__FUNCTION__, __LINE__, "fi_writemsg", "", ret);
+    } else {
+        ret = fi_readmsg(conn->fab_conn.ep, &msg, context->flags);
+        if (ret < 0 && ret != -FI_EAGAIN)
+            print_func_fi_err(__FUNCTION__, __LINE__, "fi_readmsg", "", ret);
+    }
+
+    return ret;
+}
+
+static ssize_t context_post_atomic(struct stuff *conn, struct context *context)
+{
+    ssize_t             ret;
+    /* Operands and result share the results buffer; see decode. */
+    struct fi_ioc       atm_op_ioc = {
+        .addr           = context->iov.iov_base,
+        .count          = 1,
+    };
+    struct fi_ioc       atm_cmp_ioc = {
+        .addr           = context->iov.iov_base + sizeof(union zhpeq_atomic),
+        .count          = 1,
+    };
+    struct fi_ioc       atm_res_ioc = {
+        .addr           = context->iov.iov_base,
+        .count          = 1,
+    };
+    struct fi_rma_ioc   atm_rma_ioc = {
+        .addr           = context->rma_iov.addr,
+        .count          = 1,
+        .key            = context->rma_iov.key,
+    };
+    struct fi_msg_atomic atm_msg = {
+        .msg_iov        = &atm_op_ioc,
+        .desc           = &context->ldsc,
+        .iov_count      = 1,
+        .addr           = context->addr,
+        .rma_iov        = &atm_rma_ioc,
+        .rma_iov_count  = 1,
+        .datatype       = context->datatype,
+        .context        = context,
+    };
+
+    if (context->op == CONTEXT_OP_ATM_CSWAP) {
+        atm_msg.op = FI_CSWAP;
+        ret = fi_compare_atomicmsg(
+            conn->fab_conn.ep, &atm_msg, &atm_cmp_ioc, &context->ldsc, 1,
+            &atm_res_ioc, &conn->results_desc, 1, context->flags);
+    } else {
+        atm_msg.op = FI_SUM;
+        ret = fi_fetch_atomicmsg(
+            conn->fab_conn.ep, &atm_msg,
+            &atm_res_ioc, &conn->results_desc, 1, context->flags);
+    }
+    if (ret < 0 && ret != -FI_EAGAIN)
+        print_func_fi_errn(__FUNCTION__, __LINE__,
+                           "fi_atomicmsg", atm_msg.op, true, ret);
+
+    return ret;
+}
+
+static inline ssize_t context_post(struct stuff *conn, struct context *context)
+{
+    if (context->op <= CONTEXT_OP_READ)
+        return context_post_rma(conn, context);
+    else
+        return context_post_atomic(conn, context);
+}
+
+static struct pend_dest *pend_dest_find(struct stuff *conn, fi_addr_t addr)
+{
+    struct pend_dest    *ret;
+
+    /* Bounded by the number of contexts; expected to be very short. */
+    STAILQ_FOREACH(ret, &conn->pend_active, list) {
+        if (ret->addr == addr)
+            break;
+    }
+
+    return ret;
+}
+
+static void context_submit(struct zhpeq *zq, struct context *context)
+{
+    struct stuff        *conn = zq->backend_data;
+    struct pend_dest    *pend;
+    ssize_t             rc;
+
+    /* Operations to a congested destination stay in order behind it. */
+    if (unlikely(!STAILQ_EMPTY(&conn->pend_active))) {
+        pend = pend_dest_find(conn, context->addr);
+        if (pend) {
+            STAILQ_INSERT_TAIL(&pend->pend, context, pend_list);
+            return;
+        }
+    }
+
+    rc = context_post(conn, context);
+    if (likely(rc >= 0)) {
+        conn->tx_queued++;
+        return;
+    }
+    if (rc != -FI_EAGAIN) {
+        cq_write(zq, context, rc);
+        return;
+    }
+
+    /* There is always a free pend_dest: every active one holds a context. */
+    pend = STAILQ_FIRST(&conn->pend_free);
+    STAILQ_REMOVE_HEAD(&conn->pend_free, list);
+    pend->addr = context->addr;
+    STAILQ_INIT(&pend->pend);
+    STAILQ_INSERT_TAIL(&pend->pend, context, pend_list);
+    STAILQ_INSERT_TAIL(&conn->pend_active, pend, list);
+}
+
+static void pend_retry(struct zhpeq *zq)
+{
+    struct stuff        *conn = zq->backend_data;
+    struct pend_dest_head busy = STAILQ_HEAD_INITIALIZER(busy);
+    struct pend_dest    *pend;
+    struct context      *context;
+    ssize_t             rc;
+
+    while ((pend = STAILQ_FIRST(&conn->pend_active))) {
+        STAILQ_REMOVE_HEAD(&conn->pend_active, list);
+        while ((context = STAILQ_FIRST(&pend->pend))) {
+            rc = context_post(conn, context);
+            if (rc == -FI_EAGAIN)
+                break;
+            STAILQ_REMOVE_HEAD(&pend->pend, pend_list);
+            if (rc < 0)
+                cq_write(zq, context, rc);
+            else
+                conn->tx_queued++;
+        }
+        if (context)
+            STAILQ_INSERT_TAIL(&busy, pend, list);
+        else
+            STAILQ_INSERT_HEAD(&conn->pend_free, pend, list);
+    }
+    STAILQ_CONCAT(&conn->pend_active, &busy);
+}
+
+static inline bool engine_busy(struct stuff *conn)
+{
+    return (conn->tx_queued != conn->tx_completed ||
+            !STAILQ_EMPTY(&conn->pend_active));
+}
+
+/* Reap completions, then retry anything that was refused. */
+static ssize_t engine_progress(struct zhpeq *zq)
+{
+    struct stuff        *conn = zq->backend_data;
+    ssize_t             ret;
+
+    ret = fab_completions(conn->fab_conn.tx_cq, 0, cq_update, zq);
+    if (ret < 0)
+        goto done;
+    conn->tx_completed += ret;
+    if (!STAILQ_EMPTY(&conn->pend_active))
+        pend_retry(zq);
+    cq_flush(zq);
+
+ done:
+    return ret;
+}
+
+/* Fail AV operations that were never started or are mid-handshake. */
+static void drain_av_ops(struct stuff *conn)
+{
+    struct av_op        *av_op;
+
+    mutex_lock(&conn->wq_mutex);
+    while ((av_op = conn->av_cur)) {
+        av_list_remove(conn, av_op);
+        av_op->status = -ECANCELED;
+        cond_signal(&av_op->cond);
+    }
+    mutex_unlock(&conn->wq_mutex);
+}
+
+/* Cancel everything still waiting on a destination that said FI_EAGAIN. */
+static void drain_pend(struct zhpeq *zq)
+{
+    struct stuff        *conn = zq->backend_data;
+    struct pend_dest    *pend;
+    struct context      *context;
+
+    while ((pend = STAILQ_FIRST(&conn->pend_active))) {
+        STAILQ_REMOVE_HEAD(&conn->pend_active, list);
+        while ((context = STAILQ_FIRST(&pend->pend))) {
+            STAILQ_REMOVE_HEAD(&pend->pend, pend_list);
+            cq_write(zq, context, -ECANCELED);
+        }
+        STAILQ_INSERT_HEAD(&conn->pend_free, pend, list);
+    }
+}
+
+/* Complete the WQEs the engine never picked up as canceled. */
+static void drain_wq(struct zhpeq *zq, uint16_t wq_head)
+{
+    struct zhpe_hw_reg  *reg = zq->reg;
+    struct stuff        *conn = zq->backend_data;
+    uint16_t            qmask = zq->info.qlen - 1;
+    uint16_t            wq_tail = reg->wq_tail;
+    union zhpe_hw_cq_entry *cqe;
+
+    smp_rmb();
+    for (; wq_head != wq_tail; wq_head = (wq_head + 1) & qmask) {
+        cqe = zq->cq + (conn->cq_pend & qmask);
+        cqe->entry.index = zq->wq[wq_head].hdr.cmp_index;
+        cqe->entry.status = ZHPEQ_CQ_STATUS_CANCELED;
+        conn->cq_pend++;
+    }
+    reg->wq_head = wq_head;
+}
+
+/*
+ * Orderly shutdown: every committed WQE gets a CQ entry before the
+ * engine exits. Posted operations get DRAIN_TIMEOUT_NS to complete
+ * normally; after that they are cancelled with fi_cancel() and any
+ * that the provider still does not return are reported as cancelled.
+ */
+static void engine_drain(struct zhpeq *zq, uint16_t wq_head)
+{
+    struct stuff        *conn = zq->backend_data;
+    struct fab_conn     *fab_conn = &conn->fab_conn;
+    struct context      *context;
+    struct timespec     ts_beg;
+    struct timespec     ts_end;
+    ssize_t             rc;
+    uint32_t            i;
+    bool                canceled = false;
+
+    drain_av_ops(conn);
+    drain_pend(zq);
+    drain_wq(zq, wq_head);
+    cq_flush(zq);
+
+    if (gettime_raw(&ts_beg) < 0)
+        goto cancel;
+    while (conn->tx_queued != conn->tx_completed) {
+        rc = engine_progress(zq);
+        if (rc < 0)
+            goto cancel;
+        if (rc > 0)
+            continue;
+        if (gettime_raw(&ts_end) < 0 ||
+            ts_delta(&ts_beg, &ts_end) >= DRAIN_TIMEOUT_NS) {
+            if (canceled)
+                goto cancel;
+            /* Give the provider one more period to return them. */
+            for (i = 0; i < conn->n_context; i++) {
+                if (conn->context[i].active)
+                    (void)fi_cancel(&fab_conn->ep->fid, &conn->context[i]);
+            }
+            canceled = true;
+            ts_beg = ts_end;
+        }
+        sched_yield();
+    }
+
+ cancel:
+    for (i = 0; i < conn->n_context; i++) {
+        context = &conn->context[i];
+        if (context->active)
+            cq_write(zq, context, -ECANCELED);
+    }
+    cq_flush(zq);
+}
+
 static void *lfab_wq_start(void *voidzq)
 {
     struct zhpeq        *zq = voidzq;
@@ -527,21 +1535,10 @@ static void *lfab_wq_start(void *voidzq)
     struct stuff        *conn = zq->backend_data;
     struct fab_conn     *fab_conn = &conn->fab_conn;
     struct zdom_data    *bdom = zq->zdom->backend_data;
-    struct fid_mr       **lcl_mr = bdom->lcl_mr;
+    struct lcl_mr       *lcl;
+    struct rkey         *rkey;
     uint16_t            qmask = zq->info.qlen - 1;
-    uint64_t            tx_queued = 0;
-    uint64_t            tx_completed = 0;
     struct timespec     ts_beg = { 0, 0 };
-    struct iovec        msg_iov;
-    struct fi_rma_iov   rma_iov;
-    void                *ldsc;
-    struct fi_msg_rma   msg = {
-        .msg_iov = &msg_iov,
-        .desc = &ldsc,
-        .iov_count = 1,
-        .rma_iov = &rma_iov,
-        .rma_iov_count = 1,
-    };
     struct timespec     ts_end;
     uint64_t            queued;
     uint16_t            wq_head;
@@ -551,21 +1548,10 @@ static void *lfab_wq_start(void *voidzq)
     uint64_t            laddr;
     uint64_t            raddr;
     struct fid_mr       *mr;
-    uint64_t            flags;
-    struct fi_ioc       atm_op_ioc = { .count = 1 };
-    struct fi_ioc       atm_cmp_ioc = { .count = 1 };
-    struct fi_ioc       atm_res_ioc = { .count = 1 };
-    struct fi_rma_ioc   atm_rma_ioc = { .count = 1 };
-    struct fi_msg_atomic atm_msg = {
-        .msg_iov = &atm_op_ioc,
-        .desc = &ldsc,
-        .iov_count = 1,
-        .rma_iov = &atm_rma_ioc,
-        .rma_iov_count = 1,
-    };
     struct context      *context;
     char                *sendbuf;
     struct av_op        *av_op;
+    size_t              i;
     ZHPEQ_TIMING_CODE(struct zhpeq_timing_stamp lfabt_new);
 
     for (wq_head = reg->wq_head;;) {
@@ -579,27 +1565,52 @@ static void *lfab_wq_start(void *voidzq)
             switch (av_op->status) {
 
             case AV_OP_REMOVE_INIT:
-                rc = fab_av_remove(fab_conn, av_op->fi_addr);
+                rc = fab_av_remove_many(conn->av_conn, av_op->fi_addrs,
+                                        av_op->count);
                 av_op->status = 1;
                 break;
 
             case AV_OP_INSERT_INIT:
-                rc = fab_av_insert(fab_conn, &av_op->ep_addr, &av_op->fi_addr);
+                rc = fab_av_insert_many(conn->av_conn, av_op->ep_addrs,
+                                        av_op->count, av_op->fi_addrs);
                 if (rc < 0)
                     break;
                 av_op->status--;
                 /* FALLTHROUGH */
             case AV_OP_INSERT_INIT - 1:
-                rc = fab_av_wait_send(fab_conn, av_op->fi_addr,
-                                      retry_none, NULL);
+                /* Send to every peer before waiting on any of them. */
+                for (rc = 0; av_op->next_send < av_op->count;
+                     av_op->next_send++) {
+                    rc = fab_av_wait_send(fab_conn,
+                                          av_op->fi_addrs[av_op->next_send],
+                                          retry_none, NULL);
+                    if (rc == 1 || rc < 0)
+                        break;
+                }
                 if (rc == 1 || rc < 0)
                     break;
                 av_op->status--;
                 /* FALLTHROUGH */
             case AV_OP_INSERT_INIT - 2:
-                rc = fab_av_wait_recv(fab_conn, av_op->fi_addr,
-                                      retry_none, NULL);
-                if (rc == 1 || rc < 0)
+                /* The rx context of a scalable endpoint is shared. */
+                if (conn->sep_tx >= 0)
+                    mutex_lock(&bdom->sep_mutex);
+                /* Take the replies in whatever order they arrive. */
+                for (i = 0, rc = 0; i < av_op->count; i++) {
+                    if (av_op->recv_done[i])
+                        continue;
+                    rc = fab_av_wait_recv(conn->av_conn, av_op->fi_addrs[i],
+                                          retry_none, NULL);
+                    if (rc < 0)
+                        break;
+                    if (rc == 0) {
+                        av_op->recv_done[i] = true;
+                        av_op->n_recv++;
+                    }
+                }
+                if (conn->sep_tx >= 0)
+                    mutex_unlock(&bdom->sep_mutex);
+                if (rc < 0 || av_op->n_recv < av_op->count)
                     break;
                 av_op->status--;
                 assert(av_op->status == 1);
@@ -626,13 +1637,14 @@ static void *lfab_wq_start(void *voidzq)
             mutex_unlock(&conn->wq_mutex);
         }
 
-        for (queued = tx_queued, wq_tail = reg->wq_tail;
+        for (queued = conn->tx_queued, wq_tail = reg->wq_tail;
              (context = conn->context_free) && wq_head != wq_tail;
              wq_head = (wq_head + 1) & qmask) {
 
             ZHPEQ_TIMING_UPDATE_STAMP(&lfabt_new);
 
             conn->context_free = context ->opaque.internal[0];
+            context->active = true;
             wqe = zq->wq + wq_head;
             context->result = NULL;
             context->cmp_index = wqe->hdr.cmp_index;
@@ -641,153 +1653,89 @@ static void *lfab_wq_start(void *voidzq)
              * on an operation means it is not dispatched until all previous
              * operations are complete; however, we can't just rely on
              * the libfabric fence, since that is per endpoint and ours
-             * are not. So, we must wait for all operations to complete.
+             * are not. So, we must wait for all operations to complete,
+             * including any still pending on FI_EAGAIN.
              *
              * Completion does not guarantee delivery, but if the fence
              * works as advertised on a per-endpoint basis, we don't
              * care.
              */
-            flags = 0;
+            context->flags = 0;
             if (wqe->hdr.opcode & ZHPE_HW_OPCODE_FENCE) {
-                flags = FI_FENCE;
+                context->flags = FI_FENCE;
                 /* Wait for all outstanding operations to complete. */
                 for (;;) {
-                    rc = fab_completions(fab_conn->tx_cq, 0, cq_update, zq);
-                    if (rc < 0)
+                    rc = engine_progress(zq);
+                    if (rc < 0) {
+                        /* Leave the WQE for engine_drain(). */
+                        context_put(conn, context);
                         goto done;
-                    tx_completed += rc;
-                    if (tx_queued == tx_completed)
+                    }
+                    if (!engine_busy(conn))
                         break;
                     sched_yield();
                 }
             }
 
-            rc = 0;
-
             switch (wqe->hdr.opcode & ~ZHPE_HW_OPCODE_FENCE) {
 
             case ZHPE_HW_OPCODE_NOP:
                 lfabt_cmdpost(nop, wqe, context);
                 cq_write(zq, context, 0);
-                break;
+                continue;
 
             case ZHPE_HW_OPCODE_PUT:
-                msg.context = context;
-                laddr = wqe->dma.lcl_addr;
-                mr = lcl_mr[TO_KEYIDX(laddr)];
-                /* Check if key unregistered. (Race handling.) */
-                if ((uintptr_t)mr & 1) {
-                    cq_write(zq, msg.context, -EINVAL);
-                    break;
-                }
-                ldsc = fi_mr_desc(mr);
-                msg_iov.iov_base = TO_PTR(TO_ADDR(laddr));
-                msg_iov.iov_len = wqe->dma.len;
-                rma_iov.len = wqe->dma.len;
-                raddr = wqe->dma.rem_addr;
-                rma_iov.addr = TO_ADDR(raddr);
-                rma_iov.key = conn->rkey[TO_KEYIDX(raddr)].rkey;
-                msg.addr = conn->rkey[TO_KEYIDX(raddr)].av_idx;
-                lfabt_cmdpost(dma, wqe, context);
-                rc = fi_writemsg(fab_conn->ep, &msg, flags);
-                if (rc < 0) {
-                    if (rc == -FI_EAGAIN)
-                        break;
-                    print_func_fi_err(__FUNCTION__, __LINE__,
-                                      "fi_writemsg", "", rc);
-                    cq_write(zq, context, rc);
-                    break;
-                }
-                tx_queued++;
-                break;
-
             case ZHPE_HW_OPCODE_GET:
-                msg.context = context;
                 laddr = wqe->dma.lcl_addr;
-                mr = lcl_mr[TO_KEYIDX(laddr)];
+                lcl = lcl_mr_entry(bdom, TO_KEYIDX(laddr));
                 /* Check if key unregistered. (Race handling.) */
-                if ((uintptr_t)mr & 1) {
+                if (unlikely(!lcl) || !(mr = lcl->mr) ||
+                    ((uintptr_t)mr & 1)) {
                     cq_write(zq, context, -EINVAL);
-                    break;
+                    continue;
                 }
-                ldsc = fi_mr_desc(mr);
-                msg_iov.iov_base = TO_PTR(TO_ADDR(laddr));
-                msg_iov.iov_len = wqe->dma.len;
-                rma_iov.len = wqe->dma.len;
+                context->op = ((wqe->hdr.opcode & ~ZHPE_HW_OPCODE_FENCE) ==
+                               ZHPE_HW_OPCODE_PUT ?
+                               CONTEXT_OP_WRITE : CONTEXT_OP_READ);
+                context->ldsc = fi_mr_desc(mr);
+                context->iov.iov_base = TO_PTR(lcl->vaddr + TO_ADDR(laddr));
+                context->iov.iov_len = wqe->dma.len;
+                context->rma_iov.len = wqe->dma.len;
                 raddr = wqe->dma.rem_addr;
-                rma_iov.addr = TO_ADDR(raddr);
-                rma_iov.key = conn->rkey[TO_KEYIDX(raddr)].rkey;
-                msg.addr = conn->rkey[TO_KEYIDX(raddr)].av_idx;
                 lfabt_cmdpost(dma, wqe, context);
-                rc = fi_readmsg(fab_conn->ep, &msg, flags);
-                if (rc < 0) {
-                    if (rc == -FI_EAGAIN)
-                        break;
-                    print_func_fi_err(__FUNCTION__, __LINE__,
-                                      "fi_readmsg", "", rc);
-                    cq_write(zq, context, rc);
-                    break;
-                }
-                tx_queued++;
                 break;
 
             case ZHPE_HW_OPCODE_PUTIMM:
-                msg.context = context;
+                context->op = CONTEXT_OP_WRITE;
                 /* No NULL descriptors! Use results buffer for sent data. */
                 sendbuf = conn->results[context->cmp_index].data;
                 memcpy(sendbuf, wqe->imm.data, wqe->imm.len);
-                laddr = (uintptr_t)sendbuf;
-                ldsc = conn->results_desc;
-                msg_iov.iov_base = TO_PTR(TO_ADDR(laddr));
-                msg_iov.iov_len = wqe->imm.len;
-                rma_iov.len = wqe->imm.len;
+                context->ldsc = conn->results_desc;
+                context->iov.iov_base = sendbuf;
+                context->iov.iov_len = wqe->imm.len;
+                context->rma_iov.len = wqe->imm.len;
                 raddr = wqe->imm.rem_addr;
-                rma_iov.addr = TO_ADDR(raddr);
-                rma_iov.key = conn->rkey[TO_KEYIDX(raddr)].rkey;
-                msg.addr = conn->rkey[TO_KEYIDX(raddr)].av_idx;
                 lfabt_cmdpost(imm, wqe, context);
-                rc = fi_writemsg(fab_conn->ep, &msg, flags);
-                if (rc < 0) {
-                    if (rc == -FI_EAGAIN)
-                        break;
-                    print_func_fi_err(__FUNCTION__, __LINE__,
-                                      "fi_writemsg", "", rc);
-                    cq_write(zq, context, rc);
-                    break;
-                }
-                tx_queued++;
                 break;
 
             case ZHPE_HW_OPCODE_GETIMM:
-                msg.context = context;
+                context->op = CONTEXT_OP_READ;
                 /* Return data in local results buffer. */
                 context->result = &conn->results[context->cmp_index];
                 context->result_len = wqe->imm.len;
-                laddr = (uintptr_t)context->result->data;
-                ldsc = conn->results_desc;
-                msg_iov.iov_base = TO_PTR(TO_ADDR(laddr));
-                msg_iov.iov_len = wqe->imm.len;
-                rma_iov.len = wqe->imm.len;
+                context->ldsc = conn->results_desc;
+                context->iov.iov_base = context->result->data;
+                context->iov.iov_len = wqe->imm.len;
+                context->rma_iov.len = wqe->imm.len;
                 raddr = wqe->imm.rem_addr;
-                rma_iov.addr = TO_ADDR(raddr);
-                rma_iov.key = conn->rkey[TO_KEYIDX(raddr)].rkey;
-                msg.addr = conn->rkey[TO_KEYIDX(raddr)].av_idx;
                 lfabt_cmdpost(imm, wqe, context);
-                rc = fi_readmsg(fab_conn->ep, &msg, flags);
-                if (rc < 0) {
-                    if (rc == -FI_EAGAIN)
-                        break;
-                    print_func_fi_err(__FUNCTION__, __LINE__,
-                                      "fi_readmsg", "", rc);
-                    cq_write(zq, context, rc);
-                    break;
-                }
-                tx_queued++;
                 break;
 
             case ZHPE_HW_OPCODE_ATM_ADD:
             case ZHPE_HW_OPCODE_ATM_CAS:
-                atm_msg.context = context;
+                context->op = ((wqe->hdr.opcode & ~ZHPE_HW_OPCODE_FENCE) ==
+                               ZHPE_HW_OPCODE_ATM_ADD ?
+                               CONTEXT_OP_ATM_SUM : CONTEXT_OP_ATM_CSWAP);
                 /* Return data in local results buffer.
                  * No NULL descriptors! Use results buffer for sent data, too.
                  */
@@ -795,62 +1743,43 @@ static void *lfab_wq_start(void *voidzq)
                 sendbuf = context->result->data;
                 if ((wqe->atm.size & ZHPE_HW_ATOMIC_SIZE_MASK) ==
                     ZHPE_HW_ATOMIC_SIZE_64) {
-                    atm_msg.datatype = FI_UINT64;
+                    context->datatype = FI_UINT64;
                     context->result_len = sizeof(uint64_t);
                 } else {
-                    atm_msg.datatype = FI_UINT32;
+                    context->datatype = FI_UINT32;
                     context->result_len = sizeof(uint32_t);
                 }
                 memcpy(sendbuf, wqe->atm.operands, sizeof(wqe->atm.operands));
-                laddr = (uintptr_t)sendbuf;
-                ldsc = conn->results_desc;
-                atm_op_ioc.addr = TO_PTR(TO_ADDR(laddr));
-                atm_res_ioc.addr = atm_op_ioc.addr;
-                atm_cmp_ioc.addr =
-                    atm_op_ioc.addr + sizeof(wqe->atm.operands[0]);
+                context->ldsc = conn->results_desc;
+                context->iov.iov_base = sendbuf;
                 raddr = wqe->atm.rem_addr;
-                atm_rma_ioc.addr = TO_ADDR(raddr);
-                atm_rma_ioc.key = conn->rkey[TO_KEYIDX(raddr)].rkey;
-                atm_msg.addr = conn->rkey[TO_KEYIDX(raddr)].av_idx;
                 lfabt_cmdpost(atm, wqe, context);
-                if ((wqe->hdr.opcode & ~ZHPE_HW_OPCODE_FENCE) !=
-                    ZHPE_HW_OPCODE_ATM_ADD) {
-                    atm_msg.op = FI_CSWAP;
-                    rc = fi_compare_atomicmsg(
-                        fab_conn->ep, &atm_msg, &atm_cmp_ioc, &ldsc, 1,
-                        &atm_res_ioc, &conn->results_desc, 1, flags);
-                } else {
-                    atm_msg.op = FI_SUM;
-                    rc = fi_fetch_atomicmsg(
-                        fab_conn->ep, &atm_msg,
-                        &atm_res_ioc, &conn->results_desc, 1, flags);
-                }
-                if (rc < 0) {
-                    if (rc == -FI_EAGAIN)
-                        break;
-                    print_func_fi_errn(__FUNCTION__, __LINE__,
-                                       "fi_atomicmsg", atm_msg.op, true, rc);
-                    cq_write(zq, context, rc);
-                    break;
-                }
-                tx_queued++;
                 break;
 
             default:
                 print_err("%s,%u:Unexpected opcode 0x%02x\n",
                           __FUNCTION__, __LINE__, wqe->hdr.opcode);
+                cq_write(zq, context, -EINVAL);
+                wq_head = (wq_head + 1) & qmask;
                 goto done;
             }
-            /* Get completions before retrying. */
-            if (rc == -FI_EAGAIN)
-                break;
+
+            rkey = rkey_entry(conn, TO_KEYIDX(raddr));
+            if (unlikely(!rkey) || !rkey->used) {
+                cq_write(zq, context, -EINVAL);
+                continue;
+            }
+            context->rma_iov.addr = rkey->vaddr + TO_ADDR(raddr);
+            context->rma_iov.key = rkey->rkey;
+            context->addr = rkey->av_idx;
+            context_submit(zq, context);
         }
-        /* Don't sleep while there are I/Os outstanding. */
-        if (tx_queued != tx_completed) {
-            rc = fab_completions(fab_conn->tx_cq, 0, cq_update, zq);
+        cq_flush(zq);
+        /* Don't sleep while there are I/Os outstanding or pending. */
+        if (engine_busy(conn)) {
+            rc = engine_progress(zq);
             if (rc < 0)
                 goto done;
-            tx_completed += rc;
             continue;
         }
         /* Time to sleep? */
@@ -858,7 +1787,7 @@ static void *lfab_wq_start(void *voidzq)
         if (rc < 0)
             goto done;
         /* Reset the sleep clock if operations were started. */
-        if (tx_queued != queued)
+        if (conn->tx_queued != queued)
             ts_beg = ts_end;
         if (ts_delta(&ts_beg, &ts_end) < SLEEP_THRESHOLD_NS)
             continue;
@@ -881,22 +1810,7 @@ static void *lfab_wq_start(void *voidzq)
     }
 
 done:
-    /* FIXME: Problematic: orderly shutdown handshake needed in libfabric.
-     * Key revocation needs to be skipped. Must deal with outstanding
-     * av processing.
-     */
-#if 0
-    /* Wait for all outstanding operations to complete. */
-    for (;;) {
-        rc = fab_completions(fab_conn->tx_cq, 0, cq_update, zq);
-        if (rc < 0)
-            goto done;
-        tx_completed += rc;
-        if (tx_queued == tx_completed)
-            break;
-        sched_yield();
-    }
-#endif
+    engine_drain(zq, wq_head);
 
     return NULL;
 }
@@ -905,15 +1819,33 @@ static int engine_start(struct zhpeq *zq)
 {
     int                 ret;
     struct stuff        *conn = zq->backend_data;
+    struct zdom_data    *bdom = zq->zdom->backend_data;
+    pthread_attr_t      attr;
 
-    ret = -pthread_create(&conn->wq_thread, NULL, lfab_wq_start, zq);
+    ret = -pthread_attr_init(&attr);
     if (ret < 0) {
-        print_func_err(__FUNCTION__, __LINE__, "pthread_mutex_init",
-                       "wq", ret);
+        print_func_err(__FUNCTION__, __LINE__, "pthread_attr_init", "", ret);
         goto done;
     }
+    if (bdom->engine_pin) {
+        ret = -pthread_attr_setaffinity_np(&attr, sizeof(bdom->engine_cpus),
+                                           &bdom->engine_cpus);
+        if (ret < 0) {
+            print_func_err(__FUNCTION__, __LINE__,
+                           "pthread_attr_setaffinity_np", "", ret);
+            goto destroy;
+        }
+    }
+    ret = -pthread_create(&conn->wq_thread, &attr, lfab_wq_start, zq);
+    if (ret < 0) {
+        print_func_err(__FUNCTION__, __LINE__, "pthread_create",
+                       "wq", ret);
+        goto destroy;
+    }
     conn->engine_init = ENGINE_WQ_THREAD_INIT;
 
+ destroy:
+    pthread_attr_destroy(&attr);
  done:
     return ret;
 }
@@ -953,7 +1885,7 @@ static void free_lcl_mr(struct zdom_data *bdom, uint32_t index)
     union free_index    new;
 
     for (old.blob = bdom->lcl_mr_free.blob;;) {
-        bdom->lcl_mr[index] = TO_PTR(old.index);
+        lcl_mr_entry(bdom, index)->mr = TO_PTR(old.index);
         new.index = (index << 1) | 1;
         new.seq = old.seq + 1;
         new.blob = __sync_val_compare_and_swap(&bdom->lcl_mr_free.blob,
@@ -977,7 +1909,13 @@ static int lfab_mr_reg(struct zhpeq_dom *zdom,
     union free_index    old;
     union free_index    new;
     uint32_t            index;
+    struct lcl_mr       *lcl;
 
+    /* The offset must fit below the key index. */
+    ret = -EINVAL;
+    if (len > KEY_MASK_ADDR + 1)
+        goto done;
+    ret = -ENOMEM;
     desc = do_malloc(sizeof(*desc));
     if (!desc)
         goto done;
@@ -994,12 +1932,17 @@ static int lfab_mr_reg(struct zhpeq_dom *zdom,
         mr = NULL;
         goto done;
     }
-    ret = -ENOSPC;
     for (old.blob = bdom->lcl_mr_free.blob;;) {
-        if (old.index == FREE_END)
-            goto done;
+        if (old.index == FREE_END) {
+            ret = keytab_new((void **)bdom->lcl_mr, &bdom->lcl_mr_hwm,
+                             sizeof(**bdom->lcl_mr));
+            if (ret < 0)
+                goto done;
+            index = ret;
+            break;
+        }
         index = old.index >> 1;
-        new.index = (uintptr_t)bdom->lcl_mr[index];
+        new.index = (uintptr_t)lcl_mr_entry(bdom, index)->mr;
         new.seq = old.seq + 1;
         new.blob = __sync_val_compare_and_swap(&bdom->lcl_mr_free.blob,
                                                old.blob, new.blob);
@@ -1007,13 +1950,14 @@ static int lfab_mr_reg(struct zhpeq_dom *zdom,
             break;
         old.blob = new.blob;
     }
-    bdom->lcl_mr[index] = mr;
+    lcl = lcl_mr_entry(bdom, index);
+    lcl->vaddr = (uintptr_t)buf;
+    lcl->mr = mr;
     desc->hdr.magic = ZHPE_MAGIC;
     desc->hdr.version = ZHPE_MR_V1;
     desc->kdata.vaddr = (uintptr_t)buf;
     desc->kdata.len = len;
-    desc->kdata.zaddr = (((uint64_t)index << KEY_SHIFT) +
-                         TO_ADDR(desc->kdata.vaddr));
+    desc->kdata.zaddr = ((uint64_t)index << KEY_SHIFT);
     desc->kdata.access = access;
     desc->kdata.key = fi_mr_key(mr);
     *kdata_out = &desc->kdata;
@@ -1041,7 +1985,7 @@ static int lfab_mr_free(struct zhpeq_dom *zdom, struct zhpeq_key_data *kdata)
     if (desc->hdr.magic != ZHPE_MAGIC || desc->hdr.version != ZHPE_MR_V1)
         goto done;
 
-    ret = fi_close(&bdom->lcl_mr[index]->fid);
+    ret = fi_close(&lcl_mr_entry(bdom, index)->mr->fid);
     free_lcl_mr(bdom, index);
     do_free(desc);
     ret = 0;
@@ -1055,8 +1999,9 @@ static void free_conn_rkey(struct stuff *conn, uint32_t index)
     union free_index    old;
     union free_index    new;
 
+    rkey_entry(conn, index)->used = false;
     for (old.blob = conn->rkey_free.blob;;) {
-        conn->rkey[index].rkey = old.index;
+        rkey_entry(conn, index)->rkey = old.index;
         new.index = index;
         new.seq = old.seq + 1;
         new.blob = __sync_val_compare_and_swap(&conn->rkey_free.blob, old.blob,
@@ -1077,6 +2022,7 @@ static int lfab_zmmu_import(struct zhpeq *zq, int open_idx,
     struct zhpe_mr_desc_v1 *desc = NULL;
     union free_index    old;
     union free_index    new;
+    struct rkey         *rkey;
 
     if (blob_len != sizeof(*pdata))
         goto done;
@@ -1089,11 +2035,16 @@ static int lfab_zmmu_import(struct zhpeq *zq, int open_idx,
     desc->hdr.version = ZHPE_MR_V1 | ZHPE_MR_REMOTE;
     unpack_kdata(pdata, &desc->kdata);
 
-    ret = -ENOSPC;
     for (old.blob = conn->rkey_free.blob;;) {
-        if (old.index == FREE_END)
-            goto done;
-        new.index = conn->rkey[old.index].rkey;
+        if (old.index == FREE_END) {
+            ret = keytab_new((void **)conn->rkey, &conn->rkey_hwm,
+                             sizeof(**conn->rkey));
+            if (ret < 0)
+                goto done;
+            old.index = ret;
+            break;
+        }
+        new.index = rkey_entry(conn, old.index)->rkey;
         new.seq = old.seq + 1;
         new.blob = __sync_val_compare_and_swap(&conn->rkey_free.blob, old.blob,
                                                new.blob);
@@ -1101,10 +2052,12 @@ static int lfab_zmmu_import(struct zhpeq *zq, int open_idx,
             break;
         old.blob = new.blob;
     }
-    conn->rkey[old.index].rkey = desc->kdata.zaddr;
-    conn->rkey[old.index].av_idx = open_idx;
-    desc->kdata.zaddr = (((uint64_t)old.index << KEY_SHIFT) +
-                         TO_ADDR(desc->kdata.vaddr));
+    rkey = rkey_entry(conn, old.index);
+    rkey->rkey = desc->kdata.zaddr;
+    rkey->av_idx = open_idx;
+    rkey->vaddr = desc->kdata.vaddr;
+    rkey->used = true;
+    desc->kdata.zaddr = ((uint64_t)old.index << KEY_SHIFT);
     *kdata_out = &desc->kdata;
 
     ret = 0;
@@ -1156,7 +2109,7 @@ static int lfab_zmmu_export(struct zhpeq *zq,
         goto done;
 
     pack_kdata(&desc->kdata, blob,
-               fi_mr_key(bdom->lcl_mr[TO_KEYIDX(kdata->zaddr)]));
+               fi_mr_key(lcl_mr_entry(bdom, TO_KEYIDX(kdata->zaddr))->mr));
     *blob_out = blob;
 
     ret = 0;
@@ -1184,6 +2137,7 @@ struct backend_ops libfabric_ops = {
     .qalloc             = lfab_qalloc,
     .qfree              = lfab_qfree,
     .open               = lfab_open,
+    .open_many          = lfab_open_many,
     .close              = lfab_close,
     .wq_signal          = lfab_wq_signal,
     .cq_poll            = lfab_cq_poll,
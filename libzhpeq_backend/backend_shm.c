@@ -0,0 +1,1149 @@
+/*
+ * Copyright (C) 2017-2018 Hewlett Packard Enterprise Development LP.
+ * All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Same-host backend: puts and gets are done by the engine thread with
+ * cross-memory attach (process_vm_writev/readv), so peers must be allowed
+ * to ptrace each other (same uid, subject to the Yama ptrace_scope).
+ * Atomics cannot be done that way; they are forwarded through a shared
+ * mailbox to the target queue's engine, which does them on its own memory.
+ * The mailbox is also the futex the engine sleeps on.
+ */
+
+#include <internal.h>
+
+#include <endian.h>
+#include <limits.h>
+
+#include <linux/futex.h>
+
+#include <signal.h>
+
+#include <sys/queue.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#define SLEEP_THRESHOLD_NS (20000)
+
+/* Bounds on waiting for a mailbox; pids are checked every CHECK_NS. */
+#define MBOX_TIMEOUT_NS (5000000000UL)
+#define MBOX_CHECK_NS   (1000000UL)
+
+#define SHM_PEER_MAX    (4096)
+#define SHM_RKEY_MAX    (65536)
+
+#define SHM_BOOT_ID     "/proc/sys/kernel/random/boot_id"
+#define SHM_NAME_FMT    "/zhpeq_shm.%d.%u"
+
+/* Local zaddrs are the vaddr; remote zaddrs are an rkey index and offset. */
+#define KEY_SHIFT       43
+#define KEY_MASK_ADDR   (((uint64_t)1 << KEY_SHIFT) - 1)
+
+#define TO_KEYIDX(_addr) ((_addr) >> KEY_SHIFT)
+#define TO_ADDR(_addr)  ((_addr) & KEY_MASK_ADDR)
+
+struct shm_addr {
+    char                boot_id[40];
+    char                mbox_name[32];
+    uint32_t            pid;
+} __attribute__((packed));
+
+struct key_data_packed {
+    uint64_t            vaddr;
+    uint64_t            len;
+    uint8_t             access;
+} __attribute__((packed));
+
+/*
+ * One request at a time; lock is the pid of the requesting engine's
+ * process, so a lock left by a process that died can be taken over.
+ */
+struct shm_mbox {
+    uint32_t            wake;
+    uint32_t            sleeping;
+    uint32_t            lock;
+    uint32_t            req_seq;
+    uint32_t            rsp_seq;
+    int32_t             status;
+    uint16_t            opcode;
+    uint8_t             size;
+    uint64_t            addr;
+    union zhpeq_atomic  operands[2];
+    union zhpeq_atomic  result;
+};
+
+struct shm_mr {
+    STAILQ_ENTRY(shm_mr) list;
+    struct zhpe_mr_desc_v1 desc;
+};
+
+STAILQ_HEAD(shm_mr_head, shm_mr);
+
+struct shm_dom {
+    pthread_mutex_t     mr_mutex;
+    struct shm_mr_head  mr_list;
+};
+
+struct shm_peer {
+    struct shm_mbox     *mbox;
+    pid_t               pid;
+};
+
+struct shm_rkey {
+    uint64_t            vaddr;
+    uint64_t            len;
+    uint32_t            peer;
+    uint8_t             access;
+};
+
+/*
+ * Closes and rkey frees unmap or recycle state that wqe_do() uses without
+ * the lock, so they are handed to the engine thread and run between WQEs;
+ * once the engine has exited, they are done directly.
+ */
+enum shm_ctl_type {
+    SHM_CTL_CLOSE,
+    SHM_CTL_RKEY_FREE,
+};
+
+struct shm_ctl {
+    STAILQ_ENTRY(shm_ctl) list;
+    enum shm_ctl_type   type;
+    uint32_t            index;
+    int                 status;
+    bool                done;
+};
+
+STAILQ_HEAD(shm_ctl_head, shm_ctl);
+
+/* hwm plus a stack of freed indices; protected by the queue's mutex. */
+struct shm_index {
+    uint32_t            *free;
+    uint32_t            n_free;
+    uint32_t            hwm;
+    uint32_t            max;
+};
+
+struct shm_conn {
+    struct shm_mbox     *mbox;
+    char                mbox_name[32];
+    struct shm_peer     *peers;
+    struct shm_rkey     *rkeys;
+    struct shm_index    peer_idx;
+    struct shm_index    rkey_idx;
+    pthread_mutex_t     mutex;
+    pthread_cond_t      ctl_cond;
+    struct shm_ctl_head ctl_list;
+    pthread_t           wq_thread;
+    uint32_t            cq_tail;
+    uint32_t            cq_pend;
+    pid_t               pid;
+    volatile bool       halt;
+    bool                thread_started;
+    bool                thread_exited;
+};
+
+static char             boot_id[40];
+static uint32_t         mbox_count;
+
+static inline int futex_wait(uint32_t *uaddr, uint32_t val)
+{
+    return syscall(SYS_futex, uaddr, FUTEX_WAIT, val, NULL, NULL, 0);
+}
+
+static inline int futex_wake(uint32_t *uaddr)
+{
+    return syscall(SYS_futex, uaddr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static void mbox_wake(struct shm_mbox *mbox)
+{
+    __sync_fetch_and_add(&mbox->wake, 1);
+    smp_mb();
+    if (atomic_load_lazy_uint32(&mbox->sleeping))
+        (void)futex_wake(&mbox->wake);
+}
+
+static int shm_index_init(struct shm_index *idx, uint32_t max)
+{
+    idx->free = do_malloc(max * sizeof(*idx->free));
+    if (!idx->free)
+        return -ENOMEM;
+    idx->n_free = 0;
+    idx->hwm = 0;
+    idx->max = max;
+
+    return 0;
+}
+
+static int shm_index_alloc(struct shm_index *idx)
+{
+    if (idx->n_free)
+        return idx->free[--idx->n_free];
+    if (idx->hwm < idx->max)
+        return idx->hwm++;
+
+    return -ENOSPC;
+}
+
+static void shm_index_free(struct shm_index *idx, uint32_t index)
+{
+    idx->free[idx->n_free++] = index;
+}
+
+/* Must hold conn->mutex. */
+static void ctl_run(struct shm_conn *conn)
+{
+    struct shm_ctl      *ctl;
+    struct shm_peer     *peer;
+    struct shm_rkey     *rkey;
+
+    while ((ctl = STAILQ_FIRST(&conn->ctl_list))) {
+        STAILQ_REMOVE_HEAD(&conn->ctl_list, list);
+        ctl->status = -EINVAL;
+
+        switch (ctl->type) {
+
+        case SHM_CTL_CLOSE:
+            if (ctl->index >= conn->peer_idx.hwm)
+                break;
+            peer = &conn->peers[ctl->index];
+            if (!peer->mbox)
+                break;
+            munmap(peer->mbox, sizeof(*peer->mbox));
+            peer->mbox = NULL;
+            shm_index_free(&conn->peer_idx, ctl->index);
+            ctl->status = 0;
+            break;
+
+        case SHM_CTL_RKEY_FREE:
+            if (ctl->index >= conn->rkey_idx.hwm)
+                break;
+            rkey = &conn->rkeys[ctl->index];
+            rkey->len = 0;
+            rkey->access = 0;
+            shm_index_free(&conn->rkey_idx, ctl->index);
+            ctl->status = 0;
+            break;
+
+        }
+        ctl->done = true;
+    }
+    cond_broadcast(&conn->ctl_cond);
+}
+
+static int ctl_op(struct shm_conn *conn, enum shm_ctl_type type,
+                  uint32_t index)
+{
+    struct shm_ctl      ctl = {
+        .type           = type,
+        .index          = index,
+    };
+
+    mutex_lock(&conn->mutex);
+    STAILQ_INSERT_TAIL(&conn->ctl_list, &ctl, list);
+    if (conn->thread_exited)
+        ctl_run(conn);
+    else
+        mbox_wake(conn->mbox);
+    while (!ctl.done)
+        cond_wait(&conn->ctl_cond, &conn->mutex);
+    mutex_unlock(&conn->mutex);
+
+    return ctl.status;
+}
+
+static int shm_lib_init(void)
+{
+    int                 ret;
+    int                 fd;
+    ssize_t             len;
+
+    fd = open(SHM_BOOT_ID, O_RDONLY);
+    if (fd == -1) {
+        ret = -errno;
+        print_func_err(__FUNCTION__, __LINE__, "open", SHM_BOOT_ID, ret);
+        goto done;
+    }
+    len = read(fd, boot_id, sizeof(boot_id) - 1);
+    ret = (len < 0 ? -errno : 0);
+    close(fd);
+    if (ret < 0) {
+        print_func_err(__FUNCTION__, __LINE__, "read", SHM_BOOT_ID, ret);
+        goto done;
+    }
+    boot_id[len] = '\0';
+
+ done:
+    return ret;
+}
+
+static int shm_domain(const union zhpeq_backend_params *params,
+                      struct zhpeq_dom *zdom)
+{
+    int                 ret = -ENOMEM;
+    struct shm_dom      *bdom;
+
+    bdom = zdom->backend_data = do_calloc(1, sizeof(*bdom));
+    if (!bdom)
+        goto done;
+    mutex_init(&bdom->mr_mutex, NULL);
+    STAILQ_INIT(&bdom->mr_list);
+    ret = 0;
+
+ done:
+    return ret;
+}
+
+static int shm_domain_free(struct zhpeq_dom *zdom)
+{
+    struct shm_dom      *bdom = zdom->backend_data;
+    struct shm_mr       *smr;
+
+    if (!bdom)
+        return 0;
+
+    while ((smr = STAILQ_FIRST(&bdom->mr_list))) {
+        STAILQ_REMOVE_HEAD(&bdom->mr_list, list);
+        do_free(smr);
+    }
+    mutex_destroy(&bdom->mr_mutex);
+    do_free(bdom);
+    zdom->backend_data = NULL;
+
+    return 0;
+}
+
+static inline void cq_write(struct zhpeq *zq, uint16_t cmp_index, int status,
+                            const void *result, size_t result_len)
+{
+    struct shm_conn     *conn = zq->backend_data;
+    uint32_t            qmask = zq->info.qlen - 1;
+    union zhpe_hw_cq_entry *cqe = zq->cq + (conn->cq_pend & qmask);
+
+    /* The valid bit is set by cq_flush(). */
+    cqe->entry.index = cmp_index;
+    cqe->entry.status = (status < 0 ? ZHPEQ_CQ_STATUS_FABRIC_UNRECOVERABLE :
+                         ZHPEQ_CQ_STATUS_SUCCESS);
+    if (result_len)
+        memcpy(cqe->entry.result.data, result, result_len);
+    conn->cq_pend++;
+}
+
+static inline void cq_flush(struct zhpeq *zq)
+{
+    struct zhpe_hw_reg *reg = zq->reg;
+    struct shm_conn     *conn = zq->backend_data;
+    uint32_t            qmask = zq->info.qlen - 1;
+    uint32_t            cq_tail = conn->cq_tail;
+
+    if (cq_tail == conn->cq_pend)
+        return;
+    smp_wmb_wb();
+    for (; cq_tail != conn->cq_pend; cq_tail++)
+        zq->cq[cq_tail & qmask].entry.valid = cq_valid(cq_tail, qmask);
+    conn->cq_tail = cq_tail;
+    reg->cq_tail  = (cq_tail & qmask);
+}
+
+#define ATOMIC_OPS(_bits)                                               \
+static int atomic##_bits(uint16_t opcode, uint##_bits##_t *p,           \
+                         uint##_bits##_t op0, uint##_bits##_t op1,      \
+                         uint##_bits##_t *result)                       \
+{                                                                       \
+    uint##_bits##_t     old;                                            \
+    uint##_bits##_t     new;                                            \
+                                                                        \
+    switch (opcode) {                                                   \
+                                                                        \
+    case ZHPE_HW_OPCODE_ATM_SWAP:                                       \
+        *result = __atomic_exchange_n(p, op0, __ATOMIC_SEQ_CST);        \
+        return 0;                                                       \
+                                                                        \
+    case ZHPE_HW_OPCODE_ATM_ADD:                                        \
+        *result = __atomic_fetch_add(p, op0, __ATOMIC_SEQ_CST);         \
+        return 0;                                                       \
+                                                                        \
+    case ZHPE_HW_OPCODE_ATM_AND:                                        \
+        *result = __atomic_fetch_and(p, op0, __ATOMIC_SEQ_CST);         \
+        return 0;                                                       \
+                                                                        \
+    case ZHPE_HW_OPCODE_ATM_OR:                                         \
+        *result = __atomic_fetch_or(p, op0, __ATOMIC_SEQ_CST);          \
+        return 0;                                                       \
+                                                                        \
+    case ZHPE_HW_OPCODE_ATM_XOR:                                        \
+        *result = __atomic_fetch_xor(p, op0, __ATOMIC_SEQ_CST);         \
+        return 0;                                                       \
+                                                                        \
+    case ZHPE_HW_OPCODE_ATM_CAS:                                        \
+        /* operands[1] is the compare value, like FI_CSWAP. */          \
+        old = op1;                                                      \
+        (void)__atomic_compare_exchange_n(p, &old, op0, false,          \
+                                          __ATOMIC_SEQ_CST,             \
+                                          __ATOMIC_SEQ_CST);            \
+        *result = old;                                                  \
+        return 0;                                                       \
+                                                                        \
+    case ZHPE_HW_OPCODE_ATM_SMIN:                                       \
+    case ZHPE_HW_OPCODE_ATM_SMAX:                                       \
+    case ZHPE_HW_OPCODE_ATM_UMIN:                                       \
+    case ZHPE_HW_OPCODE_ATM_UMAX:                                       \
+        for (old = __atomic_load_n(p, __ATOMIC_SEQ_CST);;) {            \
+            switch (opcode) {                                           \
+            case ZHPE_HW_OPCODE_ATM_SMIN:                               \
+                new = ((int##_bits##_t)op0 < (int##_bits##_t)old ?      \
+                       op0 : old);                                      \
+                break;                                                  \
+            case ZHPE_HW_OPCODE_ATM_SMAX:                               \
+                new = ((int##_bits##_t)op0 > (int##_bits##_t)old ?      \
+                       op0 : old);                                      \
+                break;                                                  \
+            case ZHPE_HW_OPCODE_ATM_UMIN:                               \
+                new = (op0 < old ? op0 : old);                          \
+                break;                                                  \
+            default:                                                    \
+                new = (op0 > old ? op0 : old);                          \
+                break;                                                  \
+            }                                                           \
+            if (new == old ||                                           \
+                __atomic_compare_exchange_n(p, &old, new, false,        \
+                                            __ATOMIC_SEQ_CST,           \
+                                            __ATOMIC_SEQ_CST))          \
+                break;                                                  \
+        }                                                               \
+        *result = old;                                                  \
+        return 0;                                                       \
+                                                                        \
+    default:                                                            \
+        return -EINVAL;                                                 \
+    }                                                                   \
+}
+
+ATOMIC_OPS(32)
+ATOMIC_OPS(64)
+
+/* The target address must lie in a region registered for remote access. */
+static bool mr_check(struct shm_dom *bdom, uint64_t addr, size_t len)
+{
+    bool                ret = false;
+    struct shm_mr       *smr;
+    struct zhpeq_key_data *kdata;
+
+    mutex_lock(&bdom->mr_mutex);
+    STAILQ_FOREACH(smr, &bdom->mr_list, list) {
+        kdata = &smr->desc.kdata;
+        if (addr >= kdata->vaddr && addr + len <= kdata->vaddr + kdata->len &&
+            (kdata->access & (ZHPEQ_MR_GET_REMOTE | ZHPEQ_MR_PUT_REMOTE)) ==
+            (ZHPEQ_MR_GET_REMOTE | ZHPEQ_MR_PUT_REMOTE)) {
+            ret = true;
+            break;
+        }
+    }
+    mutex_unlock(&bdom->mr_mutex);
+
+    return ret;
+}
+
+/* Do an atomic another engine has placed in our mailbox. */
+static void mbox_serve(struct zhpeq *zq)
+{
+    struct shm_conn     *conn = zq->backend_data;
+    struct shm_mbox     *mbox = conn->mbox;
+    int                 status;
+
+    if (atomic_load_lazy_uint32(&mbox->req_seq) == mbox->rsp_seq)
+        return;
+    smp_rmb();
+
+    status = -EFAULT;
+    if ((mbox->addr & (mbox->size - 1)) ||
+        !mr_check(zq->zdom->backend_data, mbox->addr, mbox->size))
+        goto done;
+    if (mbox->size == sizeof(uint64_t))
+        status = atomic64(mbox->opcode, TO_PTR(mbox->addr),
+                          mbox->operands[0].u64, mbox->operands[1].u64,
+                          &mbox->result.u64);
+    else
+        status = atomic32(mbox->opcode, TO_PTR(mbox->addr),
+                          mbox->operands[0].u32, mbox->operands[1].u32,
+                          &mbox->result.u32);
+ done:
+    mbox->status = status;
+    smp_wmb();
+    atomic_store_lazy_uint32(&mbox->rsp_seq, mbox->req_seq);
+}
+
+struct mbox_wait {
+    struct timespec     ts_beg;
+    struct timespec     ts_check;
+};
+
+static inline bool pid_dead(pid_t pid)
+{
+    return (kill(pid, 0) == -1 && errno == ESRCH);
+}
+
+/*
+ * Called while spinning on a mailbox; < 0 if we must give up: the queue
+ * is being freed, the wait timed out, or the target died. Returns 1 if
+ * the lock's owner, if any, has died and may be taken over.
+ */
+static int mbox_wait_check(struct shm_conn *conn, struct mbox_wait *wait,
+                           pid_t target, pid_t owner)
+{
+    int                 ret;
+    struct timespec     ts_now;
+
+    if (conn->halt)
+        return -ECANCELED;
+    ret = gettime_raw(&ts_now);
+    if (ret < 0)
+        return ret;
+    if (ts_delta(&wait->ts_check, &ts_now) < MBOX_CHECK_NS)
+        return 0;
+    wait->ts_check = ts_now;
+    if (ts_delta(&wait->ts_beg, &ts_now) >= MBOX_TIMEOUT_NS)
+        return -ETIMEDOUT;
+    if (pid_dead(target))
+        return -ESRCH;
+
+    return (owner && pid_dead(owner));
+}
+
+/*
+ * If we give up holding the lock, it is only released if the target is
+ * gone: a live target may still serve the request and would race with
+ * the next one. The lock then stays ours until this process exits.
+ */
+static int mbox_atomic(struct zhpeq *zq, struct shm_peer *peer,
+                       union zhpe_hw_wq_entry *wqe, uint64_t addr,
+                       union zhpeq_atomic *result)
+{
+    int                 ret;
+    struct shm_conn     *conn = zq->backend_data;
+    struct shm_mbox     *mbox = peer->mbox;
+    struct mbox_wait    wait;
+    uint32_t            owner;
+    uint32_t            seq;
+
+    ret = gettime_raw(&wait.ts_beg);
+    if (ret < 0)
+        return ret;
+    wait.ts_check = wait.ts_beg;
+
+    /* Keep serving our own mailbox while we wait, or two engines
+     * making requests of each other would deadlock.
+     */
+    for (;;) {
+        owner = atomic_load_lazy_uint32(&mbox->lock);
+        if (!owner &&
+            __sync_bool_compare_and_swap(&mbox->lock, 0, conn->pid))
+            break;
+        mbox_serve(zq);
+        ret = mbox_wait_check(conn, &wait, peer->pid, owner);
+        if (ret < 0)
+            return ret;
+        if (ret > 0 &&
+            __sync_bool_compare_and_swap(&mbox->lock, owner, conn->pid))
+            break;
+    }
+    /* An owner that died may have left a request; let it finish. */
+    while (atomic_load_lazy_uint32(&mbox->rsp_seq) != mbox->req_seq) {
+        mbox_serve(zq);
+        ret = mbox_wait_check(conn, &wait, peer->pid, 0);
+        if (ret < 0)
+            goto give_up;
+    }
+
+    mbox->opcode = wqe->hdr.opcode & ~ZHPE_HW_OPCODE_FENCE;
+    mbox->size = (((wqe->atm.size & ZHPE_HW_ATOMIC_SIZE_MASK) ==
+                   ZHPE_HW_ATOMIC_SIZE_64) ?
+                  sizeof(uint64_t) : sizeof(uint32_t));
+    mbox->addr = addr;
+    memcpy(mbox->operands, wqe->atm.operands, sizeof(mbox->operands));
+    seq = mbox->req_seq + 1;
+    smp_wmb();
+    atomic_store_lazy_uint32(&mbox->req_seq, seq);
+    mbox_wake(mbox);
+
+    while (atomic_load_lazy_uint32(&mbox->rsp_seq) != seq) {
+        mbox_serve(zq);
+        ret = mbox_wait_check(conn, &wait, peer->pid, 0);
+        if (ret < 0)
+            goto give_up;
+    }
+    smp_rmb();
+    *result = mbox->result;
+    ret = mbox->status;
+
+    smp_mb();
+    atomic_store_lazy_uint32(&mbox->lock, 0);
+
+    return ret;
+
+ give_up:
+    print_err("%s,%u:atomic to pid %d abandoned:%s\n",
+              __FUNCTION__, __LINE__, peer->pid, strerror(-ret));
+    if (ret == -ESRCH)
+        atomic_store_lazy_uint32(&mbox->lock, 0);
+
+    return ret;
+}
+
+static int wqe_do(struct zhpeq *zq, union zhpe_hw_wq_entry *wqe,
+                  union zhpeq_atomic *result, size_t *result_len)
+{
+    int                 ret = -EINVAL;
+    struct shm_conn     *conn = zq->backend_data;
+    uint16_t            opcode = wqe->hdr.opcode & ~ZHPE_HW_OPCODE_FENCE;
+    struct shm_rkey     *rkey;
+    struct shm_peer     *peer;
+    uint32_t            access;
+    uint64_t            raddr;
+    uint64_t            off;
+    size_t              len;
+    struct iovec        liov;
+    struct iovec        riov;
+    ssize_t             rc;
+
+    *result_len = 0;
+    /* Operations complete in order, so fences need no work. */
+    switch (opcode) {
+
+    case ZHPE_HW_OPCODE_NOP:
+        return 0;
+
+    case ZHPE_HW_OPCODE_PUT:
+    case ZHPE_HW_OPCODE_GET:
+        raddr = wqe->dma.rem_addr;
+        len = wqe->dma.len;
+        liov.iov_base = TO_PTR(wqe->dma.lcl_addr);
+        access = (opcode == ZHPE_HW_OPCODE_PUT ?
+                  ZHPEQ_MR_PUT_REMOTE : ZHPEQ_MR_GET_REMOTE);
+        break;
+
+    case ZHPE_HW_OPCODE_PUTIMM:
+        raddr = wqe->imm.rem_addr;
+        len = wqe->imm.len;
+        if (len > ZHPEQ_IMM_MAX)
+            goto done;
+        liov.iov_base = wqe->imm.data;
+        access = ZHPEQ_MR_PUT_REMOTE;
+        break;
+
+    case ZHPE_HW_OPCODE_GETIMM:
+        raddr = wqe->imm.rem_addr;
+        len = wqe->imm.len;
+        if (len > ZHPEQ_IMM_MAX)
+            goto done;
+        liov.iov_base = result;
+        *result_len = len;
+        access = ZHPEQ_MR_GET_REMOTE;
+        break;
+
+    default:
+        if (opcode < ZHPE_HW_OPCODE_ATM_SWAP ||
+            opcode > ZHPE_HW_OPCODE_ATM_CAS)
+            goto done;
+        raddr = wqe->atm.rem_addr;
+        len = (((wqe->atm.size & ZHPE_HW_ATOMIC_SIZE_MASK) ==
+                ZHPE_HW_ATOMIC_SIZE_64) ?
+               sizeof(uint64_t) : sizeof(uint32_t));
+        access = ZHPEQ_MR_GET_REMOTE | ZHPEQ_MR_PUT_REMOTE;
+        break;
+    }
+
+    if (TO_KEYIDX(raddr) >= conn->rkey_idx.hwm)
+        goto done;
+    rkey = &conn->rkeys[TO_KEYIDX(raddr)];
+    off = TO_ADDR(raddr);
+    ret = -EFAULT;
+    if (off + len > rkey->len)
+        goto done;
+    /* The peer's export decides what may be done to the region. */
+    ret = -EACCES;
+    if ((rkey->access & access) != access)
+        goto done;
+    peer = &conn->peers[rkey->peer];
+    if (!peer->mbox)
+        goto done;
+
+    if (opcode >= ZHPE_HW_OPCODE_ATM_SWAP) {
+        ret = mbox_atomic(zq, peer, wqe, rkey->vaddr + off, result);
+        if (ret >= 0)
+            *result_len = len;
+        goto done;
+    }
+
+    liov.iov_len = len;
+    riov.iov_base = TO_PTR(rkey->vaddr + off);
+    riov.iov_len = len;
+    if (opcode == ZHPE_HW_OPCODE_PUT || opcode == ZHPE_HW_OPCODE_PUTIMM)
+        rc = process_vm_writev(peer->pid, &liov, 1, &riov, 1, 0);
+    else
+        rc = process_vm_readv(peer->pid, &liov, 1, &riov, 1, 0);
+    if (rc == -1) {
+        ret = -errno;
+        print_func_err(__FUNCTION__, __LINE__, "process_vm", "", ret);
+    } else if (rc != len)
+        ret = -EFAULT;
+    else
+        ret = 0;
+
+ done:
+    return ret;
+}
+
+static void *shm_wq_start(void *voidzq)
+{
+    struct zhpeq        *zq = voidzq;
+    struct zhpe_hw_reg  *reg = zq->reg;
+    struct shm_conn     *conn = zq->backend_data;
+    struct shm_mbox     *mbox = conn->mbox;
+    uint16_t            qmask = zq->info.qlen - 1;
+    struct timespec     ts_beg = { 0, 0 };
+    struct timespec     ts_end;
+    uint16_t            wq_head;
+    uint16_t            wq_tail;
+    uint32_t            wake;
+    union zhpe_hw_wq_entry *wqe;
+    union {
+        union zhpeq_atomic atm;
+        struct zhpeq_result imm;
+    }                   result;
+    size_t              result_len;
+    bool                busy;
+    int                 rc;
+
+    for (wq_head = reg->wq_head;;) {
+        if (conn->halt)
+            break;
+
+        wake = atomic_load_lazy_uint32(&mbox->wake);
+        smp_rmb();
+        if (atomic_load_lazy_ptr((void **)&STAILQ_FIRST(&conn->ctl_list))) {
+            mutex_lock(&conn->mutex);
+            ctl_run(conn);
+            mutex_unlock(&conn->mutex);
+        }
+        mbox_serve(zq);
+        for (busy = false, wq_tail = reg->wq_tail; wq_head != wq_tail;
+             wq_head = (wq_head + 1) & qmask) {
+            wqe = zq->wq + wq_head;
+            rc = wqe_do(zq, wqe, &result.atm, &result_len);
+            cq_write(zq, wqe->hdr.cmp_index, rc, &result, result_len);
+            busy = true;
+        }
+        cq_flush(zq);
+        reg->wq_head = wq_head;
+
+        rc = gettime_raw(&ts_end);
+        if (rc < 0)
+            break;
+        if (busy)
+            ts_beg = ts_end;
+        if (ts_delta(&ts_beg, &ts_end) < SLEEP_THRESHOLD_NS)
+            continue;
+
+        /* Sleep until a local commit or a remote request bumps wake. */
+        atomic_store_lazy_uint32(&mbox->sleeping, 1);
+        smp_mb();
+        if (reg->wq_tail == wq_head &&
+            atomic_load_lazy_uint32(&mbox->req_seq) == mbox->rsp_seq &&
+            !atomic_load_lazy_ptr((void **)&STAILQ_FIRST(&conn->ctl_list)) &&
+            !conn->halt) {
+            ZHPEQ_TIMING_UPDATE_COUNT(&zhpeq_timing_tx_sleep);
+            (void)futex_wait(&mbox->wake, wake);
+        }
+        atomic_store_lazy_uint32(&mbox->sleeping, 0);
+        rc = gettime_raw(&ts_beg);
+        if (rc < 0)
+            break;
+    }
+
+    mutex_lock(&conn->mutex);
+    conn->thread_exited = true;
+    ctl_run(conn);
+    mutex_unlock(&conn->mutex);
+
+    return NULL;
+}
+
+static int shm_qfree(struct zhpeq *zq)
+{
+    int                 ret = 0;
+    struct shm_conn     *conn;
+    uint32_t            i;
+
+    if (!zq || !zq->backend_data)
+        goto done;
+    conn = zq->backend_data;
+
+    if (conn->thread_started) {
+        conn->halt = true;
+        mbox_wake(conn->mbox);
+        ret = -pthread_join(conn->wq_thread, NULL);
+        if (ret < 0)
+            print_func_err(__FUNCTION__, __LINE__, "pthread_join", "wq", ret);
+    }
+    if (conn->peers) {
+        for (i = 0; i < conn->peer_idx.hwm; i++) {
+            if (conn->peers[i].mbox)
+                munmap(conn->peers[i].mbox, sizeof(*conn->peers[i].mbox));
+        }
+    }
+    if (conn->mbox) {
+        munmap(conn->mbox, sizeof(*conn->mbox));
+        shm_unlink(conn->mbox_name);
+    }
+    do_free(conn->peers);
+    do_free(conn->rkeys);
+    do_free(conn->peer_idx.free);
+    do_free(conn->rkey_idx.free);
+    cond_destroy(&conn->ctl_cond);
+    mutex_destroy(&conn->mutex);
+    do_free(conn);
+    zq->backend_data = NULL;
+
+ done:
+    return ret;
+}
+
+static struct shm_mbox *mbox_map(const char *name, bool create)
+{
+    struct shm_mbox     *ret = NULL;
+    int                 fd;
+    int                 rc;
+
+    fd = shm_open(name, (create ? O_CREAT | O_EXCL | O_RDWR : O_RDWR), 0600);
+    if (fd == -1) {
+        rc = -errno;
+        print_func_err(__FUNCTION__, __LINE__, "shm_open", name, rc);
+        goto done;
+    }
+    if (create && ftruncate(fd, sizeof(*ret)) == -1) {
+        rc = -errno;
+        print_func_err(__FUNCTION__, __LINE__, "ftruncate", name, rc);
+        goto done;
+    }
+    ret = mmap(NULL, sizeof(*ret), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ret == MAP_FAILED) {
+        rc = -errno;
+        print_func_err(__FUNCTION__, __LINE__, "mmap", name, rc);
+        ret = NULL;
+    }
+
+ done:
+    if (fd != -1)
+        close(fd);
+    if (!ret && create)
+        shm_unlink(name);
+
+    return ret;
+}
+
+static int shm_qalloc(struct zhpeq_dom *zdom, struct zhpeq *zq)
+{
+    int                 ret = -ENOMEM;
+    struct shm_conn     *conn;
+
+    conn = zq->backend_data = do_calloc(1, sizeof(*conn));
+    if (!conn)
+        goto done;
+    mutex_init(&conn->mutex, NULL);
+    cond_init(&conn->ctl_cond, NULL);
+    STAILQ_INIT(&conn->ctl_list);
+    conn->pid = getpid();
+    conn->peers = do_calloc(SHM_PEER_MAX, sizeof(*conn->peers));
+    /* Large enough that calloc() leaves untouched entries unbacked. */
+    conn->rkeys = do_calloc(SHM_RKEY_MAX, sizeof(*conn->rkeys));
+    if (!conn->peers || !conn->rkeys)
+        goto done;
+    ret = shm_index_init(&conn->peer_idx, SHM_PEER_MAX);
+    if (ret < 0)
+        goto done;
+    ret = shm_index_init(&conn->rkey_idx, SHM_RKEY_MAX);
+    if (ret < 0)
+        goto done;
+
+    ret = -EEXIST;
+    snprintf(conn->mbox_name, sizeof(conn->mbox_name), SHM_NAME_FMT,
+             getpid(), __sync_fetch_and_add(&mbox_count, 1));
+    conn->mbox = mbox_map(conn->mbox_name, true);
+    if (!conn->mbox)
+        goto done;
+
+    ret = -pthread_create(&conn->wq_thread, NULL, shm_wq_start, zq);
+    if (ret < 0) {
+        print_func_err(__FUNCTION__, __LINE__, "pthread_create", "wq", ret);
+        goto done;
+    }
+    conn->thread_started = true;
+
+ done:
+    return ret;
+}
+
+static int shm_open_peer(struct zhpeq *zq, int sock_fd)
+{
+    int                 ret;
+    struct shm_conn     *conn = zq->backend_data;
+    struct shm_addr     addr;
+    struct shm_mbox     *mbox;
+
+    memset(&addr, 0, sizeof(addr));
+    strncpy(addr.boot_id, boot_id, sizeof(addr.boot_id) - 1);
+    strncpy(addr.mbox_name, conn->mbox_name, sizeof(addr.mbox_name) - 1);
+    addr.pid = htobe32(getpid());
+    ret = sock_send_blob(sock_fd, &addr, sizeof(addr));
+    if (ret < 0)
+        goto done;
+    ret = sock_recv_fixed_blob(sock_fd, &addr, sizeof(addr));
+    if (ret < 0)
+        goto done;
+    addr.boot_id[sizeof(addr.boot_id) - 1] = '\0';
+    addr.mbox_name[sizeof(addr.mbox_name) - 1] = '\0';
+
+    /* Same boot ID, same kernel: the peer is on this host. */
+    if (strcmp(addr.boot_id, boot_id)) {
+        ret = -EHOSTUNREACH;
+        print_err("%s,%u:peer is not on this host\n", __FUNCTION__, __LINE__);
+        goto done;
+    }
+    mbox = mbox_map(addr.mbox_name, false);
+    if (!mbox) {
+        ret = -ENOENT;
+        goto done;
+    }
+
+    mutex_lock(&conn->mutex);
+    ret = shm_index_alloc(&conn->peer_idx);
+    if (ret >= 0) {
+        conn->peers[ret].pid = be32toh(addr.pid);
+        conn->peers[ret].mbox = mbox;
+    }
+    mutex_unlock(&conn->mutex);
+    if (ret < 0)
+        munmap(mbox, sizeof(*mbox));
+
+ done:
+    return ret;
+}
+
+static int shm_close(struct zhpeq *zq, int open_idx)
+{
+    struct shm_conn     *conn = zq->backend_data;
+
+    if (open_idx < 0)
+        return -EINVAL;
+
+    return ctl_op(conn, SHM_CTL_CLOSE, open_idx);
+}
+
+static int shm_wq_signal(struct zhpeq *zq)
+{
+    struct shm_conn     *conn = zq->backend_data;
+
+    mbox_wake(conn->mbox);
+
+    return 0;
+}
+
+static int shm_mr_reg(struct zhpeq_dom *zdom,
+                      const void *buf, size_t len,
+                      uint32_t access, struct zhpeq_key_data **kdata_out)
+{
+    int                 ret = -ENOMEM;
+    struct shm_dom      *bdom = zdom->backend_data;
+    struct shm_mr       *smr;
+
+    smr = do_malloc(sizeof(*smr));
+    if (!smr)
+        goto done;
+    smr->desc.hdr.magic = ZHPE_MAGIC;
+    smr->desc.hdr.version = ZHPE_MR_V1;
+    smr->desc.kdata.vaddr = (uintptr_t)buf;
+    smr->desc.kdata.zaddr = (uintptr_t)buf;
+    smr->desc.kdata.len = len;
+    smr->desc.kdata.access = access;
+    smr->desc.kdata.key = 0;
+    mutex_lock(&bdom->mr_mutex);
+    STAILQ_INSERT_TAIL(&bdom->mr_list, smr, list);
+    mutex_unlock(&bdom->mr_mutex);
+    *kdata_out = &smr->desc.kdata;
+    ret = 0;
+
+ done:
+    return ret;
+}
+
+static int shm_mr_free(struct zhpeq_dom *zdom, struct zhpeq_key_data *kdata)
+{
+    int                 ret = -EINVAL;
+    struct shm_dom      *bdom = zdom->backend_data;
+    struct shm_mr       *smr = container_of(kdata, struct shm_mr, desc.kdata);
+
+    if (smr->desc.hdr.magic != ZHPE_MAGIC ||
+        smr->desc.hdr.version != ZHPE_MR_V1)
+        goto done;
+
+    mutex_lock(&bdom->mr_mutex);
+    STAILQ_REMOVE(&bdom->mr_list, smr, shm_mr, list);
+    mutex_unlock(&bdom->mr_mutex);
+    do_free(smr);
+    ret = 0;
+
+ done:
+    return ret;
+}
+
+static int shm_zmmu_import(struct zhpeq *zq, int open_idx,
+                           const void *blob, size_t blob_len,
+                           struct zhpeq_key_data **kdata_out)
+{
+    int                 ret = -EINVAL;
+    struct shm_conn     *conn = zq->backend_data;
+    const struct key_data_packed *pdata = blob;
+    struct zhpe_mr_desc_v1 *desc = NULL;
+    struct shm_rkey     *rkey;
+
+    if (blob_len != sizeof(*pdata) || open_idx < 0 ||
+        open_idx >= conn->peer_idx.hwm)
+        goto done;
+
+    ret = -ENOMEM;
+    desc = do_malloc(sizeof(*desc));
+    if (!desc)
+        goto done;
+    desc->hdr.magic = ZHPE_MAGIC;
+    desc->hdr.version = ZHPE_MR_V1 | ZHPE_MR_REMOTE;
+    desc->kdata.vaddr = be64toh(pdata->vaddr);
+    desc->kdata.len = be64toh(pdata->len);
+    desc->kdata.access = pdata->access;
+    desc->kdata.key = 0;
+
+    mutex_lock(&conn->mutex);
+    ret = shm_index_alloc(&conn->rkey_idx);
+    mutex_unlock(&conn->mutex);
+    if (ret < 0)
+        goto done;
+    rkey = &conn->rkeys[ret];
+    rkey->vaddr = desc->kdata.vaddr;
+    rkey->len = desc->kdata.len;
+    rkey->peer = open_idx;
+    rkey->access = desc->kdata.access;
+    desc->kdata.zaddr = ((uint64_t)ret << KEY_SHIFT);
+    *kdata_out = &desc->kdata;
+    ret = 0;
+
+ done:
+    if (ret < 0)
+        do_free(desc);
+
+    return ret;
+}
+
+static int shm_zmmu_free(struct zhpeq *zq, struct zhpeq_key_data *kdata)
+{
+    int                 ret = -EINVAL;
+    struct shm_conn     *conn = zq->backend_data;
+    struct zhpe_mr_desc_v1 *desc = container_of(kdata, struct zhpe_mr_desc_v1,
+                                                kdata);
+    uint32_t            index = TO_KEYIDX(kdata->zaddr);
+
+    if (desc->hdr.magic != ZHPE_MAGIC ||
+        desc->hdr.version != (ZHPE_MR_V1 | ZHPE_MR_REMOTE))
+        goto done;
+
+    ret = ctl_op(conn, SHM_CTL_RKEY_FREE, index);
+    if (ret < 0)
+        goto done;
+    do_free(desc);
+
+ done:
+    return ret;
+}
+
+static int shm_zmmu_export(struct zhpeq *zq,
+                           const struct zhpeq_key_data *kdata,
+                           void **blob_out, size_t *blob_len)
+{
+    int                 ret = -EINVAL;
+    struct zhpe_mr_desc_v1 *desc = container_of(kdata, struct zhpe_mr_desc_v1,
+                                                kdata);
+    struct key_data_packed *blob = NULL;
+
+    if (desc->hdr.magic != ZHPE_MAGIC || desc->hdr.version != ZHPE_MR_V1)
+        goto done;
+
+    ret = -ENOMEM;
+    *blob_len = sizeof(*blob);
+    blob = do_malloc(*blob_len);
+    if (!blob)
+        goto done;
+    blob->vaddr = htobe64(kdata->vaddr);
+    blob->len = htobe64(kdata->len);
+    blob->access = kdata->access;
+    *blob_out = blob;
+
+    ret = 0;
+
+ done:
+    return ret;
+}
+
+static void shm_print_info(struct zhpeq *zq)
+{
+    printf("shm backend: same-host peers only\n");
+}
+
+struct backend_ops shm_ops = {
+    .lib_init           = shm_lib_init,
+    .domain             = shm_domain,
+    .domain_free        = shm_domain_free,
+    .qalloc             = shm_qalloc,
+    .qfree              = shm_qfree,
+    .open               = shm_open_peer,
+    .close              = shm_close,
+    .wq_signal          = shm_wq_signal,
+    .mr_reg             = shm_mr_reg,
+    .mr_free            = shm_mr_free,
+    .zmmu_import        = shm_zmmu_import,
+    .zmmu_free          = shm_zmmu_free,
+    .zmmu_export        = shm_zmmu_export,
+    .print_info         = shm_print_info,
+};
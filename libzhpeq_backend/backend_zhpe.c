@@ -0,0 +1,292 @@
+/*
+ * Copyright (C) 2017-2018 Hewlett Packard Enterprise Development LP.
+ * All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Emulated bridge: the helper's data movers poll the queues the driver
+ * hands out and do the transfers, so there is no engine in the process.
+ * Keys are assigned by the helper and are only meaningful on this node.
+ */
+
+#include <internal.h>
+
+#include <endian.h>
+
+#define ZHPE_BOOT_ID    "/proc/sys/kernel/random/boot_id"
+
+struct key_data_packed {
+    uint64_t            key;
+    uint64_t            vaddr;
+    uint64_t            len;
+    uint8_t             access;
+} __attribute__((packed));
+
+struct zhpe_conn {
+    uint32_t            n_open;
+};
+
+static char             boot_id[40];
+
+static int zhpe_lib_init(void)
+{
+    int                 ret;
+    int                 fd;
+    ssize_t             len;
+
+    fd = open(ZHPE_BOOT_ID, O_RDONLY);
+    if (fd == -1) {
+        ret = -errno;
+        print_func_err(__FUNCTION__, __LINE__, "open", ZHPE_BOOT_ID, ret);
+        goto done;
+    }
+    len = read(fd, boot_id, sizeof(boot_id) - 1);
+    ret = (len < 0 ? -errno : 0);
+    close(fd);
+    if (ret < 0) {
+        print_func_err(__FUNCTION__, __LINE__, "read", ZHPE_BOOT_ID, ret);
+        goto done;
+    }
+    boot_id[len] = '\0';
+
+ done:
+    return ret;
+}
+
+static int zhpe_domain(const union zhpeq_backend_params *params,
+                       struct zhpeq_dom *zdom)
+{
+    return 0;
+}
+
+static int zhpe_domain_free(struct zhpeq_dom *zdom)
+{
+    return 0;
+}
+
+static int zhpe_qalloc(struct zhpeq_dom *zdom, struct zhpeq *zq)
+{
+    zq->backend_data = do_calloc(1, sizeof(struct zhpe_conn));
+
+    return (zq->backend_data ? 0 : -ENOMEM);
+}
+
+static int zhpe_qfree(struct zhpeq *zq)
+{
+    if (zq) {
+        do_free(zq->backend_data);
+        zq->backend_data = NULL;
+    }
+
+    return 0;
+}
+
+static int zhpe_open(struct zhpeq *zq, int sock_fd)
+{
+    int                 ret;
+    struct zhpe_conn    *conn = zq->backend_data;
+    char                peer_id[sizeof(boot_id)];
+
+    ret = sock_send_blob(sock_fd, boot_id, sizeof(boot_id));
+    if (ret < 0)
+        goto done;
+    ret = sock_recv_fixed_blob(sock_fd, peer_id, sizeof(peer_id));
+    if (ret < 0)
+        goto done;
+    peer_id[sizeof(peer_id) - 1] = '\0';
+    if (strcmp(peer_id, boot_id)) {
+        ret = -EHOSTUNREACH;
+        print_err("%s,%u:peer is not on this node\n", __FUNCTION__, __LINE__);
+        goto done;
+    }
+    ret = __sync_fetch_and_add(&conn->n_open, 1) & INT32_MAX;
+
+ done:
+    return ret;
+}
+
+static int zhpe_close(struct zhpeq *zq, int open_idx)
+{
+    return 0;
+}
+
+static int zhpe_mr_reg(struct zhpeq_dom *zdom,
+                       const void *buf, size_t len,
+                       uint32_t access, struct zhpeq_key_data **kdata_out)
+{
+    int                 ret = -ENOMEM;
+    struct zhpe_mr_desc_v1 *desc = NULL;
+    union zhpe_op       op;
+    union zhpe_req      *req = &op.req;
+    union zhpe_rsp      *rsp = &op.rsp;
+
+    desc = do_malloc(sizeof(*desc));
+    if (!desc)
+        goto done;
+
+    req->hdr.opcode = ZHPE_OP_MR_REG;
+    memset(&req->mr_reg.kdata, 0, sizeof(req->mr_reg.kdata));
+    req->mr_reg.kdata.vaddr = (uintptr_t)buf;
+    req->mr_reg.kdata.len = len;
+    req->mr_reg.kdata.access = access;
+    ret = zhpe_driver_cmd(&op, sizeof(req->mr_reg), sizeof(rsp->mr_reg));
+    if (ret < 0)
+        goto done;
+    *desc = rsp->mr_reg.desc.v1;
+    *kdata_out = &desc->kdata;
+
+ done:
+    if (ret < 0)
+        do_free(desc);
+
+    return ret;
+}
+
+static int zhpe_mr_free(struct zhpeq_dom *zdom, struct zhpeq_key_data *kdata)
+{
+    int                 ret = -EINVAL;
+    struct zhpe_mr_desc_v1 *desc = container_of(kdata, struct zhpe_mr_desc_v1,
+                                                kdata);
+    union zhpe_op       op;
+    union zhpe_req      *req = &op.req;
+    union zhpe_rsp      *rsp = &op.rsp;
+
+    if (desc->hdr.magic != ZHPE_MAGIC || desc->hdr.version != ZHPE_MR_V1)
+        goto done;
+
+    req->hdr.opcode = ZHPE_OP_MR_DEREG;
+    req->mr_dereg.desc.v1 = *desc;
+    ret = zhpe_driver_cmd(&op, sizeof(req->mr_dereg), sizeof(rsp->mr_dereg));
+    do_free(desc);
+
+ done:
+    return ret;
+}
+
+static int zhpe_zmmu_import(struct zhpeq *zq, int open_idx,
+                            const void *blob, size_t blob_len,
+                            struct zhpeq_key_data **kdata_out)
+{
+    int                 ret = -EINVAL;
+    const struct key_data_packed *pdata = blob;
+    struct zhpe_mr_desc_v1 *desc;
+
+    if (blob_len != sizeof(*pdata))
+        goto done;
+
+    ret = -ENOMEM;
+    desc = do_malloc(sizeof(*desc));
+    if (!desc)
+        goto done;
+    desc->hdr.magic = ZHPE_MAGIC;
+    desc->hdr.version = ZHPE_MR_V1 | ZHPE_MR_REMOTE;
+    desc->kdata.key = be64toh(pdata->key);
+    desc->kdata.vaddr = be64toh(pdata->vaddr);
+    desc->kdata.len = be64toh(pdata->len);
+    desc->kdata.access = pdata->access;
+    desc->kdata.zaddr = (desc->kdata.key << ZHPE_KEY_SHIFT);
+    *kdata_out = &desc->kdata;
+    ret = 0;
+
+ done:
+    return ret;
+}
+
+static int zhpe_zmmu_free(struct zhpeq *zq, struct zhpeq_key_data *kdata)
+{
+    int                 ret = -EINVAL;
+    struct zhpe_mr_desc_v1 *desc = container_of(kdata, struct zhpe_mr_desc_v1,
+                                                kdata);
+
+    if (desc->hdr.magic != ZHPE_MAGIC ||
+        desc->hdr.version != (ZHPE_MR_V1 | ZHPE_MR_REMOTE))
+        goto done;
+
+    do_free(desc);
+    ret = 0;
+
+ done:
+    return ret;
+}
+
+static int zhpe_zmmu_export(struct zhpeq *zq,
+                            const struct zhpeq_key_data *kdata,
+                            void **blob_out, size_t *blob_len)
+{
+    int                 ret = -EINVAL;
+    struct zhpe_mr_desc_v1 *desc = container_of(kdata, struct zhpe_mr_desc_v1,
+                                                kdata);
+    struct key_data_packed *blob = NULL;
+
+    if (desc->hdr.magic != ZHPE_MAGIC || desc->hdr.version != ZHPE_MR_V1)
+        goto done;
+
+    ret = -ENOMEM;
+    *blob_len = sizeof(*blob);
+    blob = do_malloc(*blob_len);
+    if (!blob)
+        goto done;
+    blob->key = htobe64(kdata->key);
+    blob->vaddr = htobe64(kdata->vaddr);
+    blob->len = htobe64(kdata->len);
+    blob->access = kdata->access;
+    *blob_out = blob;
+
+    ret = 0;
+
+ done:
+    return ret;
+}
+
+static void zhpe_print_info(struct zhpeq *zq)
+{
+    printf("zhpe backend: emulated by the helper, same-node peers only\n");
+}
+
+struct backend_ops zhpe_ops = {
+    .lib_init           = zhpe_lib_init,
+    .domain             = zhpe_domain,
+    .domain_free        = zhpe_domain_free,
+    .qalloc             = zhpe_qalloc,
+    .qfree              = zhpe_qfree,
+    .open               = zhpe_open,
+    .close              = zhpe_close,
+    .mr_reg             = zhpe_mr_reg,
+    .mr_free            = zhpe_mr_free,
+    .zmmu_import        = zhpe_zmmu_import,
+    .zmmu_free          = zhpe_zmmu_free,
+    .zmmu_export        = zhpe_zmmu_export,
+    .print_info         = zhpe_print_info,
+};
@@ -38,7 +38,10 @@
 
 #include <zhpeq_util.h>
 
+#include <inttypes.h>
 #include <libgen.h>
+#include <limits.h>
+#include <sched.h>
 
 const char              *appname = "libzhpeq_util";
 size_t                  page_size;
@@ -246,34 +249,72 @@ char *get_cpuinfo_val(FILE *fp, char *buf, size_t buf_size,
     return ret;
 }
 
-static uint64_t __get_tsc_freq(void)
+/*
+ * TSC calibration: ZHPEQ_TSC_FREQ overrides everything; otherwise the
+ * frequency comes from the driver (set_tsc_freq()), from a cache file,
+ * or from measuring the TSC against CLOCK_MONOTONIC_RAW on a spread of
+ * CPUs. The cache, ZHPEQ_TSC_CACHE or zhpeq_tsc in $XDG_CACHE_HOME or
+ * $HOME/.cache, is keyed by the CPU model and the boot ID, so the
+ * measurement is done once per boot; a cache file not owned by us, or
+ * writable by others, is ignored. The nominal frequency from
+ * /proc/cpuinfo is the last resort.
+ */
+#define TSC_FREQ_ENV    "ZHPEQ_TSC_FREQ"
+#define TSC_CACHE_ENV   "ZHPEQ_TSC_CACHE"
+#define TSC_CACHE_FILE  "zhpeq_tsc"
+#define TSC_BOOT_ID     "/proc/sys/kernel/random/boot_id"
+#define TSC_CAL_CPUS    (8)
+#define TSC_CAL_NSEC    (25000000UL)
+#define TSC_CAL_PAIRS   (5)
+#define TSC_CAL_PPM     (1000)
+
+struct zhpeq_tsc        zhpeq_tsc;
+
+static uint64_t tsc_freq_env(void)
 {
-    uint64_t            ret = 0;
-    FILE                *fp = NULL;
-    const char          *fname_info = "/proc/cpuinfo";
-    const char          *fname_freq =
-        "/sys/devices/system/cpu/cpu0/cpufreq/cpuinfo_max_freq";
-    bool                intel = false;
-    const char          *fname;
+    uint64_t            ret;
+    const char          *env;
+    char                *endp;
+
+    env = getenv(TSC_FREQ_ENV);
+    if (!env)
+        return 0;
+    errno = 0;
+    ret = strtoull(env, &endp, 0);
+    if (errno || *endp != '\0' || !ret) {
+        print_err("%s,%u:Ignoring %s=%s\n",
+                  __FUNCTION__, __LINE__, TSC_FREQ_ENV, env);
+        ret = 0;
+    }
+
+    return ret;
+}
+
+/*
+ * Model name of the CPU and whether the TSC runs at a constant rate
+ * through P- and C-states; returns false if cpuinfo can't be read.
+ */
+static bool tsc_cpuinfo(char *model, size_t model_size, bool *invariant)
+{
+    bool                ret = false;
+    const char          *fname = "/proc/cpuinfo";
+    FILE                *fp;
     char                buf[1024];
     char                *sval;
     char                *tok;
-    char                *endp;
-    uint64_t            val1;
-    uint64_t            val2;
     uint                i;
 
-    fname = fname_info;
+    *invariant = false;
     fp = fopen(fname, "r");
     if (!fp) {
         print_func_err(__FUNCTION__, __LINE__, "fopen", fname, errno);
         goto done;
     }
-    /* We only handle Intel, for now */
-    sval = get_cpuinfo_val(fp, buf, sizeof(buf), 1, "vendor_id", NULL);
+    sval = get_cpuinfo_val(fp, buf, sizeof(buf), 0, "model", "name", NULL);
     if (!sval)
         goto done;
-    intel = !strcmp(sval, "GenuineIntel");
+    sval[strcspn(sval, "\n")] = '\0';
+    snprintf(model, model_size, "%s", sval);
 
     /* We need "constant_tsc" and "nonstop_tsc" in flags. */
     sval = get_cpuinfo_val(fp, buf, sizeof(buf), 0, "flags", NULL);
@@ -288,32 +329,290 @@ static uint64_t __get_tsc_freq(void)
         if (i == 3)
             break;
     }
-    if (!tok) {
-        print_err("%s:CPU missing constant_tsc/nonstop_tsc", __FUNCTION__);
-        goto done;
+    *invariant = (i == 3);
+    ret = true;
+
+ done:
+    if (fp) {
+        if (ferror(fp)) {
+            print_err("%s,%u:Error reading %s\n",
+                      __FUNCTION__, __LINE__, fname);
+            ret = false;
+        }
+        fclose(fp);
+    }
+
+    return ret;
+}
+
+/* Cache key: model and boot ID, one per line. */
+static bool tsc_cache_key(const char *model, char *key, size_t key_size)
+{
+    bool                ret = false;
+    FILE                *fp;
+    char                boot_id[64];
+
+    fp = fopen(TSC_BOOT_ID, "r");
+    if (!fp) {
+        print_func_err(__FUNCTION__, __LINE__, "fopen", TSC_BOOT_ID, errno);
+        return false;
+    }
+    if (fgets(boot_id, sizeof(boot_id), fp)) {
+        boot_id[strcspn(boot_id, "\n")] = '\0';
+        ret = (snprintf(key, key_size, "%s\n%s\n", model, boot_id) <
+               key_size);
+    }
+    fclose(fp);
+
+    return ret;
+}
+
+/* False if there is nowhere private to keep the cache. */
+static bool tsc_cache_name(char *fname, size_t fname_size)
+{
+    const char          *env = getenv(TSC_CACHE_ENV);
+    const char          *home;
+    int                 len;
+
+    if (env) {
+        len = snprintf(fname, fname_size, "%s", env);
+        return (len < fname_size);
+    }
+    env = getenv("XDG_CACHE_HOME");
+    if (env && env[0] == '/')
+        len = snprintf(fname, fname_size, "%s", env);
+    else {
+        home = getenv("HOME");
+        if (!home || home[0] != '/')
+            return false;
+        len = snprintf(fname, fname_size, "%s/.cache", home);
+    }
+    if (len >= fname_size)
+        return false;
+    if (mkdir(fname, 0700) == -1 && errno != EEXIST) {
+        print_func_err(__FUNCTION__, __LINE__, "mkdir", fname, errno);
+        return false;
+    }
+    len = snprintf(fname + len, fname_size - len, "/%s", TSC_CACHE_FILE);
+
+    return (len < fname_size);
+}
+
+static uint64_t tsc_cache_read(const char *fname, const char *key)
+{
+    uint64_t            ret = 0;
+    size_t              key_len = strlen(key);
+    FILE                *fp;
+    struct stat         st;
+    char                buf[1024];
+    size_t              len;
+    char                *endp;
+
+    fp = fopen(fname, "r");
+    if (!fp) {
+        if (errno != ENOENT)
+            print_func_err(__FUNCTION__, __LINE__, "fopen", fname, errno);
+        return 0;
+    }
+    /* Anyone else could have written any frequency. */
+    if (fstat(fileno(fp), &st) == -1 || !S_ISREG(st.st_mode) ||
+        st.st_uid != getuid() || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+        print_err("%s,%u:Ignoring %s: not ours or not private\n",
+                  __FUNCTION__, __LINE__, fname);
+        fclose(fp);
+        return 0;
+    }
+    len = fread(buf, 1, sizeof(buf) - 1, fp);
+    buf[len] = '\0';
+    /* A stale key just means measuring again. */
+    if (len > key_len && !strncmp(buf, key, key_len)) {
+        errno = 0;
+        ret = strtoull(buf + key_len, &endp, 10);
+        if (errno || *endp != '\n')
+            ret = 0;
+    }
+    fclose(fp);
+
+    return ret;
+}
+
+/* Write a new file and rename it, so readers never see a partial one. */
+static void tsc_cache_write(const char *fname, const char *key,
+                            uint64_t freq)
+{
+    char                tmp[PATH_MAX];
+    FILE                *fp;
+    int                 fd;
+    bool                ok;
+
+    if (snprintf(tmp, sizeof(tmp), "%s.%d", fname, (int)getpid()) >=
+        sizeof(tmp))
+        return;
+    /* The directory may be shared; don't follow anyone's symlink. */
+    fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd == -1) {
+        print_func_err(__FUNCTION__, __LINE__, "open", tmp, errno);
+        return;
+    }
+    fp = fdopen(fd, "w");
+    if (!fp) {
+        print_func_err(__FUNCTION__, __LINE__, "fdopen", tmp, errno);
+        close(fd);
+        unlink(tmp);
+        return;
+    }
+    ok = (fprintf(fp, "%s%" PRIu64 "\n", key, freq) > 0);
+    ok = (fclose(fp) == 0 && ok);
+    if (ok && rename(tmp, fname) == -1) {
+        print_func_err(__FUNCTION__, __LINE__, "rename", fname, errno);
+        ok = false;
+    }
+    if (!ok)
+        unlink(tmp);
+}
+
+/*
+ * Read the TSC and the raw clock together: the read with the tightest
+ * pair of rdtscps around it wins and the TSC is taken at its middle.
+ */
+static int tsc_clock_pair(struct timespec *ts, uint64_t *cycles)
+{
+    int                 ret;
+    struct timespec     ts_tmp;
+    uint64_t            best = UINT64_MAX;
+    uint64_t            beg;
+    uint64_t            end;
+    uint                i;
+
+    for (i = 0; i < TSC_CAL_PAIRS; i++) {
+        beg = get_cycles(NULL);
+        ret = gettime_raw(&ts_tmp);
+        end = get_cycles(NULL);
+        if (ret < 0)
+            return ret;
+        if (end - beg < best) {
+            best = end - beg;
+            *ts = ts_tmp;
+            *cycles = beg + best / 2;
+        }
     }
 
-    /*
-     * Once we know nonstop_tsc exists, we could measure the frequency,
-     * but I don't want to slow down application launch to
-     * measure it. Measure it once, perhaps, at package install? Not today.
-     *
-     * For Intel, the TSC seems to use the listed frequency for the CPU.
-     * On real hardware, the /proc/cpuinfo "model name" gives you 3 digit
-     * accuracy and /sys/devices/system/cpu/cpu0/cpufreq/cpuinfo_max_freq,
-     * if available, gives you at least 4, it seems.
-     */
-    tok = NULL;
-    if (intel) {
-        sval = get_cpuinfo_val(fp, buf, sizeof(buf), 0, "model", "name", NULL);
-        if (!sval)
+    return 0;
+}
+
+static uint64_t tsc_measure_cpu(void)
+{
+    struct timespec     ts_beg;
+    struct timespec     ts_end;
+    struct timespec     ts_sleep = { .tv_nsec = TSC_CAL_NSEC };
+    uint64_t            cyc_beg;
+    uint64_t            cyc_end;
+    uint64_t            nsec;
+
+    if (tsc_clock_pair(&ts_beg, &cyc_beg) < 0)
+        return 0;
+    while (nanosleep(&ts_sleep, &ts_sleep) == -1 && errno == EINTR)
+        continue;
+    if (tsc_clock_pair(&ts_end, &cyc_end) < 0)
+        return 0;
+    nsec = ts_delta(&ts_beg, &ts_end);
+    if (!nsec || cyc_end <= cyc_beg)
+        return 0;
+
+    return ((unsigned __int128)(cyc_end - cyc_beg) * 1000000000UL) / nsec;
+}
+
+/*
+ * Measure on up to TSC_CAL_CPUS CPUs spread across our affinity mask;
+ * fail if any rate differs from the first by more than TSC_CAL_PPM.
+ * The result is the mean, rounded to kHz.
+ */
+static uint64_t tsc_measure(void)
+{
+    uint64_t            ret = 0;
+    uint64_t            total = 0;
+    uint64_t            first = 0;
+    cpu_set_t           saved;
+    cpu_set_t           cpus;
+    uint64_t            freq;
+    uint                ncpus;
+    uint                step;
+    uint                n;
+    uint                i;
+    uint                j;
+
+    if (sched_getaffinity(0, sizeof(saved), &saved) == -1) {
+        print_func_err(__FUNCTION__, __LINE__, "sched_getaffinity", "",
+                       errno);
+        return 0;
+    }
+    ncpus = CPU_COUNT(&saved);
+    step = (ncpus + TSC_CAL_CPUS - 1) / TSC_CAL_CPUS;
+    for (i = 0, j = 0, n = 0; i < CPU_SETSIZE && j < ncpus; i++) {
+        if (!CPU_ISSET(i, &saved) || j++ % step)
+            continue;
+        CPU_ZERO(&cpus);
+        CPU_SET(i, &cpus);
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) == -1) {
+            print_func_err(__FUNCTION__, __LINE__, "sched_setaffinity", "",
+                           errno);
+            goto done;
+        }
+        freq = tsc_measure_cpu();
+        if (!freq)
+            goto done;
+        if (!n)
+            first = freq;
+        else if ((freq > first ? freq - first : first - freq) >
+                 first / (1000000 / TSC_CAL_PPM)) {
+            print_err("%s,%u:TSC rate on cpu %u %" PRIu64
+                      " differs from %" PRIu64 "\n",
+                      __FUNCTION__, __LINE__, i, freq, first);
             goto done;
-        while ((tok = strsep(&sval, cpuinfo_delim))) {
-            if (strcmp(tok, "@"))
-                continue;
-            tok = strsep(&sval, cpuinfo_delim);
-            break;
         }
+        total += freq;
+        n++;
+    }
+    if (n)
+        ret = (total / n + 500) / 1000 * 1000;
+
+ done:
+    if (sched_setaffinity(0, sizeof(saved), &saved) == -1)
+        print_func_err(__FUNCTION__, __LINE__, "sched_setaffinity", "",
+                       errno);
+
+    return ret;
+}
+
+/*
+ * The frequency the CPU advertises. For Intel, the TSC seems to use the
+ * listed frequency for the CPU. On real hardware, the /proc/cpuinfo
+ * "model name" gives you 3 digit accuracy and
+ * /sys/devices/system/cpu/cpu0/cpufreq/cpuinfo_max_freq, if available,
+ * gives you at least 4, it seems. Both are wrong with turbo, underclocking
+ * and virtualization, so this is used only if measuring fails.
+ */
+static uint64_t tsc_freq_nominal(const char *model)
+{
+    uint64_t            ret = 0;
+    FILE                *fp = NULL;
+    const char          *fname =
+        "/sys/devices/system/cpu/cpu0/cpufreq/cpuinfo_max_freq";
+    char                buf[1024];
+    char                *sval;
+    char                *tok;
+    char                *endp;
+    uint64_t            val1;
+    uint64_t            val2;
+    uint                i;
+
+    snprintf(buf, sizeof(buf), "%s", model);
+    sval = buf;
+    while ((tok = strsep(&sval, cpuinfo_delim))) {
+        if (strcmp(tok, "@"))
+            continue;
+        tok = strsep(&sval, cpuinfo_delim);
+        break;
     }
     if (tok) {
         errno = 0;
@@ -335,9 +634,7 @@ static uint64_t __get_tsc_freq(void)
             val1 *= 10;
         ret = val1;
     }
-    fclose(fp);
 
-    fname = fname_freq;
     fp = fopen(fname, "r");
     if (fp) {
         if (!fgets(buf, sizeof(buf), fp))
@@ -351,11 +648,9 @@ static uint64_t __get_tsc_freq(void)
         if (errno || *endp != '\0')
             goto done;
         ret = val1;
-    } else if (!fp) {
-        if (errno != ENOENT) {
-            print_func_err(__FUNCTION__, __LINE__, "fopen", fname, errno);
-            goto done;
-        }
+    } else if (errno != ENOENT) {
+        print_func_err(__FUNCTION__, __LINE__, "fopen", fname, errno);
+        goto done;
     }
 
 done:
@@ -371,9 +666,89 @@ done:
     return ret;
 }
 
+static uint64_t __get_tsc_freq(void)
+{
+    uint64_t            ret;
+    char                model[256];
+    char                key[512];
+    char                fname[PATH_MAX];
+    bool                invariant;
+    bool                cache;
+
+    ret = tsc_freq_env();
+    if (ret)
+        return ret;
+
+    if (!tsc_cpuinfo(model, sizeof(model), &invariant))
+        return 0;
+    if (!invariant) {
+        print_err("%s:CPU missing constant_tsc/nonstop_tsc", __FUNCTION__);
+        return 0;
+    }
+
+    cache = (tsc_cache_key(model, key, sizeof(key)) &&
+             tsc_cache_name(fname, sizeof(fname)));
+    if (cache) {
+        ret = tsc_cache_read(fname, key);
+        if (ret)
+            return ret;
+    }
+    ret = tsc_measure();
+    if (ret) {
+        if (cache)
+            tsc_cache_write(fname, key, ret);
+        return ret;
+    }
+
+    return tsc_freq_nominal(model);
+}
+
+/*
+ * The largest mult, up to shift 32, for which maxsec seconds of cycles
+ * times mult fit in 64 bits; the kernel's clocks_calc_mult_shift().
+ */
+static void calc_mult_shift(uint32_t *mult, uint32_t *shift,
+                            uint64_t from, uint64_t to, uint32_t maxsec)
+{
+    uint64_t            tmp;
+    uint32_t            sft;
+    uint32_t            sftacc = 32;
+
+    for (tmp = ((uint64_t)maxsec * from) >> 32; tmp; tmp >>= 1)
+        sftacc--;
+    for (sft = 32; sft > 0; sft--) {
+        tmp = ((uint64_t)to << sft) + from / 2;
+        tmp /= from;
+        if (!(tmp >> sftacc))
+            break;
+    }
+    *mult = tmp;
+    *shift = sft;
+}
+
+static void tsc_conv_set(uint64_t freq, uint32_t mult, uint32_t shift)
+{
+    if (!mult)
+        calc_mult_shift(&mult, &shift, freq, 1000000000UL, 600);
+    zhpeq_tsc.mult = mult;
+    zhpeq_tsc.shift = shift;
+    /* freq last: it says the rest is valid. */
+    smp_wmb();
+    zhpeq_tsc.freq = freq;
+}
+
+void set_tsc_freq(uint64_t freq, uint32_t mult, uint32_t shift)
+{
+    /* The environment wins over any calibration. */
+    if (tsc_freq_env())
+        (void)get_tsc_freq();
+    else
+        tsc_conv_set(freq, mult, shift);
+}
+
 uint64_t get_tsc_freq(void)
 {
-    static uint64_t     freq = 0;
+    uint64_t            freq = zhpeq_tsc.freq;
 
     if (!freq) {
         freq = __get_tsc_freq();
@@ -382,6 +757,7 @@ uint64_t get_tsc_freq(void)
                       __FUNCTION__, __LINE__);
             abort();
         }
+        tsc_conv_set(freq, 0, 0);
     }
 
     return freq;
@@ -290,6 +290,7 @@ int fab_conn_free(struct fab_conn *conn)
 
     fab_mrmem_free(&conn->mrmem);
     FI_CLOSE(conn->ep);
+    FI_CLOSE(conn->sep);
     FI_CLOSE(conn->pep);
     FI_CLOSE(conn->rx_cq);
     FI_CLOSE(conn->tx_cq);
@@ -574,6 +575,112 @@ int _fab_ep_setup(const char *callf, uint line,
     return ret;
 }
 
+int _fab_sep_setup(const char *callf, uint line, struct fab_conn *conn,
+                   size_t tx_ctx_cnt, size_t rx_size)
+{
+    int                 ret = -EEXIST;
+    struct fi_cq_attr   rx_cq_attr =  {
+        .format = FI_CQ_FORMAT_CONTEXT,
+        .wait_obj = FI_WAIT_NONE,
+    };
+    struct fi_av_attr   av_attr = { .type = FI_AV_TABLE };
+
+    if (conn->info->ep_attr->type != FI_EP_RDM ||
+        conn->info->domain_attr->max_ep_tx_ctx < tx_ctx_cnt) {
+        ret = -FI_ENOSYS;
+        goto done;
+    }
+    conn->info->ep_attr->tx_ctx_cnt = tx_ctx_cnt;
+    conn->info->ep_attr->rx_ctx_cnt = 1;
+    rx_size = (rx_size ?: conn->info->rx_attr->size);
+    conn->info->rx_attr->size = rx_size;
+    rx_cq_attr.size = rx_size;
+
+    ret = fi_scalable_ep(conn->domain, conn->info, &conn->sep, NULL);
+    if (ret < 0) {
+	print_func_fi_err(callf, line, "fi_scalable_ep", "", ret);
+	goto done;
+    }
+    ret = fi_av_open(conn->domain, &av_attr, &conn->av, NULL);
+    if (ret < 0) {
+        print_func_fi_err(callf, line, "fi_av_open", "", ret);
+        goto done;
+    }
+    ret = fi_scalable_ep_bind(conn->sep, &conn->av->fid, 0);
+    if (ret < 0) {
+        print_func_fi_err(callf, line, "fi_scalable_ep_bind", "av", ret);
+        goto done;
+    }
+    ret = fi_enable(conn->sep);
+    if (ret < 0) {
+	print_func_fi_err(callf, line, "fi_enable", "sep", ret);
+	goto done;
+    }
+    ret = fi_rx_context(conn->sep, 0, NULL, &conn->ep, NULL);
+    if (ret < 0) {
+	print_func_fi_err(callf, line, "fi_rx_context", "", ret);
+	goto done;
+    }
+    ret = fi_cq_open(conn->domain, &rx_cq_attr, &conn->rx_cq, NULL);
+    if (ret < 0) {
+        print_func_fi_err(callf, line, "fi_cq_open", "rx", ret);
+        goto done;
+    }
+    ret = fi_ep_bind(conn->ep, &conn->rx_cq->fid, FI_RECV);
+    if (ret < 0) {
+        print_func_fi_err(callf, line, "fi_ep_bind", "rx_cq", ret);
+        goto done;
+    }
+    ret = fi_enable(conn->ep);
+    if (ret < 0) {
+	print_func_fi_err(callf, line, "fi_enable", "rx", ret);
+	goto done;
+    }
+
+ done:
+    return ret;
+}
+
+int _fab_sep_tx_setup(const char *callf, uint line,
+                      struct fab_conn *sep_conn, struct fab_conn *conn,
+                      int idx, size_t tx_size)
+{
+    int                 ret = -EEXIST;
+    struct fi_cq_attr   tx_cq_attr =  {
+        .format = FI_CQ_FORMAT_CONTEXT,
+        .wait_obj = FI_WAIT_NONE,
+    };
+
+    tx_size = (tx_size ?: conn->info->tx_attr->size);
+    conn->info->tx_attr->size = tx_size;
+    tx_cq_attr.size = tx_size;
+
+    ret = fi_tx_context(sep_conn->sep, idx, conn->info->tx_attr, &conn->ep,
+                        NULL);
+    if (ret < 0) {
+	print_func_fi_err(callf, line, "fi_tx_context", "", ret);
+	goto done;
+    }
+    ret = fi_cq_open(conn->domain, &tx_cq_attr, &conn->tx_cq, NULL);
+    if (ret < 0) {
+        print_func_fi_err(callf, line, "fi_cq_open", "tx", ret);
+        goto done;
+    }
+    ret = fi_ep_bind(conn->ep, &conn->tx_cq->fid, FI_TRANSMIT);
+    if (ret < 0) {
+        print_func_fi_err(callf, line, "fi_ep_bind", "tx_cq", ret);
+        goto done;
+    }
+    ret = fi_enable(conn->ep);
+    if (ret < 0) {
+	print_func_fi_err(callf, line, "fi_enable", "tx", ret);
+	goto done;
+    }
+
+ done:
+    return ret;
+}
+
 int _fab_eq_cm_event(const char *callf, uint line,
                      struct fab_conn *conn, int timeout, uint32_t expected,
                      struct fi_eq_cm_entry *entry)
@@ -850,7 +957,9 @@ int _fab_av_xchg_addr(const char *callf, uint line, struct fab_conn *conn,
     int                 ret;
     size_t              addr_len = sizeof(*ep_addr);
 
-    ret = fi_getname(&conn->ep->fid, ep_addr, &addr_len);
+    /* A scalable endpoint has one address for all its contexts. */
+    ret = fi_getname((conn->sep ? &conn->sep->fid : &conn->ep->fid),
+                     ep_addr, &addr_len);
     if (ret >= 0 && !sockaddr_valid(ep_addr, addr_len, true))
         ret = -EAFNOSUPPORT;
     if (ret < 0) {
@@ -870,6 +979,40 @@ int _fab_av_xchg_addr(const char *callf, uint line, struct fab_conn *conn,
     return ret;
 }
 
+int _fab_av_xchg_addr_many(const char *callf, uint line,
+                           struct fab_conn *conn, size_t count,
+                           const int *sock_fds, union sockaddr_in46 *ep_addrs)
+{
+    int                 ret;
+    union sockaddr_in46 ep_addr;
+    size_t              addr_len = sizeof(ep_addr);
+    size_t              i;
+
+    ret = fi_getname((conn->sep ? &conn->sep->fid : &conn->ep->fid),
+                     &ep_addr, &addr_len);
+    if (ret >= 0 && !sockaddr_valid(&ep_addr, addr_len, true))
+        ret = -EAFNOSUPPORT;
+    if (ret < 0) {
+        print_func_fi_err(callf, line, "fi_getname", "", ret);
+        goto done;
+    }
+    /* All the sends first, so the peers can make progress concurrently. */
+    for (i = 0; i < count; i++) {
+        ret = _sock_send_blob(callf, line, sock_fds[i], &ep_addr, addr_len);
+        if (ret < 0)
+            goto done;
+    }
+    for (i = 0; i < count; i++) {
+        ret = _sock_recv_fixed_blob(callf, line, sock_fds[i], &ep_addrs[i],
+                                    addr_len);
+        if (ret < 0)
+            goto done;
+    }
+
+ done:
+    return ret;
+}
+
 struct xchg_retry_args {
     struct timespec     ts_beg;
     uint64_t            timeout_ns;
@@ -932,31 +1075,52 @@ int _fab_av_xchg(const char *callf, uint line, struct fab_conn *conn,
 
 int _fab_av_insert(const char *callf, uint line, struct fab_conn *conn,
                    union sockaddr_in46 *saddr, fi_addr_t *fi_addr)
+{
+    return _fab_av_insert_many(callf, line, conn, saddr, 1, fi_addr);
+}
+
+int _fab_av_insert_many(const char *callf, uint line, struct fab_conn *conn,
+                        union sockaddr_in46 *saddrs, size_t count,
+                        fi_addr_t *fi_addrs)
 {
     int                 ret;
+    size_t              i;
 
-    ret = fi_av_insert(conn->av, saddr, 1,  fi_addr, 0, NULL);
+    ret = fi_av_insert(conn->av, saddrs, count, fi_addrs, 0, NULL);
     if (ret < 0) {
 	print_func_fi_err(callf, line, "fi_av_insert", "", ret);
         goto done;
-    } else if (!_expected_saw(callf, line, "fi_av_insert", 1, ret)) {
+    } else if (!_expected_saw(callf, line, "fi_av_insert", count, ret)) {
+        /* Remove the ones that did succeed. */
+        for (i = 0; i < count; i++) {
+            if (fi_addrs[i] != FI_ADDR_NOTAVAIL)
+                (void)fi_av_remove(conn->av, &fi_addrs[i], 1, 0);
+        }
         ret = -FI_EINVAL;
         goto done;
     }
 
  done:
-    if (ret < 0)
-        *fi_addr = FI_ADDR_UNSPEC;
+    if (ret < 0) {
+        for (i = 0; i < count; i++)
+            fi_addrs[i] = FI_ADDR_UNSPEC;
+    }
 
     return ret;
 }
 
 int _fab_av_remove(const char *callf, uint line, struct fab_conn *conn,
                    fi_addr_t idx)
+{
+    return _fab_av_remove_many(callf, line, conn, &idx, 1);
+}
+
+int _fab_av_remove_many(const char *callf, uint line, struct fab_conn *conn,
+                        fi_addr_t *fi_addrs, size_t count)
 {
     int                 ret;
 
-    ret = fi_av_remove(conn->av, &idx, 1, 0);
+    ret = fi_av_remove(conn->av, fi_addrs, count, 0);
     if (ret < 0)
 	print_func_fi_err(callf, line, "fi_av_remove", "", ret);
 
@@ -35,6 +35,7 @@
  */
 
 #include <zhpe.h>
+#include <zhpeq.h>
 #include <zhpeq_util.h>
 
 #include <poll.h>
@@ -48,11 +49,13 @@ static void usage(bool help)
 {
     print_usage(
         help,
-        "Usage:%s [-p] <count>\n"
+        "Usage:%s [-p|-r] [-b <batch>] <count>\n"
         "<count> is the number of no-ops to send\n"
         "<count> may be postfixed with [kmgtKMGT] to specify the"
         " base units.\n"
-        "-p : use polling\n",
+        "-b : send and receive up to <batch> no-ops per syscall\n"
+        "-p : use polling\n"
+        "-r : use libzhpeq's control ring\n",
         appname);
 
     exit(255);
@@ -102,6 +105,38 @@ static int _do_send(const char *callf, uint line, int fd, uint64_t sent)
 #define do_send(_fd, _sent)                             \
     _do_send(__FUNCTION__, __LINE__, _fd, _sent)
 
+static int check_rsp_index(union zhpe_rsp *rsp, uint64_t recv,
+                           bool check_index)
+{
+    int                 ret = -EINVAL;
+
+    if (!expected_saw("version", ZHPE_OP_VERSION, rsp->hdr.version))
+        goto done;
+    if (check_index &&
+        !expected_saw("index", recv & INDEX_MASK, rsp->hdr.index))
+        goto done;
+    if (!expected_saw("opcode", ZHPE_OP_NOP | ZHPE_OP_RESPONSE,
+                      rsp->hdr.opcode))
+        goto done;
+    if (rsp->hdr.status < 0) {
+        print_err("%s,%u:NOP returned %d:%s\n",
+                  __FUNCTION__, __LINE__, -rsp->hdr.status,
+                  strerror(-rsp->hdr.status));
+        goto done;
+    }
+    if (!expected_saw("seq", recv, rsp->nop.seq))
+        goto done;
+
+    ret = 0;
+
+ done:
+
+    return ret;
+}
+
+#define check_rsp(_rsp, _recv)                          \
+    check_rsp_index(_rsp, _recv, true)
+
 static int _do_recv(const char *callf, uint line, int fd, uint64_t recv)
 {
     int                 ret;
@@ -121,24 +156,7 @@ static int _do_recv(const char *callf, uint line, int fd, uint64_t recv)
                          size, false, res, 0);
     if (ret < 0)
         goto done;
-    ret = -EINVAL;
-    if (!expected_saw("version", ZHPE_OP_VERSION, rsp.hdr.version))
-        goto done;
-    if (!expected_saw("index", recv & INDEX_MASK, rsp.hdr.index))
-        goto done;
-    if (!expected_saw("opcode", ZHPE_OP_NOP | ZHPE_OP_RESPONSE,
-                      rsp.hdr.opcode))
-        goto done;
-    if (rsp.hdr.status < 0) {
-        print_err("%s,%u:NOP returned %d:%s\n",
-                  __FUNCTION__, __LINE__, -rsp.hdr.status,
-                  strerror(-rsp.hdr.status));
-        goto done;
-    }
-    if (!expected_saw("seq", recv, rsp.nop.seq))
-        goto done;
-
-    ret = 0;
+    ret = check_rsp(&rsp, recv);
 
  done:
 
@@ -207,12 +225,128 @@ static int pingpong(int fd, uint64_t count)
     return ret;
 }
 
+/*
+ * A write of more than one union zhpe_op slot is a batch; a read with
+ * room for more than one returns as many responses as are ready, in
+ * completion order.
+ */
+static int batched(int fd, uint64_t count, size_t batch)
+{
+    int                 ret = -ENOMEM;
+    union zhpe_op       *ops;
+    uint64_t            sent;
+    uint64_t            seq;
+    uint64_t            n;
+    uint64_t            recv;
+    uint64_t            size;
+    uint64_t            res;
+    size_t              i;
+
+    ops = calloc(batch, sizeof(*ops));
+    if (!ops)
+        goto done;
+
+    for (sent = 0; sent < count; sent += n) {
+        n = count - sent;
+        if (n > batch)
+            n = batch;
+        if (n == 1) {
+            ret = do_send(fd, sent);
+            if (ret < 0)
+                goto done;
+            ret = do_recv(fd, sent);
+            if (ret < 0)
+                goto done;
+            continue;
+        }
+        for (i = 0; i < n; i++) {
+            ops[i].req.hdr.version = ZHPE_OP_VERSION;
+            ops[i].req.hdr.opcode  = ZHPE_OP_NOP;
+            ops[i].req.hdr.index = ((sent + i) & INDEX_MASK);
+            ops[i].req.nop.seq = sent + i;
+        }
+        size = n * sizeof(*ops);
+        res = write(fd, ops, size);
+        ret = check_func_ion(__FUNCTION__, __LINE__, "write", sent,
+                             size, false, res, 0);
+        if (ret < 0)
+            goto done;
+        /* The helper may complete them out of order. */
+        for (recv = 0; recv < n;) {
+            size = batch * sizeof(*ops);
+            res = read(fd, ops, size);
+            if (res == (uint64_t)-1) {
+                ret = -errno;
+                print_func_err(__FUNCTION__, __LINE__, "read", "", ret);
+                goto done;
+            }
+            for (i = 0; i < res / sizeof(*ops); i++, recv++) {
+                seq = (sent & ~(uint64_t)INDEX_MASK) | ops[i].rsp.hdr.index;
+                if (seq < sent)
+                    seq += INDEX_MASK + 1;
+                ret = check_rsp(&ops[i].rsp, seq);
+                if (ret < 0)
+                    goto done;
+            }
+        }
+    }
+    ret = 0;
+
+ done:
+    free(ops);
+
+    return ret;
+}
+
+/*
+ * Through zhpe_driver_cmds(): the ring rewrites the indices, so only
+ * the sequence numbers are checked.
+ */
+static int ring(uint64_t count, size_t batch)
+{
+    int                 ret = -ENOMEM;
+    union zhpe_op       *ops;
+    uint64_t            sent;
+    uint64_t            n;
+    size_t              i;
+
+    ops = calloc(batch, sizeof(*ops));
+    if (!ops)
+        goto done;
+
+    for (sent = 0; sent < count; sent += n) {
+        n = count - sent;
+        if (n > batch)
+            n = batch;
+        for (i = 0; i < n; i++) {
+            ops[i].req.hdr.opcode  = ZHPE_OP_NOP;
+            ops[i].req.nop.seq = sent + i;
+        }
+        ret = zhpe_driver_cmds(ops, n);
+        if (ret < 0)
+            goto done;
+        for (i = 0; i < n; i++) {
+            ret = check_rsp_index(&ops[i].rsp, sent + i, false);
+            if (ret < 0)
+                goto done;
+        }
+    }
+    ret = 0;
+
+ done:
+    free(ops);
+
+    return ret;
+}
+
 int main(int argc, char **argv)
 {
     int                 ret = 1;
     int                 fd = -1;
     const char          *devname = "/dev/" DRIVER_NAME;
     bool                use_polling = false;
+    bool                use_ring = false;
+    uint64_t            batch = 0;
     int                 opt;
     uint64_t            count;
 
@@ -220,16 +354,31 @@ int main(int argc, char **argv)
     if (argc == 1)
         usage(true);
 
-    while ((opt = getopt(argc, argv, "p")) != -1) {
+    while ((opt = getopt(argc, argv, "b:pr")) != -1) {
 
         switch (opt) {
 
+        case 'b':
+            if (batch)
+                usage(false);
+            if (parse_kb_uint64_t(__FUNCTION__, __LINE__, "batch",
+                                  optarg, &batch, 0, 2, SIZE_MAX,
+                                  PARSE_KB | PARSE_KIB) < 0)
+                usage(false);
+            break;
+
         case 'p':
             if (use_polling)
                 usage(false);
             use_polling = true;
             break;
 
+        case 'r':
+            if (use_ring)
+                usage(false);
+            use_ring = true;
+            break;
+
         default:
             usage(false);
 
@@ -244,6 +393,17 @@ int main(int argc, char **argv)
                           argv[optind++], &count, 0, 1, SIZE_MAX,
                           PARSE_KB | PARSE_KIB) < 0)
         usage(false);
+    if ((batch || use_ring) && use_polling)
+        usage(false);
+
+    if (use_ring) {
+        if (zhpeq_init(ZHPEQ_API_VERSION) < 0)
+            goto done;
+        if (ring(count, (batch ?: 1)) < 0)
+            goto done;
+        ret = 0;
+        goto done;
+    }
 
     /* Open zhpe device */
     fd = open(devname, O_RDWR);
@@ -251,7 +411,10 @@ int main(int argc, char **argv)
         print_func_err(__FUNCTION__, __LINE__, "open", devname, errno);
         goto done;
     }
-    if (use_polling) {
+    if (batch) {
+        if (batched(fd, count, batch) < 0)
+            goto done;
+    } else if (use_polling) {
         if (polling(fd, count) < 0)
             goto done;
     } else {
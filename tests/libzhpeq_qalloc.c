@@ -42,6 +42,33 @@ static struct zhpeq_attr   attr;
 
 static void usage(bool help) __attribute__ ((__noreturn__));
 
+/*
+ * Drop the ptes of a driver queue and make its first page read-only: the
+ * rest of the mapping becomes a vma with a larger vm_pgoff and has to
+ * fault the same pages back in.
+ */
+static int split_queue(struct zhpeq *zq, void *q, int prot)
+{
+    int                 ret = 0;
+    size_t              qsize = zq->info.qsize;
+
+    if (zq->qmem_len || qsize < 2 * page_size)
+        goto done;
+    if (prot == PROT_READ && madvise(q, qsize, MADV_DONTNEED) == -1) {
+        ret = -errno;
+        print_func_err(__FUNCTION__, __LINE__, "madvise", "", ret);
+        goto done;
+    }
+    if (mprotect(q, page_size, prot) == -1) {
+        ret = -errno;
+        print_func_err(__FUNCTION__, __LINE__, "mprotect", "", ret);
+        goto done;
+    }
+
+ done:
+    return ret;
+}
+
 static void usage(bool help)
 {
     print_usage(
@@ -209,6 +236,11 @@ int main(int argc, char **argv)
                 zq[i]->info.cq_off + check_off;
         }
     }
+    for (i = 0; i < queues; i++) {
+        if (split_queue(zq[i], zq[i]->wq, PROT_READ) < 0 ||
+            split_queue(zq[i], zq[i]->cq, PROT_READ) < 0)
+            goto done;
+    }
     for (i = 0; i < queues; i++) {
         check_off = page_size - sizeof(ulong);
         if (attr.backend != ZHPEQ_BACKEND_ZHPE
@@ -229,6 +261,11 @@ int main(int argc, char **argv)
                 goto done;
         }
     }
+    for (i = 0; i < queues; i++) {
+        if (split_queue(zq[i], zq[i]->wq, PROT_READ | PROT_WRITE) < 0 ||
+            split_queue(zq[i], zq[i]->cq, PROT_READ | PROT_WRITE) < 0)
+            goto done;
+    }
     /* Free queues: if qlen == 0, free a random 50%. */
     for (i = 0; i < queues; i++) {
         if (!qlen && random_range(0, 1))